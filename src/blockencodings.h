@@ -0,0 +1,226 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+/** Depth from the tip up to which we answer getdata for compact blocks and getblocktxn requests */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+static const int MAX_BLOCKTXN_DEPTH = 10;
+
+/**
+ * Request for the transactions of a compact block we could not find locally.
+ * Indexes are differentially encoded on the wire to keep the message small.
+ */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        s << blockhash;
+        WriteCompactSize(s, indexes.size());
+        for (size_t i = 0; i < indexes.size(); i++) {
+            uint64_t index = indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1));
+            WriteCompactSize(s, index);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        s >> blockhash;
+        uint64_t indexes_size = ReadCompactSize(s);
+        size_t i = 0;
+        while (indexes.size() < indexes_size) {
+            indexes.resize(std::min((uint64_t)(1000 + indexes.size()), indexes_size));
+            for (; i < indexes.size(); i++) {
+                uint64_t index = ReadCompactSize(s);
+                if (index > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("index overflowed 16 bits");
+                indexes[i] = index;
+            }
+        }
+
+        uint16_t offset = 0;
+        for (size_t j = 0; j < indexes.size(); j++) {
+            if (uint64_t(indexes[j]) + uint64_t(offset) > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("indexes overflowed 16 bits");
+            indexes[j] = indexes[j] + offset;
+            offset = indexes[j] + 1;
+        }
+    }
+};
+
+/** Answer to a getblocktxn request: the requested transactions, in order. */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full inside a compact block, with its differentially encoded index. */
+struct PrefilledTransaction {
+    //! Used as an offset since last prefilled tx in CBlockHeaderAndShortTxIDs,
+    //! as a proper transaction-in-block-index in PartiallyDownloadedBlock
+    uint16_t index;
+    CTransaction tx;
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(index) + ::GetSerializeSize(tx, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, index);
+        s << tx;
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        uint64_t idx = ReadCompactSize(s);
+        if (idx > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = idx;
+        s >> tx;
+    }
+};
+
+typedef enum ReadStatus_t {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! Invalid object, peer is sending bogus crap
+    READ_STATUS_FAILED,  //! Failed to process object
+} ReadStatus;
+
+/**
+ * A block announced as its header, block signature, the coinbase and (for
+ * proof-of-stake blocks) the coinstake in full, and 6-byte salted short ids
+ * for every other transaction.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    //! Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        s << header << vchBlockSig << nonce;
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            s << lsb << msb;
+        }
+        s << prefilledtxn;
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        s >> header >> vchBlockSig >> nonce;
+        uint64_t shorttxids_size = ReadCompactSize(s);
+        size_t i = 0;
+        while (shorttxids.size() < shorttxids_size) {
+            shorttxids.resize(std::min((uint64_t)(1000 + shorttxids.size()), shorttxids_size));
+            for (; i < shorttxids.size(); i++) {
+                uint32_t lsb = 0;
+                uint16_t msb = 0;
+                s >> lsb >> msb;
+                shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+            }
+        }
+        s >> prefilledtxn;
+        FillShortTxIDSelector();
+    }
+};
+
+/**
+ * A compact block being reassembled from the memory pool, the orphan
+ * transaction pool and, if needed, a blocktxn answer from the peer.
+ */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> have_txn;
+    size_t prefilled_count, mempool_count, extra_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), extra_count(0), pool(poolIn) {}
+
+    //! extra_txn is a list of extra transactions to look at, in addition to the mempool (e.g. orphans)
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<const CTransaction*>& extra_txn);
+    bool IsTxAvailable(size_t index) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
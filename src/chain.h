@@ -94,6 +94,8 @@ enum BlockStatus {
     BLOCK_FAILED_VALID = 32, //! stage after last reached validness failed
     BLOCK_FAILED_CHILD = 64, //! descends from failed block
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
+
+    BLOCK_FROM_SNAPSHOT = 128, //! block data not stored, its outputs were loaded from a UTXO snapshot
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -147,6 +147,9 @@ public:
 
         nLastPOWBlock = 580000;
 
+        //! Snapshots are added here as (height, (block hash, dumptxoutset content hash))
+        mapUTXOSnapshots.clear();
+
         fRequireRPCPassword = true;
         fRequireStandard = true;
         fTestnetToBeDeprecatedFieldRPC = false;
@@ -204,6 +207,8 @@ public:
 
         nLastPOWBlock = 0x7fffffff;
 
+        mapUTXOSnapshots.clear();
+
         fRequireRPCPassword = true;
         fRequireStandard = false;
         fTestnetToBeDeprecatedFieldRPC = true;
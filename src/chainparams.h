@@ -12,12 +12,16 @@
 #include "protocol.h"
 #include "uint256.h"
 
+#include <map>
 #include <vector>
 
 using namespace std;
 
 typedef unsigned char MessageStartChars[MESSAGE_START_SIZE];
 
+/** Block hash and content hash of the UTXO snapshots trusted for -loadtxoutset, by height */
+typedef std::map<int, std::pair<uint256, uint256> > MapUTXOSnapshots;
+
 
 struct CDNSSeedData {
     std::string name, host;
@@ -74,6 +78,7 @@ public:
     const std::vector<CAddress>& FixedSeeds() const { return vFixedSeeds; }
     int LastPOWBlock() const { return nLastPOWBlock; }
     virtual const Checkpoints::CCheckpointData& Checkpoints() const = 0;
+    const MapUTXOSnapshots& UTXOSnapshots() const { return mapUTXOSnapshots; }
 
 protected:
     CChainParams(){};
@@ -97,6 +102,7 @@ protected:
     std::string strNetworkID;
     CBlock genesis;
     std::vector<CAddress> vFixedSeeds;
+    MapUTXOSnapshots mapUTXOSnapshots;
     bool fRequireRPCPassword;
     bool fRequireStandard;
     bool fTestnetToBeDeprecatedFieldRPC;
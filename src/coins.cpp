@@ -5,6 +5,7 @@
 #include "coins.h"
 #include "random.h"
 
+#include <algorithm>
 #include <assert.h>
 
 /**
@@ -37,7 +38,10 @@ bool CCoins::Spend(const COutPoint& out, CTxInUndo& undo)
         return false;
     if (vout[out.n].IsNull())
         return false;
-    undo = CTxInUndo(vout[out.n]);
+    //! Move the script into the undo data, so spent outputs keep no memory
+    undo = CTxInUndo();
+    undo.txout.nValue = vout[out.n].nValue;
+    undo.txout.scriptPubKey.swap(vout[out.n].scriptPubKey);
     vout[out.n].SetNull();
     Cleanup();
     if (vout.size() == 0) {
@@ -61,6 +65,7 @@ bool CCoins::Spend(int nPos)
 bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
+std::vector<uint256> CCoinsView::GetHeadBlocks() const { return std::vector<uint256>(); }
 bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
 
@@ -70,6 +75,7 @@ CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
 bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { return base->GetCoins(txid, coins); }
 bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
+std::vector<uint256> CCoinsViewBacked::GetHeadBlocks() const { return base->GetHeadBlocks(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
 bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStats(stats); }
@@ -209,6 +215,49 @@ bool CCoinsViewCache::Flush()
     return fOk;
 }
 
+void CCoinsViewCache::CopyDirty(CCoinsMap& mapDirty)
+{
+    assert(!hasModifier);
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoinsCacheEntry& entry = mapDirty[it->first];
+        entry.coins = it->second.coins;
+        entry.flags = it->second.flags;
+        //! Not fresh either: a modifier erases fresh entries once they are spent
+        it->second.flags = 0;
+    }
+}
+
+namespace
+{
+//! Orders cache entries by height, so trimming drops the oldest first
+struct CompareCacheHeight {
+    bool operator()(const std::pair<int, CCoinsMap::iterator>& a, const std::pair<int, CCoinsMap::iterator>& b) const
+    {
+        return a.first < b.first;
+    }
+};
+}
+
+void CCoinsViewCache::Trim(unsigned int nMaxSize)
+{
+    assert(!hasModifier);
+    if (cacheCoins.size() <= nMaxSize)
+        return;
+
+    std::vector<std::pair<int, CCoinsMap::iterator> > vClean;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            vClean.push_back(std::make_pair(it->second.coins.IsPruned() ? -1 : it->second.coins.nHeight, it));
+    }
+    size_t nEvict = std::min(vClean.size(), cacheCoins.size() - nMaxSize);
+    if (nEvict < vClean.size())
+        std::nth_element(vClean.begin(), vClean.begin() + nEvict, vClean.end(), CompareCacheHeight());
+    for (size_t i = 0; i < nEvict; i++)
+        cacheCoins.erase(vClean[i].second);
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -346,9 +346,10 @@ struct CCoinsStats {
     uint64_t nTransactionOutputs;
     uint64_t nSerializedSize;
     uint256 hashSerialized;
+    uint256 hashMuHash;
     CAmount nTotalAmount;
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), hashMuHash(0), nTotalAmount(0) {}
 };
 
 
@@ -366,6 +367,12 @@ public:
     //! Retrieve the block hash whose state this CCoinsView currently represents
     virtual uint256 GetBestBlock() const;
 
+    //! Retrieve the range of blocks that may have been only partially written.
+    //! If the database is in a consistent state, the result is the empty vector.
+    //! Otherwise, a two-element vector is returned consisting of the new and
+    //! the old block hash, in that order.
+    virtual std::vector<uint256> GetHeadBlocks() const;
+
     //! Do a bulk modification (multiple CCoins changes + BestBlock change).
     //! The passed mapCoins can be modified.
     virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
@@ -389,6 +396,7 @@ public:
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
+    std::vector<uint256> GetHeadBlocks() const;
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
@@ -456,6 +464,16 @@ public:
      */
     bool Flush();
 
+    /**
+     * Copy the dirty entries to mapDirty and mark them clean, as if they had been flushed, so they
+     * stay cached while the copies are written to the base view. Until that write is done, no entry
+     * may leave this cache: reading it from the base view would return its old version.
+     */
+    void CopyDirty(CCoinsMap& mapDirty);
+
+    //! Drop clean entries until at most nMaxSize are left: fully spent ones first, then those of the lowest heights
+    void Trim(unsigned int nMaxSize);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
@@ -2114,7 +2114,21 @@ bool CDarkSendSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey, CAm
     CTransaction txVin;
     uint256 hash;
 
-    if (GetTransaction(vin.prevout.hash, txVin, hash, true))
+    bool fFound = GetTransaction(vin.prevout.hash, txVin, hash, true);
+    if (!fFound && fHavePruned)
+    {
+        //! The collateral's block may have been pruned; an unspent collateral is still in the UTXO set
+        LOCK(cs_main);
+        const CCoins* coins = pcoinsTip->AccessCoins(vin.prevout.hash);
+        if (coins) {
+            CMutableTransaction txTmp;
+            txTmp.vout = coins->vout;
+            txVin = txTmp;
+            fFound = true;
+        }
+    }
+
+    if (fFound)
     {
         BOOST_FOREACH (CTxOut out, txVin.vout)
         {
@@ -160,6 +160,28 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+/** SipHash-2-4, used for salted short transaction identifiers. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    uint64_t tmp;
+    int count;
+
+public:
+    //! Construct a SipHash calculator initialized with 128-bit key (k0, k1)
+    CSipHasher(uint64_t k0, uint64_t k1);
+    //! Hash a 64-bit integer worth of data (must be aligned to 8 bytes)
+    CSipHasher& Write(uint64_t data);
+    //! Hash arbitrary bytes
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    //! Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched.
+    uint64_t Finalize() const;
+};
+
+/** Optimized SipHash-2-4 of a single uint256, equivalent to CSipHasher(k0, k1).Write(val).Finalize(). */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
 void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
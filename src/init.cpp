@@ -143,8 +143,9 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
+//! Only dump the mempool once it has been loaded completely, so a short run does not truncate mempool.dat
+static bool fDumpMempoolLater = false;
 
 void Shutdown()
 {
@@ -163,6 +164,8 @@ void Shutdown()
 #endif
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
+    if (fDumpMempoolLater && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
 
     {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -186,6 +189,8 @@ void Shutdown()
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
+        delete ptxindexdb;
+        ptxindexdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -268,6 +273,7 @@ std::string HelpMessage(HelpMessageMode mode)
     //! When adding new options to the categories, please keep and ensure alphabetical ordering.
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
+    strUsage += "  -addrindex             " + strprintf(_("Maintain an index of the outputs received and spent by each address, used by searchrawtransactions and the getaddress* calls; it is built in the background for an existing chain (default: %u)"), DEFAULT_ADDRINDEX) + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -alerts                " + strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS);
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
@@ -283,14 +289,21 @@ std::string HelpMessage(HelpMessageMode mode)
 
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "  -loadtxoutset=<file>   " + _("Start a new node from a UTXO snapshot written by dumptxoutset; it must match a snapshot hash built into the client") + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"),"metrix.pid") + "\n";
 #endif
+    strUsage += "  -prune=<n>             " + strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet rescans and is incompatible with -addrindex. "
+                                                          "Stakes from pruned blocks are still checked from the UTXO set. "
+                                                          "Warning: Reverting this setting requires re-downloading the entire blockchain. "
+                                                          "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024) + "\n";
     strUsage += "  -reindex               " + _("Rebuild blockchain index from current blk000??.dat files") + "\n";
+    strUsage += "  -spentindex            " + strprintf(_("Maintain an index of the input spending each output, used by getspentinfo (default: %u)"), DEFAULT_SPENTINDEX) + "\n";
 #if !defined(WIN32)
     strUsage += "  -sysperms              " + _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)") + "\n";
 #endif
+    strUsage += "  -timestampindex        " + strprintf(_("Maintain an index of the blocks by time, used by getblockhashes (default: %u)"), DEFAULT_TIMESTAMPINDEX) + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
@@ -307,6 +320,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -maxconnections=<n>    " + strprintf(_("Maintain at most <n> connections to peers (default: %u)"),256) + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"),5000) + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"),1000) + "\n";
+    strUsage += "  -maxuploadtarget=<n>   " + strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET) + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)") + "\n";
     strUsage += "  -permitbaremultisig    " + strprintf(_("Relay non-P2SH multisig (default: %u)"),1) + "\n";
     strUsage += "  -port=<port>           " + strprintf(_("Listen for connections on <port> (default: %u)"),33820) + "\n";
@@ -348,6 +362,11 @@ std::string HelpMessage(HelpMessageMode mode)
     if (GetBoolArg("-help-debug", false)) {
         strUsage += "  -checkpoints           " + strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"),1) + "\n";
         strUsage += "  -confchange            " + strprintf(_("Require a confirmations for change (default: %u)"),0) + "\n";
+        strUsage += "  -dbbatchsize=<n>       " + strprintf(_("Maximum database write batch size in bytes (default: %u)"), nDefaultDbBatchSize) + "\n";
+        strUsage += "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+        strUsage += "  -limitancestorsize=<n> " + strprintf(_("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+        strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+        strUsage += "  -limitdescendantsize=<n> " + strprintf(_("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u)."), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
         strUsage += "  -minimizecoinage       " + strprintf(_("Minimize weight consumption (experimental) (default: %u)"),0) + "\n";
         strUsage += "  -regtest               " + _("Enter regression test mode, which uses a special chain in which blocks can be ");
         strUsage += _("solved instantly. This is intended for regression testing tools and app development.") + "\n";
@@ -357,7 +376,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
     strUsage += _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += _("<category> can be:");
-    strUsage += " addrman, alert, bench, db, lock, rand, rpc, selectcoins, mempool, net,";
+    strUsage += " addrman, alert, bench, cmpctblock, db, lock, rand, rpc, selectcoins, mempool, net,";
     strUsage += " coinage, coinstake, creation, stakemodifier";
     if (mode == HMM_BITCOIN_QT) {
         strUsage += ", qt.\n";
@@ -397,9 +416,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -rpcwait               " + _("Wait for RPC server to start") + "\n";
 
     strUsage += "\n" + _("Block sync/database options:") + "\n";
+    strUsage += "  -backgroundflush       " + strprintf(_("Write the coins cache in the background and keep its recent entries cached; the cache then gets half of the coins share of -dbcache and the write in progress the other half (default: %u)"), DEFAULT_BACKGROUND_FLUSH) + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -maxorphantxsize=<n>   " + strprintf(_("Keep at most <n> megabytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
     strUsage += "  -stopafterblockimport  " + strprintf(_("Stop running after importing blocks from disk (default: %u)"),0) + "\n";
     strUsage += "  -synctimeout=<n>       " + strprintf(_("Specify block download timeout in seconds (default: %u)"),60) + "\n";
     strUsage += "  -synctime              " + strprintf(_("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: %u)"),0) + "\n";
@@ -530,6 +554,11 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Initialize Metrix.
@@ -660,6 +689,16 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("AppInit2 : parameter interaction: -zapwallettxes=1 -> setting -rescan=1\n");
     }
 
+    //! block pruning drops the blocks a wallet rescan or an address index build would read
+    if (GetArg("-prune", 0)) {
+        if (GetBoolArg("-addrindex", DEFAULT_ADDRINDEX))
+            return InitError(_("Prune mode is incompatible with -addrindex."));
+#ifdef ENABLE_WALLET
+        if (GetBoolArg("-rescan", false))
+            return InitError(_("Rescans are not possible in pruned mode. You will need to use -reindex which will download the whole blockchain again."));
+#endif
+    }
+
     //! Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 256);
@@ -681,6 +720,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Checkmempool and checkblockindex default to true in regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", Params().DefaultConsistencyChecks()));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().DefaultConsistencyChecks());
+
+    //! mempool limits
+    int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    int64_t nMempoolSizeMin = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000 * 40;
+    if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
+        return InitError(strprintf(_("-maxmempool must be at least %d MB"), (int)std::ceil(nMempoolSizeMin / 1000000.0)));
+
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
     //! -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
@@ -691,6 +737,18 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    //! block pruning; get the amount of disk space (in MiB) to allot for block & undo files
+    int64_t nSignedPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nSignedPruneTarget < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64_t)nSignedPruneTarget;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+        LogPrintf("Prune configured to target %uMiB on disk for block and undo files.\n", nPruneTarget / 1024 / 1024);
+        fPruneMode = true;
+    }
+
     //! Check for -debugnet
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Unsupported argument -debugnet ignored, use -debug=net."));
@@ -837,8 +895,11 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        for (int i = 0; i < nScriptCheckThreads - 1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadTxScriptCheck);
+            threadGroup.create_thread(&ThreadBlockCheck);
+        }
     }
 
     /* Start the RPC server already.  It will be started in "warmup" mode
@@ -932,6 +993,10 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
     }
 
+    if (mapArgs.count("-maxuploadtarget")) {
+        CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET) * 1024 * 1024);
+    }
+
     CService addrProxy;
     bool fProxy = false;
     if (mapArgs.count("-proxy")) {
@@ -1018,6 +1083,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     //! ********************************************************* Step 7: load blockchain
 
     fReindex = GetBoolArg("-reindex", false);
+    fAddressIndex = GetBoolArg("-addrindex", DEFAULT_ADDRINDEX);
+    fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
 
     //! Upgrading to BTC 0.8; hard-link the old blknnnn.dat files into /blocks/
     filesystem::path blocksDir = GetDataDir() / "blocks";
@@ -1055,6 +1123,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nBlockTreeDBCache > (1 << 21) && false)
         nBlockTreeDBCache = (1 << 21); //! block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    size_t nTxIndexDBCache = nBlockTreeDBCache / 2; //! the tx index has its own database, sharing the block tree's part
+    nBlockTreeDBCache -= nTxIndexDBCache;
     size_t nCoinDBCache = nTotalCache / 2; //! use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; //! coins in memory require around 300 bytes
@@ -1074,8 +1144,10 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
+                delete ptxindexdb;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                ptxindexdb = new CTxIndexDB(nTxIndexDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
@@ -1083,11 +1155,43 @@ bool AppInit2(boost::thread_group& threadGroup)
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
 
+                //! Older versions kept the transaction index in the block index
+                if (!pblocktree->MoveTxIndex(*ptxindexdb)) {
+                    strLoadError = _("Error moving the transaction index");
+                    break;
+                }
+
+                //! Coin databases written by older versions have no running UTXO set statistics yet
+                if (!pcoinsdbview->LoadStats()) {
+                    strLoadError = _("Error loading UTXO set statistics");
+                    break;
+                }
+
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
                 }
 
+                bool fLoadingSnapshot = false;
+                pblocktree->ReadFlag("loadingsnapshot", fLoadingSnapshot);
+                if (fLoadingSnapshot) {
+                    strLoadError = _("Loading of a UTXO snapshot was interrupted");
+                    break;
+                }
+
+                //! Start a new node from a UTXO snapshot instead of the genesis block
+                if (mapArgs.count("-loadtxoutset") && !fReindex && mapBlockIndex.empty()) {
+                    uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                    if (!LoadUTXOSnapshot(GetArg("-loadtxoutset", ""))) {
+                        strLoadError = _("Error loading UTXO snapshot");
+                        break;
+                    }
+                    if (!LoadBlockIndex()) {
+                        strLoadError = _("Error loading block database");
+                        break;
+                    }
+                }
+
                 //! If the loaded chain has a wrong genesis, bail out immediately
                 //! (we're likely using a testnet datadir, or the other way around).
                 if (!mapBlockIndex.empty() && mapBlockIndex.count(Params().HashGenesisBlock()) == 0)
@@ -1099,6 +1203,26 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                //! Check for changed -prune state. What we are concerned about is a user who has pruned blocks
+                //! in the past, but is now trying to run unpruned.
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
+                    break;
+                }
+
+                //! The spent and timestamp indexes are only filled as blocks get connected
+                bool fSpentIndexDB = false, fTimestampIndexDB = false;
+                pblocktree->ReadFlag("spentindex", fSpentIndexDB);
+                pblocktree->ReadFlag("timestampindex", fTimestampIndexDB);
+                if (fSpentIndex != fSpentIndexDB) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+                if (fTimestampIndex != fTimestampIndexDB) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -timestampindex");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying block database..."));
                 if (!CVerifyDB().VerifyDB(pcoinsdbview, GetArg("-checklevel", 3), GetArg("-checkblocks", 288))) {
                     strLoadError = _("Corrupted block database detected");
@@ -1143,6 +1267,23 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    //! Before anything gets pruned, so the spends of the reorg window can still be read from their blocks
+    if (!InitStakeMeta())
+        return InitError(_("Error initializing the stake metadata"));
+
+    //! A pruned node can't serve the full chain; drop old block files right away when the target shrank
+    if (fPruneMode) {
+        LogPrintf("Unsetting NODE_NETWORK on prune mode\n");
+        nLocalServices &= ~NODE_NETWORK;
+        if (!fReindex) {
+            uiInterface.InitMessage(_("Pruning blockstore..."));
+            PruneAndFlush();
+        }
+    }
+
+    if (!InitAddressIndex())
+        return InitError(_("Error initializing the address index"));
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     //! Allowed to fail as this file IS missing on first startup.
@@ -1239,6 +1380,16 @@ bool AppInit2(boost::thread_group& threadGroup)
                 pindexRescan = chainActive.Genesis();
         }
         if (chainActive.Tip() != pindexRescan && chainActive.Tip() && pindexRescan && chainActive.Height() > pindexRescan->nHeight) {
+            //! We can't rescan beyond non-pruned blocks, stop and throw an error
+            if (fPruneMode) {
+                CBlockIndex* block = chainActive.Tip();
+                while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && pindexRescan != block)
+                    block = block->pprev;
+
+                if (pindexRescan != block)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
@@ -1288,7 +1439,14 @@ bool AppInit2(boost::thread_group& threadGroup)
         BOOST_FOREACH (string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    threadGroup.create_thread(&ThreadValidationCallbacks);
+    threadGroup.create_thread(boost::bind(&ThreadConnectPipeline, pcoinsdbview));
+    if (GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH))
+        threadGroup.create_thread(boost::bind(&ThreadCoinsFlush, pcoinsdbview));
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    threadGroup.create_thread(&ThreadAddressIndex);
+    if (pcoinsdbview->HasLegacyRecords())
+        threadGroup.create_thread(boost::bind(&ThreadUpgradeCoinsDB, pcoinsdbview));
    if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
@@ -25,6 +25,7 @@ std::map<uint256, CTransaction> mapTxLockReqRejected;
 std::map<uint256, CConsensusVote> mapTxLockVote;
 std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
+CCriticalSection cs_mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //!! track votes with no tx for DOS
 int nCompleteTXLocks;
 
@@ -97,9 +98,12 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
                       pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                       tx.GetHash().ToString().c_str());
 
-            BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+            {
+                LOCK(cs_mapLockedInputs);
+                BOOST_FOREACH (const CTxIn& in, tx.vin) {
+                    if (!mapLockedInputs.count(in.prevout)) {
+                        mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+                    }
                 }
             }
 
@@ -380,6 +384,7 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
 #endif
 
                 if (mapTxLockReq.count(ctx.txHash)) {
+                    LOCK(cs_mapLockedInputs);
                     BOOST_FOREACH (const CTxIn& in, tx.vin) {
                         if (!mapLockedInputs.count(in.prevout)) {
                             mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
@@ -412,6 +417,7 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    LOCK(cs_mapLockedInputs);
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
         if (mapLockedInputs.count(in.prevout)) {
             if (mapLockedInputs[in.prevout] != tx.GetHash()) {
@@ -457,8 +463,11 @@ void CleanTransactionLocksList()
             if (mapTxLockReq.count(it->second.txHash)) {
                 CTransaction& tx = mapTxLockReq[it->second.txHash];
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+                {
+                    LOCK(cs_mapLockedInputs);
+                    BOOST_FOREACH (const CTxIn& in, tx.vin)
+                        mapLockedInputs.erase(in.prevout);
+                }
 
                 mapTxLockReq.erase(it->second.txHash);
                 mapTxLockReqRejected.erase(it->second.txHash);
@@ -29,6 +29,8 @@ extern map<uint256, CTransaction> mapTxLockReqRejected;
 extern map<uint256, CConsensusVote> mapTxLockVote;
 extern map<uint256, CTransactionLock> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
+//! Guards mapLockedInputs, which CheckBlock also reads from the import and block connect threads
+extern CCriticalSection cs_mapLockedInputs;
 extern int nCompleteTXLocks;
 
 
@@ -293,16 +293,13 @@ bool CheckProofOfStake(CValidationState& state, CBlockIndex* pindexPrev, const C
     //! Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    //! Get transaction index for the previous transaction
-    CDiskTxPos postx;
-    if (!pblocktree->ReadTxIndex(txin.prevout.hash, postx))
-        return error("CheckProofOfStake() : tx index not found"); //! tx index not found
-
     //! Read txPrev and header of its block
-    CBlockHeader header;
     uint256 hashBlock;
     CTransaction txPrev;
-    {
+    unsigned int nTimeBlockFrom = 0;
+    CDiskTxPos postx;
+    if (ReadTxIndex(txin.prevout.hash, postx) && !IsBlockFilePruned(postx.nFile)) {
+        CBlockHeader header;
         CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
         try {
             file >> header;
@@ -313,18 +310,24 @@ bool CheckProofOfStake(CValidationState& state, CBlockIndex* pindexPrev, const C
         }
         if (txPrev.GetHash() != txin.prevout.hash)
             return error("%s() : txid mismatch in CheckProofOfStake()", __func__);
+        nTimeBlockFrom = header.GetBlockTime();
+
+        //! First try finding the previous transaction in database
+        if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
+            return error("CheckProofOfStake() : INFO: read txPrev failed");
+    } else {
+        //! Coins from a UTXO snapshot or a pruned block file are rebuilt from the stake metadata or the UTXO set
+        LOCK(cs_main);
+        if (!ReadStakeTxPrev(txin.prevout, txPrev, nTimeBlockFrom))
+            return error("CheckProofOfStake() : tx index not found"); //! tx index not found
     }
 
-    //! First try finding the previous transaction in database
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
-
     //! Verify signature
     CCoins coins(txPrev, 0);
     if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return state.DoS(100, error("CheckProofOfStake() : VerifyScript failed on coinstake %s", tx.GetHash().ToString()));
 
-    if (!CheckStakeKernelHash(pindexPrev, nBits, header.GetBlockTime(), txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(pindexPrev, nBits, nTimeBlockFrom, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
         return state.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", tx.GetHash().ToString(), hashProofOfStake.ToString())); //! may occur during initial download or if behind on block chain sync
 
     return true;
@@ -340,15 +343,12 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 {
     uint256 hashProofOfStake, targetProofOfStake;
 
-    //! Get transaction index for the previous transaction
-    CDiskTxPos postx;
-    if (!pblocktree->ReadTxIndex(prevout.hash, postx))
-        return false;
-
     //! Read txPrev and header of its block
-    CBlockHeader header;
     CTransaction txPrev;
-    {
+    unsigned int nTimeBlockFrom = 0;
+    CDiskTxPos postx;
+    if (ReadTxIndex(prevout.hash, postx) && !IsBlockFilePruned(postx.nFile)) {
+        CBlockHeader header;
         CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
         try {
             file >> header;
@@ -359,13 +359,19 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
         }
         if (txPrev.GetHash() != prevout.hash)
             return false;
+        nTimeBlockFrom = header.GetBlockTime();
+    } else {
+        //! Coins from a UTXO snapshot or a pruned block file are rebuilt from the stake metadata or the UTXO set
+        LOCK(cs_main);
+        if (!ReadStakeTxPrev(prevout, txPrev, nTimeBlockFrom))
+            return false;
     }
 
-    if (header.GetBlockTime() + nStakeMinAge > nTime)
+    if (nTimeBlockFrom + nStakeMinAge > nTime)
         return false; //! only count coins meeting min age requirement
 
     if (pBlockTime)
-        *pBlockTime = header.GetBlockTime();
+        *pBlockTime = nTimeBlockFrom;
 
-    return CheckStakeKernelHash(pindexPrev, nBits, header.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+    return CheckStakeKernelHash(pindexPrev, nBits, nTimeBlockFrom, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
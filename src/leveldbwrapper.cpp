@@ -8,6 +8,9 @@
 
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
+#include <stdarg.h>
+
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
 #include <leveldb/filter_policy.h>
@@ -27,25 +30,74 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+/** Forwards LevelDB's own log, with its compactions and write stalls, to debug.log under -debug=leveldb */
+class CLevelDBLogger : public leveldb::Logger
+{
+public:
+    void Logv(const char* format, va_list ap)
+    {
+        if (!LogAcceptCategory("leveldb"))
+            return;
+        //! Try a stack buffer first, and a large heap buffer for the rare long line
+        char buffer[500];
+        for (int iter = 0; iter < 2; iter++) {
+            char* base;
+            int bufsize;
+            if (iter == 0) {
+                bufsize = sizeof(buffer);
+                base = buffer;
+            } else {
+                bufsize = 30000;
+                base = new char[bufsize];
+            }
+            char* p = base;
+            char* limit = base + bufsize;
+
+            va_list backup_ap;
+            va_copy(backup_ap, ap);
+            p += vsnprintf(p, limit - p, format, backup_ap);
+            va_end(backup_ap);
+
+            if (p >= limit) {
+                if (iter == 0)
+                    continue; //! Try again with larger buffer
+                p = limit - 1;
+            }
+            //! Add newline if necessary
+            if (p == base || p[-1] != '\n')
+                *p++ = '\n';
+            assert(p <= limit);
+            base[std::min(bufsize - 1, (int)(p - base))] = '\0';
+            LogPrintStr(base);
+            if (base != buffer)
+                delete[] base;
+            break;
+        }
+    }
+};
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBProfile& profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; //! up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    size_t nWriteBuffer = nCacheSize / 100 * profile.nWriteBufferPercent;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize - 2 * nWriteBuffer);
+    options.write_buffer_size = nWriteBuffer;
+    options.block_size = profile.nBlockSize;
+    options.filter_policy = profile.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
     options.compression = leveldb::kNoCompression;
     options.max_open_files = 64;
+    options.info_log = new CLevelDBLogger();
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -70,6 +122,8 @@ CLevelDBWrapper::~CLevelDBWrapper()
     pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
+    delete options.info_log;
+    options.info_log = NULL;
     delete options.block_cache;
     options.block_cache = NULL;
     delete penv;
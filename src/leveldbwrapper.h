@@ -24,6 +24,20 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/** How a LevelDB instance is tuned for the way it is used */
+struct CLevelDBProfile {
+    //! Bits per key of the bloom filter that lets point lookups of missing keys skip the tables, 0 for none
+    int nBloomBits;
+    //! Size of the uncompressed blocks read at once; small for point lookups, larger for scans
+    size_t nBlockSize;
+    //! Share of the cache size for each write buffer, in percent. Up to two write buffers may be
+    //! held in memory simultaneously, and the block cache gets what they leave.
+    unsigned int nWriteBufferPercent;
+
+    CLevelDBProfile(int nBloomBitsIn = 10, size_t nBlockSizeIn = 4096, unsigned int nWriteBufferPercentIn = 25)
+        : nBloomBits(nBloomBitsIn), nBlockSize(nBlockSizeIn), nWriteBufferPercent(nWriteBufferPercentIn) {}
+};
+
 //! Batch of changes queued to be written to a CLevelDBWrapper
 class CLevelDBBatch
 {
@@ -31,8 +45,17 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t size_estimate;
 
 public:
+    CLevelDBBatch() : size_estimate(0) {}
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -47,6 +70,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        //! LevelDB serializes writes as:
+        //! - byte: header
+        //! - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        //! - byte[]: key
+        //! - varint: value length
+        //! - byte[]: value
+        //! The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -58,7 +89,15 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        //! LevelDB serializes erases as:
+        //! - byte: header
+        //! - varint: key length
+        //! - byte[]: key
+        //! The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CLevelDBWrapper
@@ -86,19 +125,22 @@ private:
     leveldb::DB* pdb;
 
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBProfile& profile = CLevelDBProfile());
     ~CLevelDBWrapper();
 
+    //! With psnapshot set, the value is read from that view of the database (see GetSnapshot)
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const throw(leveldb_error)
+    bool Read(const K& key, V& value, const leveldb::Snapshot* psnapshot = NULL) const throw(leveldb_error)
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        options.snapshot = psnapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -163,10 +205,41 @@ public:
         return WriteBatch(batch, true);
     }
 
+    //! Value of a LevelDB property such as "leveldb.stats", or false if the property is unknown
+    bool GetProperty(const std::string& strName, std::string& strValue) const
+    {
+        return pdb->GetProperty(strName, &strValue);
+    }
+
+    //! Approximate size on disk of the keys starting with one of the given prefix characters
+    uint64_t GetApproximateSize(char chBegin = '\x00', char chEnd = '\xff') const
+    {
+        std::string strBegin(1, chBegin), strEnd(1, chEnd);
+        strEnd += '\xff';
+        leveldb::Range range(strBegin, strEnd);
+        uint64_t nSize = 0;
+        pdb->GetApproximateSizes(&range, 1, &nSize);
+        return nSize;
+    }
+
+    //! A fixed view of the database for reading with several iterators; release it with ReleaseSnapshot
+    const leveldb::Snapshot* GetSnapshot() const
+    {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot* psnapshot) const
+    {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
+
     //! not exactly clean encapsulation, but it's easiest for now
-    leveldb::Iterator* NewIterator()
+    //! fFillCache is for short range reads that should stay cached, unlike full scans
+    leveldb::Iterator* NewIterator(bool fFillCache = false, const leveldb::Snapshot* psnapshot = NULL)
     {
-        return pdb->NewIterator(iteroptions);
+        leveldb::ReadOptions options = fFillCache ? readoptions : iteroptions;
+        options.snapshot = psnapshot;
+        return pdb->NewIterator(options);
     }
 };
 
@@ -6,9 +6,13 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -65,6 +69,12 @@ bool fImporting = false;
 bool fReindex = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
+bool fTimestampIndex = false;
+bool fHavePruned = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
 
@@ -76,10 +86,25 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nTxSize;
 };
 
 map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+
+struct IteratorComparator {
+    template <typename I>
+    bool operator()(const I& a, const I& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+//! Orphans by each outpoint they spend, so a new transaction only wakes the orphans of its own outputs
+map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> > mapOrphanTransactionsByPrev;
+//! Orphans by the peer that sent them, so disconnects do not have to scan the whole pool
+map<NodeId, set<uint256> > mapOrphanTransactionsByPeer;
+//! Sum of the serialized sizes of all orphans
+size_t nOrphanTransactionsSize = 0;
 
 struct COrphanBlock {
     uint256 hashBlock;
@@ -170,6 +195,7 @@ struct QueuedBlock {
     int64_t nTime;     //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore;  //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, used for compact block reconstruction.
 };
 
 /**
@@ -186,6 +212,12 @@ set<CBlockIndex*> setDirtyBlockIndex;
 
 // Dirty block file entries.
 set<int> setDirtyFileInfo;
+
+/**
+ * Global flag to indicate we should check to see if there are block/undo files that should be deleted.
+ * Set on startup or if we allocate more file space when we're in prune mode.
+ */
+bool fCheckForPruning = false;
 } // namespace
 
 
@@ -216,6 +248,128 @@ struct CMainSignals {
     boost::signals2::signal<void (const CBlock&, const CValidationState&)> BlockChecked;
 } g_signals;
 
+/**
+ * Delivers SyncTransaction, UpdatedTransaction and SetBestChain to the
+ * registered interfaces on a dedicated thread, in the order they were
+ * raised, so wallet work does not run on the block connection path under
+ * cs_main. Until that thread runs, and once it has stopped, they are
+ * delivered inline as before.
+ */
+class CValidationCallbackQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+    std::deque<boost::function<void()> > queue;
+    //! Callbacks taken off the queue but not finished yet
+    unsigned int nInFlight;
+    bool fRunning;
+
+public:
+    CValidationCallbackQueue() : nInFlight(0), fRunning(false) {}
+
+    void Thread()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fRunning = true;
+        }
+        bool fInterrupted = false;
+        while (true) {
+            boost::function<void()> func;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fInterrupted && queue.empty()) {
+                    try {
+                        condWorker.wait(lock);
+                    } catch (const boost::thread_interrupted&) {
+                        fInterrupted = true;
+                    }
+                }
+                //! Deliver everything already raised before exiting
+                if (queue.empty()) {
+                    fRunning = false;
+                    condDone.notify_all();
+                    return;
+                }
+                func.swap(queue.front());
+                queue.pop_front();
+                nInFlight++;
+            }
+            try {
+                func();
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadValidationCallbacks()");
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nInFlight--;
+            condDone.notify_all();
+        }
+    }
+
+    void Add(const boost::function<void()>& func)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fRunning) {
+                queue.push_back(func);
+                condWorker.notify_one();
+                return;
+            }
+        }
+        func();
+    }
+
+    //! Wait until at most nMax callbacks are pending
+    void WaitForSize(size_t nMax)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() + nInFlight > nMax)
+            condDone.wait(lock);
+    }
+};
+
+CValidationCallbackQueue validationqueue;
+
+void SyncTransactionCallback(const CTransaction& tx, const boost::shared_ptr<const CBlock>& pblock)
+{
+    g_signals.SyncTransaction(tx, pblock.get());
+}
+
+void SyncBlockCallback(const boost::shared_ptr<const CBlock>& pblock)
+{
+    BOOST_FOREACH (const CTransaction& tx, pblock->vtx)
+        g_signals.SyncTransaction(tx, pblock.get());
+}
+
+void UpdatedTransactionCallback(const uint256& hash)
+{
+    g_signals.UpdatedTransaction(hash);
+}
+
+void SetBestChainCallback(const CBlockLocator& locator)
+{
+    g_signals.SetBestChain(locator);
+}
+
+//! Tell the wallets about every transaction of a newly connected block
+void SyncBlockWithWallets(const CBlock& block)
+{
+    boost::shared_ptr<const CBlock> pblock(new CBlock(block));
+    validationqueue.Add(boost::bind(&SyncBlockCallback, pblock));
+}
+
+void UpdatedTransactionWithWallets(const uint256& hash)
+{
+    validationqueue.Add(boost::bind(&UpdatedTransactionCallback, hash));
+}
+
+void SetBestChainWithWallets(const CBlockLocator& locator)
+{
+    validationqueue.Add(boost::bind(&SetBestChainCallback, locator));
+}
+
 } // namespace
 
 void RegisterValidationInterface(CValidationInterface* pwalletIn) {
@@ -251,7 +405,26 @@ void UnregisterAllValidationInterfaces()
 
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock)
 {
-    g_signals.SyncTransaction(tx, pblock);
+    boost::shared_ptr<const CBlock> pblockCopy;
+    if (pblock)
+        pblockCopy.reset(new CBlock(*pblock));
+    validationqueue.Add(boost::bind(&SyncTransactionCallback, tx, pblockCopy));
+}
+
+void ThreadValidationCallbacks()
+{
+    RenameThread("Metrix-callback");
+    validationqueue.Thread();
+}
+
+void LimitValidationInterfaceQueue()
+{
+    validationqueue.WaitForSize(MAX_VALIDATION_CALLBACK_QUEUE);
+}
+
+void SyncWithValidationInterfaceQueue()
+{
+    validationqueue.WaitForSize(0);
 }
 
 void ResendWalletTransactions(bool fForce)
@@ -299,12 +472,18 @@ namespace
         uint256 hashLastUnknownBlock;
         //! The last full block we both have.
         CBlockIndex *pindexLastCommonBlock;
+        //! The best header we have sent our peer.
+        CBlockIndex* pindexBestHeaderSent;
         //! Whether we've started headers synchronization with this peer.
         bool fSyncStarted;
         //! Since when we're stalling block download progress (in microseconds), or 0.
         int64_t nStallingSince;
         list<QueuedBlock> vBlocksInFlight;
         int nBlocksInFlight;
+        //! Whether this peer wants new blocks announced with headers instead of inv.
+        bool fPreferHeaders;
+        //! Number of unconnecting block announcements since the last one that connected.
+        int nUnconnectingHeaders;
 
         CNodeState()
         {
@@ -314,9 +493,12 @@ namespace
             pindexBestKnownBlock = NULL;
             hashLastUnknownBlock = uint256(0);
             pindexLastCommonBlock = NULL;
+            pindexBestHeaderSent = NULL;
             fSyncStarted = false;
             nStallingSince = 0;        
             nBlocksInFlight = 0;
+            fPreferHeaders = false;
+            nUnconnectingHeaders = 0;
         }
     };
     //! Map maintaining per-node state. Requires cs_main.
@@ -387,7 +569,7 @@ namespace
         // Make sure it's not listed somewhere already.
         MarkBlockAsReceived(hash);
 
-        QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+        QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL, boost::shared_ptr<PartiallyDownloadedBlock>()};
          nQueuedValidatedHeaders += newentry.fValidatedHeaders;
         list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
         state->nBlocksInFlight++;
@@ -410,6 +592,22 @@ namespace
         }
     }
 
+    //! Requires cs_main.
+    bool PeerHasHeader(CNodeState* state, CBlockIndex* pindex)
+    {
+        if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+            return true;
+        if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+            return true;
+        return false;
+    }
+
+    /** Whether our tip is recent enough to fetch announced blocks directly instead of through the download window. */
+    bool CanDirectFetch()
+    {
+        return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20;
+    }
+
     /** Update tracking information about which blocks a peer is assumed to have. */
     void UpdateBlockAvailability(NodeId nodeid, const uint256& hash)
     {
@@ -515,7 +713,8 @@ namespace
                     //! We consider the chain that this peer is on invalid.
                     return;
                 }
-                if (pindex->nStatus & BLOCK_HAVE_DATA) {
+                if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
+                    //! Active chain blocks count as downloaded, even when pruned
                     if (pindex->nChainTx)
                         state->pindexLastCommonBlock = pindex;
                 } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
@@ -592,6 +791,8 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 
 CCoinsViewCache* pcoinsTip = NULL;
 CBlockTreeDB* pblocktree = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
+CTxIndexDB* ptxindexdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 /**
@@ -610,63 +811,98 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
      * large transaction with a missing parent then we assume
      * it will rebroadcast it later, after the parent transaction(s)
      * have been mined or received.
-     * 10,000 orphans, each of which is at most 5,000 bytes big is
-     * at most 500 megabytes of orphans:
+     * The pool as a whole is bounded by -maxorphantx and -maxorphantxsize.
      */
 
     size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
 
-    if (nSize > 5000) {
+    if (nSize > MAX_STANDARD_TX_SIZE) {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.insert(make_pair(hash, COrphanTx())).first;
+    it->second.tx = tx;
+    it->second.fromPeer = peer;
+    it->second.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    it->second.nTxSize = nSize;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(it);
+    mapOrphanTransactionsByPeer[peer].insert(hash);
+    nOrphanTransactionsSize += nSize;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u bytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), nOrphanTransactionsSize);
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+int static EraseOrphanTx(uint256 hash)
 {
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
-        return;
+        return 0;
     BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
-        itPrev->second.erase(hash);
+        itPrev->second.erase(it);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end()) {
+        itPeer->second.erase(hash);
+        if (itPeer->second.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    nOrphanTransactionsSize -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
+    return 1;
 }
 
-
 void EraseOrphansFor(NodeId peer)
 {
+    map<NodeId, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+
+    set<uint256> setErase;
+    setErase.swap(itPeer->second);
+    mapOrphanTransactionsByPeer.erase(itPeer);
+
     int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; //! increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
+    BOOST_FOREACH (const uint256& hash, setErase)
+        nErased += EraseOrphanTx(hash);
     if (nErased > 0)
         LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphansSize)
 {
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        //! Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end()) {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                nErased += EraseOrphanTx(maybeErase->first);
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        //! Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0)
+            LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    }
+
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
+    while (!mapOrphanTransactions.empty() &&
+           (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxOrphansSize)) {
         //! Evict a random orphan:
         uint256 randomhash = GetRandHash();
         map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
@@ -678,6 +914,19 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     return nEvicted;
 }
 
+//! Queue the orphans that spend outputs of tx for re-validation
+static void AddOrphanWork(const CTransaction& tx, std::set<uint256>& setOrphanWork)
+{
+    const uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (set<map<uint256, COrphanTx>::iterator, IteratorComparator>::const_iterator mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi)
+            setOrphanWork.insert((*mi)->first);
+    }
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 /**
@@ -971,17 +1220,44 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes)
     return nMinFee;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee)
+/** Drop expired transactions, then trim the pool down to limit bytes of memory. */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool fOverrideMempoolLimit)
+{
+    try {
+        std::string errorMessage;
+        return AcceptToMemoryPool(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, errorMessage, fOverrideMempoolLimit);
+    } catch (std::runtime_error& e) {
+        return state.Abort(_("System error: ") + e.what());
+    }
+}
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, std::string& errorMessage, bool fOverrideMempoolLimit, int64_t nAcceptTime);
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime)
 {
     try {
         std::string errorMessage;
-        return AcceptToMemoryPool(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, errorMessage);
+        return AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, false, errorMessage, false, nAcceptTime);
     } catch (std::runtime_error& e) {
         return state.Abort(_("System error: ") + e.what());
     }
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, std::string& errorMessage)
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, std::string& errorMessage, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, errorMessage, fOverrideMempoolLimit, GetTime());
+}
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, std::string& errorMessage, bool fOverrideMempoolLimit, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1106,7 +1382,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         //! Don't accept it if it can't get into a block
@@ -1118,6 +1394,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                          nFees, txMinFee);
         }
 
+        //! Once the pool has been trimmed, require at least the fee rate of what was evicted
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && entry.GetModifiedFee() < mempoolRejectFee) {
+            errorMessage = "mempool min fee not met " + hash.ToString() + ", " + boost::lexical_cast<string>(nFees) + " < " + boost::lexical_cast<string>(mempoolRejectFee);
+            return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d", hash.ToString(), nFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         //! Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1155,6 +1439,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        //! Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        {
+            LOCK(pool.cs);
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+                errorMessage = "too long mempool chain " + hash.ToString() + ", " + errString;
+                return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s, %s", hash.ToString(), errString),
+                                 REJECT_NONSTANDARD, "too-long-mempool-chain");
+            }
+        }
+
         /**
          * Check against previous transactions
          * This is done last to help prevent CPU exhaustion denial-of-service attacks.
@@ -1180,7 +1480,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         }
 
         //! Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        //! trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash)) {
+                errorMessage = "mempool full " + hash.ToString();
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+            }
+        }
     }
 
     setValidatedTx.insert(hash);
@@ -1273,10 +1582,8 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn - nValueOut;
-        double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
-        unsigned int nSize = entry.GetTxSize();
+        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
         //! Don't accept it if it can't get into a block
         CAmount txMinFee = GetMinRelayFee(tx, nSize);
@@ -1327,6 +1634,119 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+/** Format version of mempool.dat */
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+    const std::string strProgress = _("Loading mempool...");
+
+    try {
+        uint64_t version;
+        filein >> version;
+        if (version != MEMPOOL_DUMP_VERSION)
+            return error("%s : unsupported mempool file version %d", __func__, version);
+
+        //! Deltas from prioritisetransaction come first, so that they already
+        //! count when their transactions are accepted again below.
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        filein >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t num;
+        filein >> num;
+        int nLastProgress = -1;
+        for (uint64_t i = 0; i < num; i++) {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx;
+            filein >> nTime;
+
+            if (nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                LOCK(cs_main);
+                AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime);
+                if (state.IsValid())
+                    ++count;
+                else
+                    ++failed;
+            } else {
+                ++skipped;
+            }
+
+            int nProgress = (int)((i + 1) * 100 / num);
+            if (nProgress != nLastProgress) {
+                uiInterface.ShowProgress(strProgress, nProgress);
+                nLastProgress = nProgress;
+            }
+            if (ShutdownRequested())
+                break;
+        }
+    } catch (const std::exception& e) {
+        uiInterface.ShowProgress("", 100);
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    uiInterface.ShowProgress("", 100);
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", count, failed, skipped);
+    return !ShutdownRequested();
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vinfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vinfo.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vinfo.push_back(std::make_pair(mi->GetTx(), mi->GetTime()));
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s : failed to open %s", __func__, pathTmp.string());
+
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << mapDeltas;
+        fileout << (uint64_t)vinfo.size();
+        for (std::vector<std::pair<CTransaction, int64_t> >::const_iterator it = vinfo.begin(); it != vinfo.end(); ++it) {
+            fileout << it->first;
+            fileout << it->second;
+        }
+        FileCommit(fileout);
+        fileout.fclose();
+        RenameOver(pathTmp, GetDataDir() / "mempool.dat");
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.000001, (GetTimeMicros() - nMid) * 0.000001);
+    return true;
+}
+
 int GetInputAge(CTxIn& vin)
 {
     const uint256& prevHash = vin.prevout.hash;
@@ -1342,78 +1762,409 @@ int GetInputAge(CTxIn& vin)
         return 0;
 }
 
-//! Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
-bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
+/**
+ * Block connect pipeline, used while in initial block download or reindexing.
+ *
+ * While ConnectTip connects block N under cs_main, a background thread writes
+ * the undo data and transaction index entries of the blocks connected before
+ * it, and reads block N+1 from disk, looking up the coins it spends so they
+ * are in the database caches by the time ConnectBlock needs them.
+ *
+ * Undo file positions are still allocated by ConnectBlock, so the block index
+ * always describes the final layout. FlushBlockFile waits for the pending
+ * writes before syncing the files, which keeps the usual order of block and
+ * undo files, then block index, then chainstate intact across a crash.
+ */
+struct CPendingBlockWrite {
+    CBlockUndo blockundo;
+    CDiskBlockPos posUndo; //! null if the undo data is already on disk
+    uint256 hashPrevBlock;
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+};
+
+static bool WritePendingBlock(CPendingBlockWrite& write)
 {
-    CBlockIndex* pindexSlow = NULL;
+    if (!write.posUndo.IsNull() && !write.blockundo.WriteToDisk(write.posUndo, write.hashPrevBlock))
+        return error("%s : failed to write undo data", __func__);
+    if (!ptxindexdb->WriteTxIndex(write.vPos))
+        return error("%s : failed to write transaction index", __func__);
+    return true;
+}
 
-    LOCK(cs_main);
+class CConnectPipeline
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
 
-    if (mempool.lookup(hash, txOut)) {
-        return true;
-    }
+    //! Writes in connect order; the front one stays queued until it is done
+    std::list<CPendingBlockWrite> listWrites;
+    //! Transaction index entries of the queued writes
+    std::map<uint256, CDiskTxPos> mapPendingTxIndex;
 
-    CDiskTxPos postx;
-    if (pblocktree->ReadTxIndex(hash, postx)) {
-        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-        if (file.IsNull())
-            return error("%s: OpenBlockFile failed", __func__);
-        CBlockHeader header;
-        try {
-            file >> header;
-            fseek(file, postx.nTxOffset, SEEK_CUR);
-            file >> txOut;
-        } catch (std::exception& e) {
-            return error("%s() : deserialize or I/O error", __func__);
-        }
-        hashBlock = header.GetHash();
-        if (txOut.GetHash() != hash)
-            return error("%s() : txid mismatch", __func__);
-        return true;
-    }
+    //! Block to read next, the block being read and the last block read
+    const CBlockIndex* pindexPrefetch;
+    const CBlockIndex* pindexPrefetching;
+    const CBlockIndex* pindexPrefetched;
+    CBlock blockPrefetched;
 
-    if (fAllowSlow) { //! use coin database to locate block that contains transaction, and scan it
-        int nHeight = -1;
+    bool fRunning;
+    bool fFailed;
+
+public:
+    CConnectPipeline() : pindexPrefetch(NULL), pindexPrefetching(NULL), pindexPrefetched(NULL), fRunning(false), fFailed(false) {}
+
+    void Thread(CCoinsView* pcoinsview)
+    {
         {
-            CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fRunning = true;
         }
-        if (nHeight > 0)
-            pindexSlow = chainActive[nHeight];
-    }
+        bool fInterrupted = false;
+        while (true) {
+            const CBlockIndex* pindexRead = NULL;
+            CPendingBlockWrite* pwrite = NULL;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fInterrupted && listWrites.empty() && pindexPrefetch == NULL) {
+                    try {
+                        condWorker.wait(lock);
+                    } catch (const boost::thread_interrupted&) {
+                        fInterrupted = true;
+                    }
+                }
+                //! Pending writes are always finished before the thread exits
+                if (fInterrupted && listWrites.empty()) {
+                    fRunning = false;
+                    condDone.notify_all();
+                    return;
+                }
+                if (pindexPrefetch != NULL && !fInterrupted) {
+                    pindexRead = pindexPrefetching = pindexPrefetch;
+                    pindexPrefetch = NULL;
+                    pindexPrefetched = NULL;
+                } else {
+                    pwrite = &listWrites.front();
+                }
+            }
 
-    if (pindexSlow) {
-        CBlock block;
-        if (ReadBlockFromDisk(block, pindexSlow)) {
-            BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-                if (tx.GetHash() == hash) {
-                    txOut = tx;
-                    hashBlock = pindexSlow->GetBlockHash();
-                    return true;
+            if (pindexRead != NULL) {
+                //! Only this thread touches blockPrefetched while pindexPrefetching is set
+                bool fRead = ReadBlockFromDisk(blockPrefetched, pindexRead);
+                if (fRead) {
+                    try {
+                        //! A full read, so the output rows get into the database cache along with the header
+                        CCoins coinsPrefetch;
+                        BOOST_FOREACH (const CTransaction& tx, blockPrefetched.vtx) {
+                            if (tx.IsCoinBase())
+                                continue;
+                            BOOST_FOREACH (const CTxIn& txin, tx.vin)
+                                pcoinsview->GetCoins(txin.prevout.hash, coinsPrefetch);
+                        }
+                    } catch (const std::exception& e) {
+                        LogPrint("bench", "%s : prefetching coins failed: %s\n", __func__, e.what());
+                    }
                 }
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pindexPrefetching = NULL;
+                pindexPrefetched = fRead ? pindexRead : NULL;
+                condDone.notify_all();
+            } else {
+                bool fOk = WritePendingBlock(*pwrite);
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (!fOk)
+                    fFailed = true;
+                for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = pwrite->vPos.begin(); it != pwrite->vPos.end(); ++it)
+                    mapPendingTxIndex.erase(it->first);
+                listWrites.pop_front();
+                condDone.notify_all();
             }
         }
     }
 
-    return false;
-}
+    bool IsRunning()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fRunning;
+    }
 
+    //! Queue the undo data and transaction index of a connected block, taking over their contents.
+    //! Returns false if this or an earlier write failed.
+    bool AddWrite(CBlockUndo& blockundo, const CDiskBlockPos& posUndo, const uint256& hashPrevBlock, std::vector<std::pair<uint256, CDiskTxPos> >& vPos)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fFailed)
+            return false;
+        listWrites.push_back(CPendingBlockWrite());
+        CPendingBlockWrite& write = listWrites.back();
+        write.blockundo.vtxundo.swap(blockundo.vtxundo);
+        write.posUndo = posUndo;
+        write.hashPrevBlock = hashPrevBlock;
+        write.vPos.swap(vPos);
+        if (!fRunning) {
+            bool fOk = WritePendingBlock(write);
+            listWrites.pop_back();
+            return fOk;
+        }
+        for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = write.vPos.begin(); it != write.vPos.end(); ++it)
+            mapPendingTxIndex[it->first] = it->second;
+        condWorker.notify_one();
+        return true;
+    }
 
-//////////////////////////////////////////////////////////////////////////////
-/**
- * CBlock and CBlockIndex
- */
+    //! Wait until all queued writes are on disk. Returns false if any of them failed.
+    bool Sync()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!listWrites.empty())
+            condDone.wait(lock);
+        return !fFailed;
+    }
 
-bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
-{
-    //! Open history file to append
-    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("CBlock::WriteToDisk() : OpenBlockFile failed");
+    bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<uint256, CDiskTxPos>::const_iterator it = mapPendingTxIndex.find(txid);
+        if (it == mapPendingTxIndex.end())
+            return false;
+        pos = it->second;
+        return true;
+    }
 
-    //! Write index header
+    //! Start reading a block that is about to be connected
+    void Prefetch(const CBlockIndex* pindex)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fRunning || pindex == pindexPrefetching || pindex == pindexPrefetched)
+            return;
+        pindexPrefetch = pindex;
+        condWorker.notify_one();
+    }
+
+    //! Hand over a prefetched block, waiting for it if it is still being read
+    bool GetPrefetched(const CBlockIndex* pindex, CBlock& block)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (pindexPrefetching == pindex)
+            condDone.wait(lock);
+        if (pindexPrefetched != pindex)
+            return false;
+        static_cast<CBlockHeader&>(block) = blockPrefetched;
+        block.vtx.swap(blockPrefetched.vtx);
+        block.vchBlockSig.swap(blockPrefetched.vchBlockSig);
+        block.nSerializedSize = blockPrefetched.nSerializedSize;
+        block.fChecked = false;
+        pindexPrefetched = NULL;
+        return true;
+    }
+};
+
+static CConnectPipeline connectpipeline;
+
+void ThreadConnectPipeline(CCoinsView* pcoinsview)
+{
+    RenameThread("Metrix-connect");
+    connectpipeline.Thread(pcoinsview);
+}
+
+/**
+ * Background writer of the coins cache (-backgroundflush).
+ *
+ * FlushStateToDisk hands it copies of the dirty cache entries, which stay in
+ * the cache as clean ones, and carries on connecting blocks while they are
+ * written. So the cache keeps its hot entries instead of being emptied, and
+ * only drops cold ones when it is trimmed. The cache must keep every entry of
+ * a pending write, as the database still has the old version, so it is only
+ * trimmed after Sync().
+ */
+class CCoinsFlusher
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+
+    CCoinsView* pcoinsview;
+    CCoinsMap mapCoins;
+    uint256 hashBlock;
+    bool fPending;
+    bool fRunning;
+    bool fFailed;
+
+public:
+    CCoinsFlusher() : pcoinsview(NULL), hashBlock(0), fPending(false), fRunning(false), fFailed(false) {}
+
+    void Thread(CCoinsView* pcoinsviewIn)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pcoinsview = pcoinsviewIn;
+            fRunning = true;
+        }
+        bool fInterrupted = false;
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fInterrupted && !fPending) {
+                    try {
+                        condWorker.wait(lock);
+                    } catch (const boost::thread_interrupted&) {
+                        fInterrupted = true;
+                    }
+                }
+                //! A pending write is always finished before the thread exits
+                if (!fPending) {
+                    fRunning = false;
+                    condDone.notify_all();
+                    return;
+                }
+            }
+
+            //! Only this thread touches mapCoins while fPending is set
+            int64_t nStart = GetTimeMicros();
+            size_t nEntries = mapCoins.size();
+            bool fOk = false;
+            try {
+                fOk = pcoinsview->BatchWrite(mapCoins, hashBlock);
+            } catch (const std::exception& e) {
+                LogPrintf("%s : %s\n", __func__, e.what());
+            }
+            mapCoins.clear();
+            LogPrint("coindb", "Background flush of %u coins entries: %.2fms\n", (unsigned int)nEntries, (GetTimeMicros() - nStart) * 0.001);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fOk)
+                fFailed = true;
+            fPending = false;
+            condDone.notify_all();
+        }
+    }
+
+    bool IsRunning()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fRunning;
+    }
+
+    //! Queue the write of a copy of the dirty entries, taking over the contents of mapCoinsIn.
+    //! Returns false if this or an earlier write failed.
+    bool Write(CCoinsMap& mapCoinsIn, const uint256& hashBlockIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fPending)
+            condDone.wait(lock);
+        if (fFailed)
+            return false;
+        //! The thread stopped since the caller checked IsRunning
+        if (!fRunning) {
+            lock.unlock();
+            return pcoinsview->BatchWrite(mapCoinsIn, hashBlockIn);
+        }
+        mapCoins.swap(mapCoinsIn);
+        hashBlock = hashBlockIn;
+        fPending = true;
+        condWorker.notify_one();
+        return true;
+    }
+
+    //! Wait until the queued write is on disk. Returns false if any write failed.
+    bool Sync()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fPending)
+            condDone.wait(lock);
+        return !fFailed;
+    }
+};
+
+static CCoinsFlusher coinsflusher;
+
+void ThreadCoinsFlush(CCoinsView* pcoinsview)
+{
+    RenameThread("Metrix-coinsflush");
+    coinsflusher.Thread(pcoinsview);
+}
+
+bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
+{
+    if (connectpipeline.ReadTxIndex(txid, pos))
+        return true;
+    return ptxindexdb->ReadTxIndex(txid, pos);
+}
+
+//! Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
+bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
+{
+    CBlockIndex* pindexSlow = NULL;
+
+    LOCK(cs_main);
+
+    if (mempool.lookup(hash, txOut)) {
+        return true;
+    }
+
+    CDiskTxPos postx;
+    if (ReadTxIndex(hash, postx)) {
+        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: OpenBlockFile failed", __func__);
+        CBlockHeader header;
+        try {
+            file >> header;
+            fseek(file, postx.nTxOffset, SEEK_CUR);
+            file >> txOut;
+        } catch (std::exception& e) {
+            return error("%s() : deserialize or I/O error", __func__);
+        }
+        hashBlock = header.GetHash();
+        if (txOut.GetHash() != hash)
+            return error("%s() : txid mismatch", __func__);
+        return true;
+    }
+
+    if (fAllowSlow) { //! use coin database to locate block that contains transaction, and scan it
+        int nHeight = -1;
+        {
+            CCoinsViewCache& view = *pcoinsTip;
+            const CCoins* coins = view.AccessCoins(hash);
+            if (coins)
+                nHeight = coins->nHeight;
+        }
+        if (nHeight > 0)
+            pindexSlow = chainActive[nHeight];
+    }
+
+    if (pindexSlow) {
+        CBlock block;
+        if (ReadBlockFromDisk(block, pindexSlow)) {
+            BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+                if (tx.GetHash() == hash) {
+                    txOut = tx;
+                    hashBlock = pindexSlow->GetBlockHash();
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+/**
+ * CBlock and CBlockIndex
+ */
+
+bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
+{
+    //! Open history file to append
+    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("CBlock::WriteToDisk() : OpenBlockFile failed");
+
+    //! Write index header
     unsigned int nSize = fileout.GetSerializeSize(block);
     fileout << FLATDATA(Params().MessageStart()) << nSize;
 
@@ -1442,6 +2193,7 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     } catch (std::exception& e) {
         return error("%s() : deserialize or I/O error", __func__);
     }
+    block.nSerializedSize = ftell(filein) - pos.nPos;
 
     //! Check the header
     if (block.IsProofOfWork() && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
@@ -1900,7 +2652,94 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool GetAddressIndexKey(const CTxDestination& dest, unsigned int& type, uint160& hashBytes)
+{
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest)) {
+        type = ADDRESS_INDEX_PUBKEYHASH;
+        hashBytes = *keyID;
+        return true;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest)) {
+        type = ADDRESS_INDEX_SCRIPTHASH;
+        hashBytes = *scriptID;
+        return true;
+    }
+    return false;
+}
+
+static bool GetAddressIndexKey(const CScript& script, unsigned int& type, uint160& hashBytes)
+{
+    CTxDestination dest;
+    return ExtractDestination(script, dest) && GetAddressIndexKey(dest, type, hashBytes);
+}
+
+/**
+ * Collect the address index rows of a connected block. The spent outputs come from its undo
+ * data; their unspent index rows are returned with a null value so that they get erased.
+ */
+static void GetAddressIndexRows(const CBlock& block, const CBlockUndo& blockundo, int nHeight,
+                                std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex,
+                                std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vAddressUnspent)
+{
+    unsigned int type;
+    uint160 hashBytes;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+        if (i > 0 && i - 1 < blockundo.vtxundo.size()) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            for (unsigned int j = 0; j < tx.vin.size() && j < txundo.vprevout.size(); j++) {
+                const CTxOut& prevout = txundo.vprevout[j].txout;
+                if (!GetAddressIndexKey(prevout.scriptPubKey, type, hashBytes))
+                    continue;
+                vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, nHeight, txhash, j, true), -prevout.nValue));
+                vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, tx.vin[j].prevout.hash, tx.vin[j].prevout.n), CAddressUnspentValue()));
+            }
+        }
+        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+            const CTxOut& out = tx.vout[k];
+            if (!GetAddressIndexKey(out.scriptPubKey, type, hashBytes))
+                continue;
+            vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, nHeight, txhash, k, false), out.nValue));
+            vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight)));
+        }
+    }
+}
+
+/** Collect the spent index rows of a connected block, one per input, from its undo data */
+static void GetSpentIndexRows(const CBlock& block, const CBlockUndo& blockundo, int nHeight,
+                              std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& vSpentIndex)
+{
+    for (unsigned int i = 1; i < block.vtx.size() && i - 1 < blockundo.vtxundo.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+        const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+        for (unsigned int j = 0; j < tx.vin.size() && j < txundo.vprevout.size(); j++) {
+            const COutPoint& prevout = tx.vin[j].prevout;
+            vSpentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n),
+                                                 CSpentIndexValue(txhash, j, nHeight, txundo.vprevout[j].txout.nValue)));
+        }
+    }
+}
+
+/**
+ * Collect the stake metadata of the outputs a transaction spends. Called before the transaction is
+ * applied to view, which still holds the time and height of every spent output then.
+ */
+static void GetStakeMetaRows(const CTransaction& tx, const CCoinsViewCache& view, const CBlockIndex* pindex,
+                             std::vector<std::pair<COutPoint, CStakeMetaValue> >& vStakeMeta)
+{
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        const COutPoint& prevout = txin.prevout;
+        const CCoins* coins = view.AccessCoins(prevout.hash);
+        assert(coins && coins->IsAvailable(prevout.n));
+        const CBlockIndex* pindexFrom = pindex->GetAncestor(coins->nHeight);
+        assert(pindexFrom);
+        vStakeMeta.push_back(std::make_pair(prevout, CStakeMetaValue(coins->nTime, pindexFrom->GetBlockTime(), coins->vout[prevout.n])));
+    }
+}
+
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, const CBlockUndo* pblockUndo)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1909,12 +2748,17 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock() : no undo data available");
-    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock() : failure reading undo data");
+    CBlockUndo blockUndoRead;
+    if (pblockUndo == NULL) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock() : no undo data available");
+        connectpipeline.Sync();
+        if (!blockUndoRead.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock() : failure reading undo data");
+        pblockUndo = &blockUndoRead;
+    }
+    const CBlockUndo& blockUndo = *pblockUndo;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
@@ -1980,6 +2824,46 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         }
     }
 
+    //! VerifyDB disconnects into a throwaway view and asks for pfClean; the index must stay as it is then
+    if (fAddressIndex && pfClean == NULL) {
+        //! Drop the rows of this block, and make the outputs it spent unspent again
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+        GetAddressIndexRows(block, blockUndo, pindex->nHeight, vAddressIndex, vAddressUnspent);
+        for (unsigned int i = 0; i < vAddressUnspent.size(); i++) {
+            CAddressUnspentValue& value = vAddressUnspent[i].second;
+            if (!value.IsNull()) {
+                value.SetNull();
+                continue;
+            }
+            const CAddressUnspentKey& key = vAddressUnspent[i].first;
+            const CCoins* coins = view.AccessCoins(key.txhash);
+            if (coins && coins->IsAvailable(key.index))
+                value = CAddressUnspentValue(coins->vout[key.index].nValue, coins->vout[key.index].scriptPubKey, coins->nHeight);
+        }
+        if (!pblocktree->EraseAddressIndex(vAddressIndex) || !pblocktree->UpdateAddressUnspentIndex(vAddressUnspent))
+            return state.Abort(_("Failed to write address index"));
+    }
+
+    if (fSpentIndex && pfClean == NULL) {
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+        GetSpentIndexRows(block, blockUndo, pindex->nHeight, vSpentIndex);
+        for (unsigned int i = 0; i < vSpentIndex.size(); i++)
+            vSpentIndex[i].second.SetNull();
+        if (!pblocktree->UpdateSpentIndex(vSpentIndex))
+            return state.Abort(_("Failed to write spent index"));
+    }
+
+    if (fTimestampIndex && pfClean == NULL) {
+        std::vector<CTimestampIndexKey> vTimestampIndex(1, CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()));
+        if (!pblocktree->EraseTimestampIndex(vTimestampIndex))
+            return state.Abort(_("Failed to write timestamp index"));
+    }
+
+    //! The outputs this block spent are back in the UTXO set
+    if (fPruneMode && pfClean == NULL && !pblocktree->EraseStakeMeta(pindex->nHeight))
+        return state.Abort(_("Failed to write stake metadata"));
+
     if (block.IsProofOfStake())
         setStakeSeen.erase(block.GetProofOfStake());
 
@@ -1998,6 +2882,118 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     }
 }
 
+/**
+ * Undo the coin changes of a block like DisconnectBlock, but without its consistency checks: after an
+ * interrupted flush every transaction may be stored in the state of either best block.
+ */
+static bool RollbackBlockCoins(const CBlock& block, const CBlockUndo& blockUndo, CCoinsViewCache& view)
+{
+    if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s : block and undo data inconsistent", __func__);
+
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction& tx = block.vtx[i];
+        view.ModifyCoins(tx.GetHash())->Clear();
+        if (i == 0)
+            continue;
+
+        const CTxUndo& txundo = blockUndo.vtxundo[i - 1];
+        if (txundo.vprevout.size() != tx.vin.size())
+            return error("%s : transaction and undo data inconsistent", __func__);
+        for (unsigned int j = tx.vin.size(); j-- > 0;) {
+            const COutPoint& out = tx.vin[j].prevout;
+            const CTxInUndo& undo = txundo.vprevout[j];
+            CCoinsModifier coins = view.ModifyCoins(out.hash);
+            if (undo.nHeight != 0) {
+                coins->Clear();
+                coins->fCoinBase = undo.fCoinBase;
+                coins->nHeight = undo.nHeight;
+                coins->nVersion = undo.nVersion;
+            }
+            if (coins->vout.size() < out.n + 1)
+                coins->vout.resize(out.n + 1);
+            coins->vout[out.n] = undo.txout;
+        }
+    }
+    return true;
+}
+
+//! Redo the coin changes of a block; outputs that are already spent were written by the interrupted flush
+static void RollforwardBlockCoins(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view)
+{
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                CTxInUndo undo;
+                view.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, undo);
+            }
+        }
+        view.ModifyCoins(tx.GetHash())->FromTx(tx, pindex->nHeight);
+    }
+}
+
+bool ReplayBlocks(CCoinsViewCache& view)
+{
+    LOCK(cs_main);
+
+    std::vector<uint256> vHeads = view.GetHeadBlocks();
+    if (vHeads.empty())
+        return true;
+    if (vHeads.size() != 2)
+        return error("%s : unknown inconsistent state", __func__);
+
+    BlockMap::iterator mi = mapBlockIndex.find(vHeads[0]);
+    if (mi == mapBlockIndex.end())
+        return error("%s : reorganization to unknown block requested", __func__);
+    CBlockIndex* pindexNew = mi->second;
+    CBlockIndex* pindexOld = NULL;
+    if (vHeads[1] != uint256(0)) {
+        mi = mapBlockIndex.find(vHeads[1]);
+        if (mi == mapBlockIndex.end())
+            return error("%s : reorganization from unknown block requested", __func__);
+        pindexOld = mi->second;
+    }
+    CBlockIndex* pindexFork = pindexOld ? LastCommonAncestor(pindexOld, pindexNew) : NULL;
+
+    uiInterface.ShowProgress(_("Replaying blocks..."), 0);
+    LogPrintf("%s: replaying the coins of blocks %s to %s after an interrupted flush\n", __func__,
+        vHeads[1].ToString(), vHeads[0].ToString());
+
+    //! Roll back along the old branch down to the fork
+    for (CBlockIndex* pindex = pindexOld; pindex != pindexFork; pindex = pindex->pprev) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("%s : failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+        CBlockUndo blockUndo;
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull() || !blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("%s : failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+        LogPrintf("Rolling back %s (%i)\n", pindex->GetBlockHash().ToString(), pindex->nHeight);
+        if (!RollbackBlockCoins(block, blockUndo, view))
+            return error("%s : failed to roll back block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+
+    //! Roll forward from the fork to the new best block. Without an old best block the coins
+    //! start at the genesis block, whose outputs ConnectBlock never adds, so begin above it.
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; nHeight++) {
+        const CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("%s : failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        RollforwardBlockCoins(block, pindex, view);
+        uiInterface.ShowProgress(_("Replaying blocks..."), (int)((nHeight - nForkHeight) * 100.0 / (pindexNew->nHeight - nForkHeight)));
+    }
+
+    view.SetBestBlock(pindexNew->GetBlockHash());
+    bool fFlushed = view.Flush();
+    uiInterface.ShowProgress("", 100);
+    if (!fFlushed)
+        return error("%s : failed to write the replayed coins", __func__);
+    return true;
+}
+
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
@@ -2008,6 +3004,73 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+//! Separate from scriptcheckqueue, so relayed transactions never contend with ConnectBlock for it
+static CCheckQueue<CScriptCheck> txscriptcheckqueue(128);
+
+void ThreadTxScriptCheck()
+{
+    RenameThread("Metrix-txscript");
+    txscriptcheckqueue.Thread();
+}
+
+/**
+ * Verify the scripts of a relayed transaction before AcceptToMemoryPool runs.
+ *
+ * Only the coins the transaction spends are copied out of the chain state
+ * and the mempool, under a short cs_main/mempool.cs lock; the stateless
+ * checks and the signature checks then run without either lock, spread over
+ * the tx script check threads. Valid signatures end up in the signature
+ * cache, so the CheckInputs call in AcceptToMemoryPool only re-evaluates the
+ * scripts and no longer does ECDSA work while holding cs_main.
+ *
+ * AcceptToMemoryPool stays authoritative: the result only tells whether the
+ * cache was warmed, and a transaction with missing inputs is left alone.
+ */
+static bool PreVerifyTransaction(const CTransaction& tx)
+{
+    CValidationState state;
+    if (!CheckTransaction(tx, state) || tx.IsCoinBase() || tx.IsCoinStake())
+        return false;
+
+    //! Snapshot the coins this transaction spends
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        view.SetBackend(viewMemPool);
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                view.SetBackend(dummy);
+                return false;
+            }
+        }
+        view.SetBackend(dummy);
+    }
+
+    std::vector<CScriptCheck> vChecks;
+    vChecks.reserve(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        const CCoins* coins = view.AccessCoins(prevout.hash);
+        if (!coins || !coins->IsAvailable(prevout.n))
+            return false;
+        vChecks.push_back(CScriptCheck(*coins, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true));
+    }
+
+    if (!nScriptCheckThreads) {
+        BOOST_FOREACH (CScriptCheck& check, vChecks) {
+            if (!check())
+                return false;
+        }
+        return true;
+    }
+
+    CCheckQueueControl<CScriptCheck> control(&txscriptcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -2073,6 +3136,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
+    std::vector<std::pair<COutPoint, CStakeMetaValue> > vStakeMeta;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
         const CTransaction& tx = block.vtx[i];
@@ -2112,6 +3176,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+
+            //! A pruned node can't read these outputs back from their blocks once the spend is final
+            if (fPruneMode && !fJustCheck)
+                GetStakeMetaRows(tx, view, pindex, vStakeMeta);
         }
         CTxUndo undoDummy;
         if (i > 0) {
@@ -2140,7 +3208,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     if (block.IsProofOfStake()) {
         //! ppcoin: coin stake tx earns reward instead of paying fee
         uint64_t nCoinAge;
-        if (!GetCoinAge(block.vtx[1], state, view, nCoinAge, pindex->nHeight))
+        if (!GetCoinAge(block.vtx[1], state, view, nCoinAge, pindex->nHeight, &blockundo.vtxundo[0]))
             return error("ConnectBlock() : %s unable to get coin age for coinstake", block.vtx[1].GetHash().ToString());
 
         CAmount nCalculatedStakeReward = GetProofOfStakeReward(nCoinAge, nFees, pindex->nHeight);
@@ -2181,13 +3249,21 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     if (fJustCheck)
         return true;
 
+    //! During initial download the undo data and transaction index are written by the connect pipeline
+    bool fDeferWrites = connectpipeline.IsRunning() && IsInitialBlockDownload();
+    CDiskBlockPos posUndo;
+
     //! Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
             if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
                 return error("ConnectBlock() : FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash()))
+            if (fDeferWrites) {
+                posUndo = pos;
+                //! CBlockUndo::WriteToDisk puts the data right after the message start and size
+                pos.nPos += MESSAGE_START_SIZE + sizeof(unsigned int);
+            } else if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash()))
                 return state.Abort("Failed to write undo data");
 
             //! update nUndoPos in block index
@@ -2199,7 +3275,34 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (!pblocktree->WriteTxIndex(vPos))
+    if (fAddressIndex) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+        GetAddressIndexRows(block, blockundo, pindex->nHeight, vAddressIndex, vAddressUnspent);
+        if (!pblocktree->WriteAddressIndex(vAddressIndex) || !pblocktree->UpdateAddressUnspentIndex(vAddressUnspent))
+            return state.Abort(_("Failed to write address index"));
+    }
+
+    if (fSpentIndex) {
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+        GetSpentIndexRows(block, blockundo, pindex->nHeight, vSpentIndex);
+        if (!pblocktree->UpdateSpentIndex(vSpentIndex))
+            return state.Abort(_("Failed to write spent index"));
+    }
+
+    if (fTimestampIndex) {
+        std::vector<CTimestampIndexKey> vTimestampIndex(1, CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()));
+        if (!pblocktree->WriteTimestampIndex(vTimestampIndex))
+            return state.Abort(_("Failed to write timestamp index"));
+    }
+
+    if (fPruneMode && !pblocktree->WriteStakeMeta(pindex->nHeight, vStakeMeta))
+        return state.Abort(_("Failed to write stake metadata"));
+
+    if (fDeferWrites) {
+        if (!connectpipeline.AddWrite(blockundo, posUndo, pindex->pprev->GetBlockHash(), vPos))
+            return state.Abort(_("Failed to write undo data or transaction index"));
+    } else if (!ptxindexdb->WriteTxIndex(vPos))
         return state.Abort(_("Failed to write transaction index"));
     //! add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -2208,13 +3311,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     nTimeIndex += nTime3 - nTime2;
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
 
-
-    BOOST_FOREACH (const CTransaction& tx, block.vtx)
-        SyncWithWallets(tx, &block);
-
     //! Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
-    g_signals.UpdatedTransaction(hashPrevBestCoinBase);
+    UpdatedTransactionWithWallets(hashPrevBestCoinBase);
     hashPrevBestCoinBase = block.vtx[0].GetHash();
 
     int64_t nTime4 = GetTimeMicros();
@@ -2227,6 +3326,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
 void static FlushBlockFile(bool fFinalize = false)
 {
+    //! Pending undo writes may target any file, including one about to be finalized
+    connectpipeline.Sync();
+
     LOCK(cs_LastBlockFile);
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
@@ -2254,6 +3356,113 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+/** Calculate the amount of disk space the block & undo files currently use */
+static uint64_t CalculateCurrentUsage()
+{
+    uint64_t retval = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+/** Mark one block file as pruned: its blocks no longer have data or undo data on disk */
+static void PruneOneBlockFile(const int fileNumber)
+{
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile == fileNumber) {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            setDirtyBlockIndex.insert(pindex);
+
+            //! Prune from mapBlocksUnlinked -- any block we prune would have to be downloaded again in
+            //! order to consider its chain, at which point it would be considered as a candidate again.
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex)
+                    mapBlocksUnlinked.erase(itUnlinked);
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+/** Actually unlink the specified files */
+static void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+/**
+ * Calculate the block files that should be deleted to remain under the -prune target, and mark them
+ * as pruned. Files holding a block within MIN_BLOCKS_TO_KEEP of the tip are never pruned; the kernel
+ * and coin age checks of stakes from pruned files fall back to the stake metadata and the UTXO set
+ * (see ReadStakeTxPrev).
+ */
+static void FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    if (chainActive.Tip()->nHeight <= (int)MIN_BLOCKS_TO_KEEP)
+        return;
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP;
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    //! We don't check to prune until after we've allocated new space for files, so leave a buffer
+    //! under the target to account for another allocation before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    int count = 0;
+
+    if (nCurrentUsage + nBuffer >= nPruneTarget) {
+        for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+            uint64_t nBytesToPrune = vinfoBlockFile[fileNumber].nSize + vinfoBlockFile[fileNumber].nUndoSize;
+
+            if (vinfoBlockFile[fileNumber].nSize == 0)
+                continue;
+
+            if (nCurrentUsage + nBuffer < nPruneTarget) //! are we below our target?
+                break;
+
+            //! don't prune files that could have a block within MIN_BLOCKS_TO_KEEP of the main chain's tip, but keep scanning
+            if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                continue;
+
+            PruneOneBlockFile(fileNumber);
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+            count++;
+        }
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+             nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+             ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+             nLastBlockWeCanPrune, count);
+}
+
+bool IsBlockFilePruned(int nFile)
+{
+    if (!fHavePruned)
+        return false;
+    LOCK(cs_LastBlockFile);
+    //! Pruned files keep a null entry; any file something still points into has data otherwise
+    return nFile >= 0 && nFile < (int)vinfoBlockFile.size() && vinfoBlockFile[nFile].nSize == 0;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
@@ -2263,9 +3472,31 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-    if ((mode == FLUSH_STATE_ALWAYS) ||
-        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+    if (fPruneMode && fCheckForPruning && !fReindex) {
+        FindFilesToPrune(setFilesToPrune);
+        fCheckForPruning = false;
+        if (!setFilesToPrune.empty()) {
+            fFlushForPrune = true;
+            if (!fHavePruned) {
+                pblocktree->WriteFlag("prunedblockfiles", true);
+                fHavePruned = true;
+            }
+        }
+    }
+    //! Forced and pruning flushes write everything before returning; the others hand the coins to the background writer
+    bool fBackground = mode != FLUSH_STATE_ALWAYS && !fFlushForPrune && coinsflusher.IsRunning();
+    /**
+     * A background write holds a copy of every dirty entry until it is done, and that copy can be as
+     * large as the cache itself. So the cache gets only half of the budget then: it is flushed once it
+     * grows past nCoinCacheSize / 2, waiting for the previous write if that is still going, and the cache
+     * plus the copy being written never exceed nCoinCacheSize entries.
+     */
+    unsigned int nCacheLimit = fBackground ? nCoinCacheSize / 2 : nCoinCacheSize;
+    if ((mode == FLUSH_STATE_ALWAYS) || fFlushForPrune ||
+        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCacheLimit) ||
         (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
         /**
          * Typical CCoins structures on disk are around 100 bytes in size.
@@ -2277,6 +3508,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode)
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // First make sure all block and undo data is flushed to disk.
+        if (!connectpipeline.Sync())
+            return state.Abort("Failed to write undo data or transaction index");
         FlushBlockFile();
         // Then update all block file information (which may refer to block and undo files).
         bool fileschanged = false;
@@ -2296,12 +3529,30 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode)
              }
              setDirtyBlockIndex.erase(it++);
         }
+        //! Spends deeper than the reorg window can't be undone any more
+        if (fPruneMode && chainActive.Height() > (int)MIN_BLOCKS_TO_KEEP &&
+            !pblocktree->ExpireStakeMeta(chainActive.Height() - MIN_BLOCKS_TO_KEEP))
+            return state.Abort("Failed to write stake metadata");
         pblocktree->Sync();
-        if (!pcoinsTip->Flush())
+        ptxindexdb->Sync();
+        //! Then the coins, after any previous background write of them
+        if (!coinsflusher.Sync())
+            return state.Abort("Failed to write to coin database");
+        if (fBackground) {
+            pcoinsTip->Trim(nCacheLimit / 100 * COINS_CACHE_TRIM_PERCENT);
+            CCoinsMap mapDirty;
+            pcoinsTip->CopyDirty(mapDirty);
+            if (!coinsflusher.Write(mapDirty, pcoinsTip->GetBestBlock()))
+                return state.Abort("Failed to write to coin database");
+        } else if (!pcoinsTip->Flush()) {
             return state.Abort("Failed to write to coin database");
+        }
+        //! Only remove the pruned files once nothing on disk refers to them any more
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
         // Update best block in wallet (so we can detect restored wallets).
         if (mode != FLUSH_STATE_IF_NEEDED) {
-            g_signals.SetBestChain(chainActive.GetLocator());
+            SetBestChainWithWallets(chainActive.GetLocator());
         }
         nLastWrite = GetTimeMicros();
     }
@@ -2316,6 +3567,12 @@ void FlushStateToDisk() {
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush() {
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+}
+
 //! Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex* pindexNew)
 {
@@ -2387,13 +3644,24 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     //! Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         //! ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    //! AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    //! no in-mempool children, which is generally not true when adding
+    //! previously-confirmed transactions back to the mempool.
+    //! UpdateTransactionsFromBlock finds descendants of any transactions in this
+    //! block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    //! Resurrected transactions bypassed the size limit; enforce it once the pool is consistent again.
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     //! Update chainActive and related variables.
@@ -2423,7 +3691,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        if (!connectpipeline.GetPrefetched(pindexNew, block) && !ReadBlockFromDisk(block, pindexNew))
             return state.Abort("Failed to read block");
         pblock = &block;
     }
@@ -2443,6 +3711,8 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
             return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(inv.hash);
+        //! Blocks read from the network or disk already know their size
+        CNode::RecordBlockSize(pblock->nSerializedSize ? pblock->nSerializedSize : ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
         nTime3 = GetTimeMicros();
         nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
@@ -2470,9 +3740,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
         SyncWithWallets(tx, NULL);
     }
     //! ... and about transactions that got confirmed:
-    BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
-    }
+    SyncBlockWithWallets(*pblock);
 
     int64_t nTime6 = GetTimeMicros();
     nTimePostConnect += nTime6 - nTime5;
@@ -2570,7 +3838,12 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
     nHeight = nTargetHeight;
 
     //! Connect new blocks.
-    BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
+    bool fPrefetch = connectpipeline.IsRunning() && IsInitialBlockDownload();
+    for (int i = vpindexToConnect.size() - 1; i >= 0; i--) {
+        CBlockIndex* pindexConnect = vpindexToConnect[i];
+        //! Read the next block while this one is connected
+        if (fPrefetch && i > 0 && !(pblock && vpindexToConnect[i - 1] == pindexMostWork))
+            connectpipeline.Prefetch(vpindexToConnect[i - 1]);
         if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
             if (state.IsInvalid()) {
                 //! The block violates a consensus rule.
@@ -2618,8 +3891,10 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
         boost::this_thread::interruption_point();
 
         bool fInitialDownload;
+        const CBlockIndex* pindexFork;
         {
             LOCK(cs_main);
+            CBlockIndex* pindexOldTip = chainActive.Tip();
             pindexMostWork = FindMostWorkChain();
 
             //! Whether we have anything to do at all.
@@ -2630,6 +3905,7 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = chainActive.FindFork(pindexOldTip);
             fInitialDownload = IsInitialBlockDownload();
         }
         //! When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -2637,13 +3913,28 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
         //! Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            //! Find the hashes of all blocks that weren't previously in the best chain, newest first.
+            std::vector<uint256> vHashes;
+            CBlockIndex* pindexToAnnounce = pindexNewTip;
+            while (pindexToAnnounce != pindexFork) {
+                vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                pindexToAnnounce = pindexToAnnounce->pprev;
+                if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                    //! Limit announcements in case of a huge reorganization.
+                    //! Rely on the peer's synchronization mechanism in that case.
+                    break;
+                }
+            }
             //! Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        BOOST_REVERSE_FOREACH(const uint256& hash, vHashes)
+                            pnode->PushBlockHash(hash);
+                    }
+                }
             }
             
             // Notify external listeners about the new tip.
@@ -2662,6 +3953,93 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
     return true;
 }
 
+bool GetStakeTxPrev(const COutPoint& prevout, const CCoins& coins, const CTxInUndo* pundo, CTransaction& txPrev, unsigned int& nTimeBlockFrom)
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex* pindexFrom = chainActive[coins.nHeight];
+    if (pindexFrom == NULL || (pindexFrom->nStatus & BLOCK_HAVE_DATA))
+        return false;
+
+    CMutableTransaction txTmp;
+    txTmp.nTime = coins.nTime;
+    txTmp.vout = coins.vout;
+    if (txTmp.vout.size() <= prevout.n)
+        txTmp.vout.resize(prevout.n + 1);
+    if (txTmp.vout[prevout.n].IsNull()) {
+        //! Already spent by the transaction being looked at
+        if (pundo == NULL)
+            return false;
+        txTmp.vout[prevout.n] = pundo->txout;
+    }
+    txPrev = txTmp;
+    nTimeBlockFrom = pindexFrom->GetBlockTime();
+    return true;
+}
+
+bool ReadStakeTxPrev(const COutPoint& prevout, CTransaction& txPrev, unsigned int& nTimeBlockFrom)
+{
+    AssertLockHeld(cs_main);
+    CStakeMetaValue meta;
+    if (fPruneMode && pblocktree->ReadStakeMeta(prevout, meta)) {
+        CMutableTransaction txTmp;
+        txTmp.nTime = meta.nTime;
+        txTmp.vout.resize(prevout.n + 1);
+        txTmp.vout[prevout.n] = meta.txout;
+        txPrev = txTmp;
+        nTimeBlockFrom = meta.nBlockTime;
+        return true;
+    }
+
+    CCoins coins;
+    return pcoinsTip->GetCoins(prevout.hash, coins) && GetStakeTxPrev(prevout, coins, NULL, txPrev, nTimeBlockFrom);
+}
+
+bool InitStakeMeta()
+{
+    LOCK(cs_main);
+    bool fComplete = false;
+    pblocktree->ReadFlag("stakemeta", fComplete);
+    if (!fPruneMode) {
+        //! Blocks connected from here on write no rows; wipe the stale ones so a later -prune starts over
+        if (fComplete && (!pblocktree->ExpireStakeMeta(std::numeric_limits<int>::max()) || !pblocktree->WriteFlag("stakemeta", false)))
+            return error("%s : failed to wipe the stake metadata", __func__);
+        return true;
+    }
+    if (fComplete)
+        return true;
+
+    //! Pruning was just switched on: collect the spends of the reorg window from the blocks, which are all still there
+    LogPrintf("Collecting the stake metadata of the last %u blocks...\n", MIN_BLOCKS_TO_KEEP);
+    if (!pblocktree->ExpireStakeMeta(std::numeric_limits<int>::max()))
+        return error("%s : failed to wipe the stake metadata", __func__);
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev && pindex->nHeight > chainActive.Height() - (int)MIN_BLOCKS_TO_KEEP; pindex = pindex->pprev) {
+        boost::this_thread::interruption_point();
+        CBlock block;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !ReadBlockFromDisk(block, pindex))
+            break;
+        std::vector<std::pair<COutPoint, CStakeMetaValue> > vStakeMeta;
+        for (unsigned int i = 1; i < block.vtx.size(); i++) {
+            BOOST_FOREACH (const CTxIn& txin, block.vtx[i].vin) {
+                //! Outputs from files an earlier version pruned already can't be collected any more
+                CDiskTxPos postx;
+                if (!ReadTxIndex(txin.prevout.hash, postx) || IsBlockFilePruned(postx.nFile))
+                    continue;
+                CTransaction txPrev;
+                uint256 hashBlock = 0;
+                if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true) || hashBlock == 0 || txin.prevout.n >= txPrev.vout.size())
+                    continue;
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+                if (mi == mapBlockIndex.end())
+                    continue;
+                vStakeMeta.push_back(std::make_pair(txin.prevout, CStakeMetaValue(txPrev.nTime, mi->second->GetBlockTime(), txPrev.vout[txin.prevout.n])));
+            }
+        }
+        if (!pblocktree->WriteStakeMeta(pindex->nHeight, vStakeMeta))
+            return error("%s : failed to write the stake metadata", __func__);
+    }
+    return pblocktree->WriteFlag("stakemeta", true);
+}
+
 /**
  * ppcoin: total coin age spent in transaction, in the unit of coin-days.
  * Only those coins meeting minimum age requirement counts. As those
@@ -2671,7 +4049,7 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
  * introduced to help nodes establish a consistent view of the coin
  * age (trust score) of competing branches.
  */
-bool GetCoinAge(const CTransaction& tx, CValidationState& state, CCoinsViewCache& view, uint64_t& nCoinAge, unsigned int nHeight)
+bool GetCoinAge(const CTransaction& tx, CValidationState& state, CCoinsViewCache& view, uint64_t& nCoinAge, unsigned int nHeight, const CTxUndo* ptxundo)
 {
     uint256 bnCentSecond = 0; //! coin age in the unit of cent-seconds
     nCoinAge = 0;
@@ -2679,8 +4057,9 @@ bool GetCoinAge(const CTransaction& tx, CValidationState& state, CCoinsViewCache
     if (tx.IsCoinBase())
         return true;
 
-    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
         //! First try finding the previous transaction in database
+        const CTxIn& txin = tx.vin[i];
         const COutPoint& prevout = txin.prevout;
         CCoins coins;
 
@@ -2691,7 +4070,8 @@ bool GetCoinAge(const CTransaction& tx, CValidationState& state, CCoinsViewCache
 
         CDiskTxPos postx;
         CTransaction txPrev;
-        if (pblocktree->ReadTxIndex(prevout.hash, postx)) {
+        int64_t nTimeBlockFrom = 0;
+        if (ReadTxIndex(prevout.hash, postx) && !IsBlockFilePruned(postx.nFile)) {
             CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
             CBlockHeader header;
             try {
@@ -2703,30 +4083,37 @@ bool GetCoinAge(const CTransaction& tx, CValidationState& state, CCoinsViewCache
             }
             if (txPrev.GetHash() != prevout.hash)
                 return error("%s() : txid mismatch in GetCoinAge()", __func__);
+            nTimeBlockFrom = header.GetBlockTime();
+        } else {
+            unsigned int nStakeBlockTime = 0;
+            LOCK(cs_main);
+            const CTxInUndo* pundo = (ptxundo && i < ptxundo->vprevout.size()) ? &ptxundo->vprevout[i] : NULL;
+            if (!GetStakeTxPrev(prevout, coins, pundo, txPrev, nStakeBlockTime))
+                return error("%s() : tx missing in tx index in GetCoinAge()", __func__);
+            nTimeBlockFrom = nStakeBlockTime;
+        }
 
-            if (header.GetBlockTime() + nStakeMinAge > tx.nTime)
-                continue; //! only count coins meeting min age requirement
+        if (nTimeBlockFrom + nStakeMinAge > tx.nTime)
+            continue; //! only count coins meeting min age requirement
 
-            CAmount nValueIn = 0;
-            int64_t nTimeWeight = 0;
+        CAmount nValueIn = 0;
+        int64_t nTimeWeight = 0;
 
-            if (nHeight < V3_START_BLOCK) {
-                nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTimeWeight = tx.nTime - txPrev.nTime;
-            } else {
-                nValueIn = min(txPrev.vout[txin.prevout.n].nValue, MAX_STAKE_VALUE);
-                nTimeWeight = min(tx.nTime - txPrev.nTime, nStakeMaxAge);
-            }
+        if (nHeight < V3_START_BLOCK) {
+            nValueIn = txPrev.vout[txin.prevout.n].nValue;
+            nTimeWeight = tx.nTime - txPrev.nTime;
+        } else {
+            nValueIn = min(txPrev.vout[txin.prevout.n].nValue, MAX_STAKE_VALUE);
+            nTimeWeight = min(tx.nTime - txPrev.nTime, nStakeMaxAge);
+        }
 
-            bnCentSecond += uint256(nValueIn) * nTimeWeight / CENT;
+        bnCentSecond += uint256(nValueIn) * nTimeWeight / CENT;
 
-            if (fDebug && GetBoolArg("-printcoinage", false)) {
-                LogPrint("getcoinage", "GetCoinAge::RAW  nValueIn=%d nTimeDiff=%d\n", txPrev.vout[txin.prevout.n].nValue, tx.nTime - txPrev.nTime);
-                LogPrint("getcoinage", "GetCoinAge::CALC nValueIn=%d nTimeDiff=%d\n", nValueIn, nTimeWeight);
-                LogPrint("getcoinage", "GetCoinAge bnCentSecond=%s\n", bnCentSecond.ToString());
-            }
-        } else
-            return error("%s() : tx missing in tx index in GetCoinAge()", __func__);
+        if (fDebug && GetBoolArg("-printcoinage", false)) {
+            LogPrint("getcoinage", "GetCoinAge::RAW  nValueIn=%d nTimeDiff=%d\n", txPrev.vout[txin.prevout.n].nValue, tx.nTime - txPrev.nTime);
+            LogPrint("getcoinage", "GetCoinAge::CALC nValueIn=%d nTimeDiff=%d\n", nValueIn, nTimeWeight);
+            LogPrint("getcoinage", "GetCoinAge bnCentSecond=%s\n", bnCentSecond.ToString());
+        }
     }
 
     uint256 bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
@@ -2931,6 +4318,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE *file = OpenBlockFile(pos);
                 if (file) {
@@ -2960,6 +4349,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE* file = OpenUndoFile(pos);
             if (file) {
@@ -2975,7 +4366,7 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
 }
 
 
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW, bool fCheckPOWHash)
 {
     if (block.GetHash() != Params().HashGenesisBlock() && block.nVersion < 7)
         return state.DoS(100, error("CheckBlockHeader() : reject too old nVersion = %d", block.nVersion),
@@ -2987,7 +4378,7 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
                          REJECT_INVALID, "rejected pow");
 
     //! Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
+    if (fCheckPOW && fCheckPOWHash && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
         return state.DoS(50, error("CheckBlockHeader() : proof of work failed"),
                          REJECT_INVALID, "high-hash");
 
@@ -3018,15 +4409,90 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+/**
+ * Closure representing the stateless checks of one transaction of a block:
+ * CheckTransaction, the transaction timestamp rule and the legacy sigop
+ * count, which is stored in the slot the caller reserved for this transaction.
+ */
+class CBlockTxCheck
 {
-    //! These are checks that are independent of context.
+private:
+    const CTransaction* ptx;
+    int64_t nBlockTime;
+    unsigned int* pnSigOps;
 
-    //! Check that the header is valid (particularly PoW).  This is mostly
-    //! redundant with the call in AcceptBlockHeader.
-    if (!CheckBlockHeader(block, state, block.IsProofOfWork() && fCheckPOW))
-        return state.DoS(100, error("CheckBlock() : CheckBlockHeader failed"),
-                         REJECT_INVALID, "bad-header", true);
+public:
+    CBlockTxCheck() : ptx(NULL), nBlockTime(0), pnSigOps(NULL) {}
+    CBlockTxCheck(const CTransaction& txIn, int64_t nBlockTimeIn, unsigned int* pnSigOpsIn) :
+        ptx(&txIn), nBlockTime(nBlockTimeIn), pnSigOps(pnSigOpsIn) { }
+
+    bool operator()()
+    {
+        CValidationState state;
+        if (!CheckTransaction(*ptx, state))
+            return false;
+        if (nBlockTime < (int64_t)ptx->nTime)
+            return false;
+        *pnSigOps = GetLegacySigOpCount(*ptx);
+        return true;
+    }
+
+    void swap(CBlockTxCheck& check)
+    {
+        std::swap(ptx, check.ptx);
+        std::swap(nBlockTime, check.nBlockTime);
+        std::swap(pnSigOps, check.pnSigOps);
+    }
+};
+
+//! CheckBlock also runs outside cs_main, so it gets its own queue, used by one block at a time
+static CCheckQueue<CBlockTxCheck> blockcheckqueue(128);
+static CCriticalSection cs_blockcheckqueue;
+
+void ThreadBlockCheck()
+{
+    RenameThread("Metrix-blockch");
+    blockcheckqueue.Thread();
+}
+
+/**
+ * Run the stateless per-transaction checks of a block on the block check
+ * threads, stopping at the first failure. Returns false when there are no
+ * such threads or when any check failed; the caller then repeats the checks
+ * serially, which finds the offending transaction and sets the reject state.
+ * On success vSigOps holds the legacy sigop count of every transaction.
+ */
+static bool CheckBlockTransactions(const CBlock& block, std::vector<unsigned int>& vSigOps)
+{
+    if (!nScriptCheckThreads || block.vtx.size() < 2)
+        return false;
+
+    vSigOps.assign(block.vtx.size(), 0);
+    std::vector<CBlockTxCheck> vChecks;
+    vChecks.reserve(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        vChecks.push_back(CBlockTxCheck(block.vtx[i], block.GetBlockTime(), &vSigOps[i]));
+
+    LOCK(cs_blockcheckqueue);
+    CCheckQueueControl<CBlockTxCheck> control(&blockcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+/**
+ * The checks of CheckBlock that depend on nothing but the block itself: the
+ * proof-of-work hash, the merkle root, size limits, coinbase and coinstake
+ * layout, the block signature, the per-transaction checks and the sigop
+ * limit. They touch no shared state, so the reindex workers run them ahead
+ * of the connect thread; fParallel lets a single caller spread the
+ * transaction checks over the block check threads instead.
+ */
+static bool CheckBlockContextFree(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig, bool fParallel)
+{
+    //! Check proof of work matches claimed amount
+    if (block.IsProofOfWork() && fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
+        return state.DoS(100, error("CheckBlock() : proof of work failed"),
+                         REJECT_INVALID, "high-hash", true);
 
     //! Check the merkle root.
     if (fCheckMerkleRoot) {
@@ -3052,8 +4518,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
      * because we receive the wrong transactions for it.
      */
 
-    //! Size limits
-    if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
+    //! Size limits; blocks read from the network or disk already know their size
+    unsigned int nBlockSize = block.nSerializedSize ? block.nSerializedSize : ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_SIZE || nBlockSize > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"),
                          REJECT_INVALID, "bad-blk-length");
 
@@ -3087,18 +4554,69 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : bad proof-of-stake block signature"),
                          REJECT_INVALID, "bad pos signature");
 
+    //! Stateless transaction checks, in parallel when possible. Only on failure
+    //! are they repeated serially, in their usual order.
+    std::vector<unsigned int> vSigOps;
+    bool fTxChecked = fParallel && CheckBlockTransactions(block, vSigOps);
+
+    //! Check transactions
+    if (!fTxChecked) {
+        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+            if (!CheckTransaction(tx, state))
+                return error("CheckBlock() : CheckTransaction failed");
+
+            //! ppcoin: check transaction timestamp
+            if (block.GetBlockTime() < (int64_t)tx.nTime)
+                return state.DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"),
+                                 REJECT_INVALID, "timestamp earlier than tx");
+        }
+    }
+
+    unsigned int nSigOps = 0;
+    if (fTxChecked) {
+        BOOST_FOREACH (unsigned int nTxSigOps, vSigOps)
+            nSigOps += nTxSigOps;
+    } else {
+        BOOST_FOREACH (const CTransaction& tx, block.vtx)
+            nSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nSigOps > MAX_BLOCK_SIGOPS)
+        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
+                         REJECT_INVALID, "bad-blk-sigops", true);
+
+    if (fCheckPOW && fCheckMerkleRoot && fCheckSig)
+        block.fChecked = true;
+
+    return true;
+}
+
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+{
+    //! Check that the header is valid. This is mostly redundant with the call
+    //! in AcceptBlockHeader. The proof-of-work hash is checked together with
+    //! the other context-free checks below.
+    if (!CheckBlockHeader(block, state, block.IsProofOfWork() && fCheckPOW, false))
+        return state.DoS(100, error("CheckBlock() : CheckBlockHeader failed"),
+                         REJECT_INVALID, "bad-header", true);
+
+    //! Skipped for blocks that already passed them, e.g. on a reindex worker
+    if (!block.fChecked && !CheckBlockContextFree(block, state, fCheckPOW, fCheckMerkleRoot, fCheckSig, true))
+        return false;
 
     //! ----------- instantX transaction scanning -----------
 
     if (IsSporkActive(SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT_DEFAULT)) {
+        //! Not part of the per-transaction checks on the block check threads; they must not read the lock map
+        LOCK(cs_mapLockedInputs);
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
             if (!tx.IsCoinBase()) {
                 //!only reject blocks when it's based on complete consensus
                 BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+                    std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(in.prevout);
+                    if (it != mapLockedInputs.end()) {
+                        if (it->second != tx.GetHash()) {
                             if (fDebug) {
-                                LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString().c_str(), tx.GetHash().ToString().c_str());
+                                LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", it->second.ToString().c_str(), tx.GetHash().ToString().c_str());
                             }
                             return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
                                              REJECT_INVALID, "conflicting tx with lock");
@@ -3165,30 +4683,10 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         LogPrint("masternode", "CheckBlock() : skipping masternode payment checks\n");
     }
 
-
-    //! Check transactions
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        if (!CheckTransaction(tx, state))
-            return error("CheckBlock() : CheckTransaction failed");
-
-        //! ppcoin: check transaction timestamp
-        if (block.GetBlockTime() < (int64_t)tx.nTime)
-            return state.DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"),
-                             REJECT_INVALID, "timestamp earlier than tx");
-    }
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
-    if (nSigOps > MAX_BLOCK_SIGOPS)
-        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
-                         REJECT_INVALID, "bad-blk-sigops", true);
-
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool fCheckPOWHash)
 {
     AssertLockHeld(cs_main);
 
@@ -3218,7 +4716,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
             return state.DoS(100, error("%s : prev block invalid", __func__), REJECT_INVALID, "bad-prevblk");
         nHeight = pindexPrev->nHeight + 1;
 
-        if (!CheckBlockHeader(block, state, block.nNonce > 0 && nHeight < Params().LastPOWBlock()))
+        if (!CheckBlockHeader(block, state, block.nNonce > 0 && nHeight < Params().LastPOWBlock(), fCheckPOWHash))
            return false;
 
         //! Check timestamp against prev
@@ -3251,7 +4749,8 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
     CBlockIndex*& pindex = *ppindex;
 
-    if (!AcceptBlockHeader(block, state, &pindex))
+    //! A proof-of-work block that passed CheckBlock already had its scrypt hash checked
+    if (!AcceptBlockHeader(block, state, &pindex, !(block.fChecked && block.IsProofOfWork())))
         return false;
 
     if (pindex->nStatus & BLOCK_HAVE_DATA) {
@@ -3467,6 +4966,9 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 
 bool static ReserealizeBlockSignature(CBlock* pblock)
 {
+    //! The signature may change length, so size and checks are redone
+    pblock->nSerializedSize = 0;
+    pblock->fChecked = false;
     if (pblock->IsProofOfWork()) {
         pblock->vchBlockSig.clear();
         return true;
@@ -3830,7 +5332,8 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        //! Blocks loaded from a UTXO snapshot and pruned blocks count as connected without their data
+        if (pindex->nTx > 0 || (pindex->nStatus & BLOCK_FROM_SNAPSHOT)) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3868,6 +5371,11 @@ bool static LoadBlockIndexDB()
             break;
         }
     }
+    //! Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     //! Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
@@ -3889,6 +5397,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
+    //! Finish a coins flush that was interrupted, so there is a single best block to load
+    if (!ReplayBlocks(*pcoinsTip))
+        return error("LoadBlockIndexDB() : failed to replay the blocks of an interrupted coins flush");
+
     //! Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3912,6 +5424,240 @@ CVerifyDB::~CVerifyDB()
     uiInterface.ShowProgress("", 100);
 }
 
+/**
+ * Worker pool that prepares entries ahead of a caller which takes them back in
+ * the order they were queued. A producer thread queues them with Push(), while
+ * the total cost of the entries not yet taken stays below nMaxCost; workers run
+ * the work function on them, and the caller takes them with Next(). Start()
+ * begins once everything the two functions use is set up.
+ */
+template <typename Entry>
+class CReadAheadQueue
+{
+private:
+    struct Item {
+        Entry* pentry;
+        size_t nCost;
+        bool fDone;
+
+        Item(Entry* pentryIn, size_t nCostIn) : pentry(pentryIn), nCost(nCostIn), fDone(false) {}
+    };
+
+    size_t nMaxCost;
+    boost::function<void()> produce;
+    boost::function<void(Entry&)> work;
+    std::string strProducerName;
+    std::string strWorkerName;
+    boost::thread_group threadGroup;
+
+    boost::mutex mutex;
+    boost::condition_variable condProducer;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+
+    //! All entries in queue order, and those no worker has taken yet
+    std::deque<Item*> queueItems;
+    std::deque<Item*> queueWork;
+    size_t nCostInFlight;
+    bool fProducerDone;
+    bool fStop;
+    std::string strError;
+
+    void ThreadProduce()
+    {
+        RenameThread(strProducerName.c_str());
+        try {
+            produce();
+        } catch (const std::runtime_error& e) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            strError = e.what();
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fProducerDone = true;
+        }
+        condWorker.notify_all();
+        condDone.notify_all();
+    }
+
+    void ThreadWork()
+    {
+        RenameThread(strWorkerName.c_str());
+        while (true) {
+            Item* pitem = NULL;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !fProducerDone && queueWork.empty())
+                    condWorker.wait(lock);
+                if (fStop || queueWork.empty())
+                    return;
+                pitem = queueWork.front();
+                queueWork.pop_front();
+            }
+            work(*pitem->pentry);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pitem->fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+
+public:
+    CReadAheadQueue(size_t nMaxCostIn, const boost::function<void()>& produceIn, const boost::function<void(Entry&)>& workIn,
+                    const std::string& strProducerNameIn, const std::string& strWorkerNameIn) :
+        nMaxCost(nMaxCostIn), produce(produceIn), work(workIn), strProducerName(strProducerNameIn),
+        strWorkerName(strWorkerNameIn), nCostInFlight(0), fProducerDone(false), fStop(false)
+    {
+    }
+
+    ~CReadAheadQueue()
+    {
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condProducer.notify_all();
+        condWorker.notify_all();
+        threadGroup.join_all();
+        BOOST_FOREACH (Item* pitem, queueItems) {
+            delete pitem->pentry;
+            delete pitem;
+        }
+    }
+
+    //! -par counts the thread taking the entries, so leave one of them to it
+    static int GetWorkerCount()
+    {
+        return std::max(nScriptCheckThreads - 1, 1);
+    }
+
+    void Start()
+    {
+        threadGroup.create_thread(boost::bind(&CReadAheadQueue::ThreadProduce, this));
+        for (int i = GetWorkerCount(); i > 0; i--)
+            threadGroup.create_thread(boost::bind(&CReadAheadQueue::ThreadWork, this));
+    }
+
+    //! Queue an entry, waiting while too much is in flight. Returns false when stopping; the caller keeps the entry then.
+    bool Push(Entry* pentry, size_t nCost)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && nCostInFlight > 0 && nCostInFlight + nCost > nMaxCost)
+                condProducer.wait(lock);
+            if (fStop)
+                return false;
+            nCostInFlight += nCost;
+            Item* pitem = new Item(pentry, nCost);
+            queueItems.push_back(pitem);
+            queueWork.push_back(pitem);
+        }
+        condWorker.notify_one();
+        return true;
+    }
+
+    /**
+     * Take the next entry, waiting for the workers to finish it. The caller owns
+     * the returned entry. Returns NULL once the producer is done, and throws if it
+     * failed with a runtime_error.
+     */
+    Entry* Next()
+    {
+        Entry* pentry = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while ((queueItems.empty() && !fProducerDone) || (!queueItems.empty() && !queueItems.front()->fDone))
+                condDone.wait(lock);
+            if (queueItems.empty()) {
+                if (!strError.empty())
+                    throw std::runtime_error(strError);
+                return NULL;
+            }
+            Item* pitem = queueItems.front();
+            queueItems.pop_front();
+            nCostInFlight -= pitem->nCost;
+            pentry = pitem->pentry;
+            delete pitem;
+        }
+        condProducer.notify_one();
+        return pentry;
+    }
+};
+
+/**
+ * Reads and checks the blocks VerifyDB walks through ahead of it. Worker
+ * threads read each block, run the context-free block checks (level 1) and
+ * read its undo data (level 2); VerifyDB takes the results in chain order
+ * with Next() and does the rest. The workers only look at block index
+ * entries VerifyDB hands them, which cannot change while it holds cs_main.
+ */
+class CVerifyDBReader
+{
+public:
+    struct Entry {
+        CBlockIndex* pindex;
+        CBlock block;
+        CBlockUndo blockundo;
+        bool fHaveBlock;
+        bool fHaveUndo;
+
+        Entry() : pindex(NULL), fHaveBlock(false), fHaveUndo(false) {}
+    };
+
+private:
+    std::vector<CBlockIndex*> vIndex;
+    int nCheckLevel;
+    //! Declared last, so its threads are stopped before the rest goes away
+    CReadAheadQueue<Entry> queue;
+
+    void Produce()
+    {
+        BOOST_FOREACH (CBlockIndex* pindex, vIndex) {
+            Entry* pentry = new Entry();
+            pentry->pindex = pindex;
+            if (!queue.Push(pentry, 1)) {
+                delete pentry;
+                return;
+            }
+        }
+    }
+
+    void Work(Entry& entry)
+    {
+        //! check level 0: read from disk
+        entry.fHaveBlock = ReadBlockFromDisk(entry.block, entry.pindex);
+        //! check level 1: the context-free part of CheckBlock, VerifyDB runs the rest
+        if (entry.fHaveBlock && nCheckLevel >= 1) {
+            CValidationState state;
+            CheckBlockContextFree(entry.block, state, true, true, true, false);
+        }
+        //! check level 2: read undo data
+        if (entry.fHaveBlock && nCheckLevel >= 2) {
+            CDiskBlockPos pos = entry.pindex->GetUndoPos();
+            if (!pos.IsNull())
+                entry.fHaveUndo = entry.blockundo.ReadFromDisk(pos, entry.pindex->pprev->GetBlockHash());
+        }
+    }
+
+public:
+    //! Reads four blocks per worker, and at least 16, ahead of VerifyDB
+    CVerifyDBReader(const std::vector<CBlockIndex*>& vIndexIn, int nCheckLevelIn) :
+        vIndex(vIndexIn), nCheckLevel(nCheckLevelIn),
+        queue(std::max(4 * CReadAheadQueue<Entry>::GetWorkerCount(), 16), boost::bind(&CVerifyDBReader::Produce, this),
+              boost::bind(&CVerifyDBReader::Work, this, _1), "Metrix-verifyread", "Metrix-verifydb")
+    {
+        queue.Start();
+    }
+
+    //! Take the next block, waiting for the workers. The caller owns the entry; NULL after the last block.
+    Entry* Next()
+    {
+        return queue.Next();
+    }
+};
+
 bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
 {
     LOCK(cs_main);
@@ -3930,31 +5676,40 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
+
+    //! Blocks to verify, newest first. Blocks below a loaded UTXO snapshot or pruned ones have no data to verify.
+    std::vector<CBlockIndex*> vIndex;
     for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
+        if (pindex->nHeight < chainActive.Height() - nCheckDepth || !(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
+        vIndex.push_back(pindex);
+    }
+    //! Undo data still queued for writing must be on disk before the workers read it
+    if (nCheckLevel >= 2)
+        connectpipeline.Sync();
+    CVerifyDBReader reader(vIndex, nCheckLevel);
+
+    while (true) {
         boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
-        if (pindex->nHeight < chainActive.Height() - nCheckDepth)
+        boost::scoped_ptr<CVerifyDBReader::Entry> pentry(reader.Next());
+        if (!pentry)
             break;
-        CBlock block;
+        CBlockIndex* pindex = pentry->pindex;
+        CBlock& block = pentry->block;
+        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         //! check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
+        if (!pentry->fHaveBlock)
             return error("VerifyDB() : *** block.ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-        //! check level 1: verify block validity
+        //! check level 1: verify block validity; the workers already ran the context-free part
         if (nCheckLevel >= 1 && !CheckBlock(block, state))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         //! check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            }
-        }
+        if (nCheckLevel >= 2 && !pindex->GetUndoPos().IsNull() && !pentry->fHaveUndo)
+            return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         //! check level 3: check for inconsistencies during memory-only disconnect of tip blocks
         if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
             bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, &fClean))
+            if (!DisconnectBlock(block, state, pindex, coins, &fClean, pentry->fHaveUndo ? &pentry->blockundo : NULL))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
             pindexState = pindex->pprev;
             if (!fClean) {
@@ -4024,6 +5779,8 @@ bool InitBlockIndex()
 
     //! Use the provided setting for -txindex in the new database
     pblocktree->WriteFlag("txindex", true); //!we need to tx index to lookup transactions for POS
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
+    pblocktree->WriteFlag("timestampindex", fTimestampIndex);
     LogPrintf("Initializing databases...\n");
 
     //! Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4050,23 +5807,384 @@ bool InitBlockIndex()
         }
     }
 
-    return true;
+    return true;
+}
+
+//! Version of the dumptxoutset file format
+static const int UTXO_SNAPSHOT_VERSION = 1;
+
+//! Write the snapshot contents to fileout, see DumpUTXOSnapshot
+static bool WriteUTXOSnapshot(CAutoFile& fileout, uint256& hashBlock, int& nHeight, uint64_t& nCoins, uint256& hashContent)
+{
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor;
+    nCoins = 0;
+    try {
+        {
+            LOCK(cs_main);
+            FlushStateToDisk();
+            if (chainActive.Tip() == NULL || pcoinsdbview->GetBestBlock() != chainActive.Tip()->GetBlockHash())
+                return error("%s : coin database is not at the chain tip", __func__);
+            hashBlock = chainActive.Tip()->GetBlockHash();
+            nHeight = chainActive.Height();
+
+            fileout << FLATDATA(Params().MessageStart()) << UTXO_SNAPSHOT_VERSION << hashBlock << nHeight;
+            hasher << hashBlock << nHeight;
+
+            //! The block index carries what PoS validation needs: stake modifiers, hashProof and nMoneySupply.
+            //! Which stake modifier gets serialized depends on nStakeModifierV2, so that goes first.
+            for (int i = 0; i <= nHeight; i++) {
+                CDiskBlockIndex diskindex(chainActive[i]);
+                diskindex.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_FROM_SNAPSHOT;
+                diskindex.nFile = 0;
+                diskindex.nDataPos = 0;
+                diskindex.nUndoPos = 0;
+                fileout << diskindex.nStakeModifierV2 << diskindex;
+                hasher << diskindex.nStakeModifierV2 << diskindex;
+            }
+
+            //! The cursor reads a consistent LevelDB snapshot, so the coins can be written without cs_main
+            pcursor.reset(pcoinsdbview->Cursor());
+        }
+
+        for (; pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            uint256 txid;
+            CCoins coins;
+            if (!pcursor->GetKey(txid) || !pcursor->GetValue(coins))
+                return error("%s : unable to read coin database", __func__);
+            fileout << txid << coins;
+            hasher << txid << coins;
+            nCoins++;
+        }
+
+        hashContent = hasher.GetHash();
+        fileout << uint256(0) << nCoins << hashContent;
+    } catch (std::exception& e) {
+        return error("%s : I/O error: %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, uint256& hashBlock, int& nHeight, uint64_t& nCoins, uint256& hashContent)
+{
+    //! Written under another name and renamed once complete, so a failed or interrupted dump leaves no snapshot behind
+    boost::filesystem::path pathTemp = path.string() + ".incomplete";
+    FILE* file = fopen(pathTemp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : failed to open %s", __func__, pathTemp.string());
+
+    bool fWritten = false;
+    try {
+        fWritten = WriteUTXOSnapshot(fileout, hashBlock, nHeight, nCoins, hashContent);
+        if (fWritten)
+            FileCommit(fileout);
+        fileout.fclose();
+        if (fWritten && !RenameOver(pathTemp, path)) {
+            fWritten = false;
+            error("%s : failed to rename %s to %s", __func__, pathTemp.string(), path.string());
+        }
+    } catch (const boost::thread_interrupted&) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTemp);
+        throw;
+    }
+    if (!fWritten) {
+        boost::filesystem::remove(pathTemp);
+        return false;
+    }
+
+    LogPrintf("Dumped UTXO snapshot at height %d: %u coins, content hash %s\n", nHeight, nCoins, hashContent.ToString());
+    return true;
+}
+
+/**
+ * Read a snapshot written by DumpUTXOSnapshot and check its content hash. With fWrite
+ * set, its block index entries and coins are also written to the (empty) databases.
+ */
+static bool ReadUTXOSnapshot(const boost::filesystem::path& path, bool fWrite, uint256& hashBlock, int& nHeight, uint256& hashContent)
+{
+    FILE* file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : failed to open %s", __func__, path.string());
+
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    try {
+        unsigned char pchMessageStart[MESSAGE_START_SIZE];
+        int nVersion = 0;
+        filein >> FLATDATA(pchMessageStart) >> nVersion >> hashBlock >> nHeight;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE))
+            return error("%s : snapshot is for a different network", __func__);
+        if (nVersion != UTXO_SNAPSHOT_VERSION)
+            return error("%s : unsupported snapshot version %d", __func__, nVersion);
+        hasher << hashBlock << nHeight;
+
+        uint256 hashPrev = 0;
+        for (int i = 0; i <= nHeight; i++) {
+            boost::this_thread::interruption_point();
+            CDiskBlockIndex diskindex;
+            filein >> diskindex.nStakeModifierV2;
+            filein >> diskindex;
+            hasher << diskindex.nStakeModifierV2 << diskindex;
+
+            uint256 hash = diskindex.GetBlockHash();
+            if (diskindex.nHeight != i || diskindex.hashPrev != hashPrev || (i == 0 && hash != Params().HashGenesisBlock()))
+                return error("%s : block index at height %d does not extend the snapshot chain", __func__, i);
+            if (diskindex.nStatus != (BLOCK_VALID_SCRIPTS | BLOCK_FROM_SNAPSHOT))
+                return error("%s : unexpected block status at height %d", __func__, i);
+            hashPrev = hash;
+
+            if (fWrite && !pblocktree->WriteBlockIndex(diskindex))
+                return error("%s : failed to write block index", __func__);
+        }
+        if (hashPrev != hashBlock)
+            return error("%s : snapshot chain does not end in %s", __func__, hashBlock.ToString());
+
+        CCoinsMap mapCoins;
+        uint64_t nCoins = 0;
+        while (true) {
+            boost::this_thread::interruption_point();
+            uint256 txid;
+            filein >> txid;
+            if (txid == 0)
+                break;
+            CCoins coins;
+            filein >> coins;
+            hasher << txid << coins;
+            nCoins++;
+
+            if (fWrite) {
+                CCoinsCacheEntry& entry = mapCoins[txid];
+                entry.coins.swap(coins);
+                //! The coin database is empty, so nothing needs to be looked up to replace
+                entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                if (mapCoins.size() >= 100000 && !pcoinsdbview->BatchWrite(mapCoins, 0))
+                    return error("%s : failed to write coins", __func__);
+            }
+        }
+
+        uint64_t nCoinsFile = 0;
+        uint256 hashContentFile;
+        filein >> nCoinsFile >> hashContentFile;
+        hashContent = hasher.GetHash();
+        if (nCoinsFile != nCoins || hashContentFile != hashContent)
+            return error("%s : snapshot is corrupt", __func__);
+
+        //! Setting the best block last makes the loaded coins visible as a whole
+        if (fWrite && !pcoinsdbview->BatchWrite(mapCoins, hashBlock))
+            return error("%s : failed to write coins", __func__);
+    } catch (std::exception& e) {
+        return error("%s : deserialize or I/O error: %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool LoadUTXOSnapshot(const boost::filesystem::path& path)
+{
+    LOCK(cs_main);
+    if (!mapBlockIndex.empty() || pcoinsdbview->GetBestBlock() != 0)
+        return error("%s : a snapshot can only be loaded into an empty data directory", __func__);
+
+    //! Check the whole file against the trusted hash before touching the databases
+    uint256 hashBlock, hashContent;
+    int nHeight = 0;
+    if (!ReadUTXOSnapshot(path, false, hashBlock, nHeight, hashContent))
+        return false;
+    const MapUTXOSnapshots& mapSnapshots = Params().UTXOSnapshots();
+    MapUTXOSnapshots::const_iterator it = mapSnapshots.find(nHeight);
+    if (it == mapSnapshots.end() || it->second.first != hashBlock || it->second.second != hashContent)
+        return error("%s : snapshot at height %d (block %s, content hash %s) is not a trusted snapshot", __func__,
+                     nHeight, hashBlock.ToString(), hashContent.ToString());
+
+    LogPrintf("Loading UTXO snapshot at height %d, block %s...\n", nHeight, hashBlock.ToString());
+    pblocktree->WriteFlag("txindex", true);
+    //! The spent and timestamp indexes only cover the blocks connected on top of the snapshot
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
+    pblocktree->WriteFlag("timestampindex", fTimestampIndex);
+    pblocktree->WriteFlag("loadingsnapshot", true);
+    if (!ReadUTXOSnapshot(path, true, hashBlock, nHeight, hashContent))
+        return false;
+    pblocktree->WriteFlag("loadingsnapshot", false);
+    return true;
+}
+
+//! Whether the address index covers the whole active chain (protected by cs_main)
+static bool fAddressIndexReady = false;
+//! Blocks up to this height are indexed by ThreadAddressIndex, later ones by ConnectBlock (protected by cs_main)
+static int nAddressIndexBuildHeight = -1;
+
+bool InitAddressIndex()
+{
+    LOCK(cs_main);
+    bool fComplete = false;
+    pblocktree->ReadFlag("addrindex", fComplete);
+    if (!fAddressIndex) {
+        //! The rows go stale from here on, they are wiped when the index is switched on again
+        if (fComplete && !pblocktree->WriteFlag("addrindex", false))
+            return error("%s : failed to write address index flag", __func__);
+        return pblocktree->EraseAddressIndexProgress();
+    }
+    if (fComplete) {
+        fAddressIndexReady = true;
+        return true;
+    }
+
+    int nProgress = -1;
+    if (!pblocktree->ReadAddressIndexProgress(nProgress)) {
+        LogPrintf("Wiping address index before building it...\n");
+        if (!pblocktree->WipeAddressIndex() || !pblocktree->WriteAddressIndexProgress(-1))
+            return error("%s : failed to reset the address index", __func__);
+    }
+    nAddressIndexBuildHeight = chainActive.Height();
+    return true;
+}
+
+bool IsAddressIndexReady()
+{
+    LOCK(cs_main);
+    return fAddressIndex && fAddressIndexReady;
+}
+
+void ThreadAddressIndex()
+{
+    RenameThread("Metrix-addrindex");
+
+    int nHeight = -1;
+    {
+        LOCK(cs_main);
+        if (!fAddressIndex || fAddressIndexReady || !pblocktree->ReadAddressIndexProgress(nHeight))
+            return;
+    }
+    LogPrintf("%s: building address index from height %d\n", __func__, nHeight + 1);
+
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        CBlockIndex* pindex = NULL;
+        {
+            LOCK(cs_main);
+            if (nHeight >= std::min(nAddressIndexBuildHeight, chainActive.Height()))
+                break;
+            pindex = chainActive[nHeight + 1];
+        }
+
+        //! Blocks loaded from a UTXO snapshot have nothing to index
+        CBlock block;
+        CBlockUndo blockundo;
+        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (!ReadBlockFromDisk(block, pindex)) {
+                error("%s : failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+                return;
+            }
+            if (pindex->pprev) {
+                connectpipeline.Sync();
+                if (!blockundo.ReadFromDisk(pindex->GetUndoPos(), pindex->pprev->GetBlockHash())) {
+                    error("%s : failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+                    return;
+                }
+            }
+        }
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+        GetAddressIndexRows(block, blockundo, pindex->nHeight, vAddressIndex, vAddressUnspent);
+
+        LOCK(cs_main);
+        //! Reorganized away while we were reading it: redo the height
+        if (chainActive[pindex->nHeight] != pindex)
+            continue;
+
+        //! Outputs spent since then never get an unspent row, so there is nothing to erase
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vStillUnspent;
+        for (unsigned int i = 0; i < vAddressUnspent.size(); i++) {
+            if (vAddressUnspent[i].second.IsNull())
+                continue;
+            const CCoins* coins = pcoinsTip->AccessCoins(vAddressUnspent[i].first.txhash);
+            if (coins && coins->IsAvailable(vAddressUnspent[i].first.index))
+                vStillUnspent.push_back(vAddressUnspent[i]);
+        }
+        if (!pblocktree->WriteAddressIndex(vAddressIndex) || !pblocktree->UpdateAddressUnspentIndex(vStillUnspent) ||
+            !pblocktree->WriteAddressIndexProgress(pindex->nHeight)) {
+            error("%s : failed to write address index", __func__);
+            return;
+        }
+        nHeight = pindex->nHeight;
+    }
+
+    LOCK(cs_main);
+    if (!pblocktree->WriteFlag("addrindex", true) || !pblocktree->EraseAddressIndexProgress()) {
+        error("%s : failed to write address index flag", __func__);
+        return;
+    }
+    fAddressIndexReady = true;
+    LogPrintf("%s: address index is complete\n", __func__);
+}
+
+bool GetAddressIndex(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart, int nEnd)
+{
+    if (!IsAddressIndexReady())
+        return error("%s : address index not available", __func__);
+    return pblocktree->ReadAddressIndex(hashBytes, type, vAddressIndex, nStart, nEnd);
+}
+
+bool GetAddressUnspent(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    if (!IsAddressIndexReady())
+        return error("%s : address index not available", __func__);
+    return pblocktree->ReadAddressUnspentIndex(hashBytes, type, vUnspent);
+}
+
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    if (!fSpentIndex)
+        return error("%s : spent index not enabled", __func__);
+    return pblocktree->ReadSpentIndex(key, value);
+}
+
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes)
+{
+    if (!fTimestampIndex)
+        return error("%s : timestamp index not enabled", __func__);
+    return pblocktree->ReadTimestampIndex(nHigh, nLow, vHashes);
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+/**
+ * Reads a block file for LoadExternalBlockFile. A reader thread locates the
+ * blocks in the file and copies out their bytes, worker threads deserialize
+ * them, compute their hashes and run the context-free block checks, and the
+ * caller takes the blocks in file order with Next(). The bytes of the blocks
+ * between reader and caller are bounded by MAX_BYTES_IN_FLIGHT.
+ */
+class CBlockFileReader
 {
-    //! Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    uint64_t nStart = GetTimeMillis();
+public:
+    struct Entry {
+        //! Position of the block in the file
+        uint64_t nPos;
+        unsigned int nSize;
+        //! The raw block, released once deserialized
+        CDataStream ssBlock;
+        CBlock block;
+        uint256 hash;
+        //! False if the block could not be deserialized; strError says why
+        bool fValid;
+        std::string strError;
 
-    int nLoaded = 0;
-    try {
-        //! This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+        Entry() : nPos(0), nSize(0), ssBlock(SER_DISK, CLIENT_VERSION), fValid(false) {}
+    };
+
+private:
+    static const size_t MAX_BYTES_IN_FLIGHT = 64 * 1024 * 1024;
+
+    CBufferedFile blkdat;
+    //! Declared last, so its threads are stopped before the file is closed
+    CReadAheadQueue<Entry> queue;
+
+    void Produce()
+    {
         uint64_t nRewind = blkdat.GetPos();
         while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
             blkdat.SetPos(nRewind);
             nRewind++;         //! start one byte further next time, in case of failure
             blkdat.SetLimit(); //! remove former limit
@@ -4087,19 +6205,92 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 //! no valid block header found; don't complain
                 break;
             }
+            Entry* pentry = new Entry();
             try {
-                //! read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                //! copy out the block, the workers deserialize it
+                pentry->nPos = blkdat.GetPos();
+                pentry->nSize = nSize;
+                pentry->ssBlock.resize(nSize);
+                blkdat.SetLimit(pentry->nPos + nSize);
+                blkdat.read(&pentry->ssBlock[0], nSize);
                 nRewind = blkdat.GetPos();
+            } catch (const std::exception& e) {
+                delete pentry;
+                LogPrintf("%s() : I/O error caught during load:%s\n", __func__, e.what());
+                continue;
+            }
+            if (!queue.Push(pentry, nSize)) {
+                delete pentry;
+                break;
+            }
+        }
+    }
+
+    void Work(Entry& entry)
+    {
+        try {
+            entry.ssBlock >> entry.block;
+            entry.block.nSerializedSize = entry.nSize - entry.ssBlock.size();
+            entry.hash = entry.block.GetHash();
+            entry.fValid = true;
+        } catch (const std::exception& e) {
+            entry.strError = e.what();
+        }
+        entry.ssBlock = CDataStream(SER_DISK, CLIENT_VERSION);
+        //! On failure the connect thread repeats the checks and reports the problem
+        if (entry.fValid) {
+            CValidationState state;
+            CheckBlockContextFree(entry.block, state, true, true, true, false);
+        }
+    }
+
+public:
+    //! This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBlockFileReader(FILE* fileIn) :
+        blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION),
+        queue(MAX_BYTES_IN_FLIGHT, boost::bind(&CBlockFileReader::Produce, this),
+              boost::bind(&CBlockFileReader::Work, this, _1), "Metrix-blkread", "Metrix-blkcheck")
+    {
+        queue.Start();
+    }
+
+    /**
+     * Take the next block of the file, waiting for the workers to finish it.
+     * The caller owns the returned entry. Returns NULL at the end of the file,
+     * and throws if reading the file failed.
+     */
+    Entry* Next()
+    {
+        return queue.Next();
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+{
+    //! Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    uint64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        CBlockFileReader reader(fileIn);
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            boost::scoped_ptr<CBlockFileReader::Entry> pentry(reader.Next());
+            if (!pentry)
+                break;
+            if (!pentry->fValid) {
+                LogPrintf("%s() : Deserialize or I/O error caught during load:%s\n", __func__, pentry->strError);
+                continue;
+            }
+            try {
+                if (dbp)
+                    dbp->nPos = pentry->nPos;
+                CBlock& block = pentry->block;
 
                 //! detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
+                uint256 hash = pentry->hash;
                 if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                             block.hashPrevBlock.ToString());
@@ -4109,6 +6300,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 }
                 //! process in case the block isn't known yet
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                    LimitValidationInterfaceQueue();
                     CValidationState state;
                     if (ProcessNewBlock(state, NULL, &block, dbp))
                         nLoaded++;
@@ -4188,13 +6380,15 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL; //! Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL; //! Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL; //! Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL; //! Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL; //! Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; //! Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
     while (pindex != NULL) {
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
-        if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstMissing == NULL && !(pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_FROM_SNAPSHOT))) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -4205,12 +6399,18 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); //! Genesis block's hash must match.
             assert(pindex == chainActive.Genesis()); //! The current active chain's genesis block must be this block.
         }
-        //! HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        if (!fHavePruned) {
+            //! HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
+            assert(!(pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_FROM_SNAPSHOT)) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            //! If we've pruned, then we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0);  //! nSequenceId can't be set for blocks that aren't linked
-        //! All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0)); //! nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        //! All parents having been processed is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0)); //! nChainTx == 0 is used to signal that all parent block's transaction data was processed.
         assert(pindex->nHeight == nHeight); //! nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainTrust >= pindex->pprev->nChainTrust); //! For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight))); //! The pskip pointer must point back for all but the first 2 blocks.
@@ -4222,7 +6422,7 @@ void static CheckBlockIndex()
             //! Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); //! The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
             if (pindexFirstInvalid == NULL) { //! If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
                  assert(setBlockIndexCandidates.count(pindex));
             }
@@ -4240,11 +6440,12 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { //! If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
-            }
-        } else { //! If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            //! If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindexFirstNeverProcessed == NULL) {
+            //! If this block does not have block data available, or all parents were received, it cannot be in mapBlocksUnlinked.
             assert(!foundInUnlinked);
         }
         //! assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
@@ -4265,6 +6466,7 @@ void static CheckBlockIndex()
             //! If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4436,10 +6638,10 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
+                if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
                     if (chainActive.Contains(mi->second)) {
                         send = true;
                     } else {
@@ -4453,6 +6655,15 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                //! Once the upload target is close, stop serving historical blocks (and filtered
+                //! blocks, which are mostly requested during SPV sync) to everyone but whitelisted peers
+                if (send && CNode::OutboundTargetReached(true) &&
+                    (((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE)) || inv.type == MSG_FILTERED_BLOCK) &&
+                    !pfrom->fWhitelisted) {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 if (send) {
                     //! Send block from disk
                     CBlock block;
@@ -4460,7 +6671,18 @@ void static ProcessGetData(CNode* pfrom)
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
-                    else //! MSG_FILTERED_BLOCK)
+                    else if (inv.type == MSG_CMPCT_BLOCK) {
+                        /**
+                         * Only send a compact block for recent blocks: the peer will not have
+                         * the transactions of older ones in its mempool anymore, so the
+                         * round trips for the missing ones would only slow it down.
+                         */
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                            CBlockHeaderAndShortTxIDs cmpctblock(block);
+                            pfrom->PushMessage("cmpctblock", cmpctblock);
+                        } else
+                            pfrom->PushMessage("block", block);
+                    } else //! MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
@@ -4476,7 +6698,7 @@ void static ProcessGetData(CNode* pfrom)
                              */
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         //! else
@@ -4571,7 +6793,7 @@ void static ProcessGetData(CNode* pfrom)
             //! Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4592,6 +6814,112 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/**
+ * Hand a block received from a peer, either in full or reconstructed from a
+ * compact block, to ProcessNewBlock and report validation failures back.
+ */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block)
+{
+    //! Don't let validation run too far ahead of the wallets
+    LimitValidationInterfaceQueue();
+
+    CInv inv(MSG_BLOCK, block.GetHash());
+    LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+    pfrom->AddInventoryKnown(inv);
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+/**
+ * Complete the compact block in flight from pfrom with the transactions in resp.
+ * Returns false if there is nothing to fill, the peer misbehaved, or the block
+ * had to be requested in full. Requires cs_main.
+ */
+bool static FillCompactBlock(CNode* pfrom, const BlockTransactions& resp, CBlock& block)
+{
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+    if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+        itInFlight->second.first != pfrom->GetId()) {
+        LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+        return false;
+    }
+
+    ReadStatus status = itInFlight->second.second->partialBlock->FillBlock(block, resp.txn);
+    if (status == READ_STATUS_INVALID) {
+        MarkBlockAsReceived(resp.blockhash);
+        Misbehaving(pfrom->GetId(), 100);
+        LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+        return false;
+    } else if (status == READ_STATUS_FAILED) {
+        //! Might have collided, fall back to getdata now
+        itInFlight->second.second->partialBlock.reset();
+        vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+        pfrom->PushMessage("getdata", vInv);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Re-validate up to MAX_ORPHAN_TX_BATCH orphans from pfrom's work set whose
+ * missing parents have arrived. Accepted orphans queue their own children,
+ * so long chains are resolved over several message handler passes instead
+ * of stalling the handler in one go.
+ */
+static void ProcessOrphanTx(CNode* pfrom)
+{
+    AssertLockHeld(cs_main);
+    set<NodeId> setMisbehaving;
+    unsigned int nProcessed = 0;
+    while (!pfrom->setOrphanWorkSet.empty() && nProcessed < MAX_ORPHAN_TX_BATCH) {
+        const uint256 orphanHash = *pfrom->setOrphanWorkSet.begin();
+        pfrom->setOrphanWorkSet.erase(pfrom->setOrphanWorkSet.begin());
+
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        const CTransaction orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        if (setMisbehaving.count(fromPeer))
+            continue;
+        nProcessed++;
+
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            AddOrphanWork(orphanTx, pfrom->setOrphanWorkSet);
+            EraseOrphanTx(orphanHash);
+        } else if (!fMissingInputs2) {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                setMisbehaving.insert(fromPeer);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // too-little-fee orphan
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+        }
+        //! Orphans that still miss other parents stay, and are woken again when those arrive
+        mempool.check(pcoinsTip);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -4724,6 +7052,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SENDHEADERS_VERSION) {
+            /**
+             * Tell our peer we prefer to receive headers rather than inv's.
+             * We send this to non-NODE NETWORK peers as well, because even
+             * non-NODE NETWORK peers can announce blocks (such as pruning
+             * nodes)
+             */
+            pfrom->PushMessage("sendheaders");
+        }
+    }
+
+
+    else if (strCommand == "sendheaders") {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
     }
 
 
@@ -4755,7 +7099,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     //! Use deterministic randomness to send to the same nodes for 24 hours
-                    //! at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    //! at a time so the addrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -4827,9 +7171,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                      */
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                            vToFetch.push_back(inv);
+                    if (CanDirectFetch() && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                            //! Near the tip, peers that support it send the block as short ids
+                            if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION)
+                                vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                            else
+                                vToFetch.push_back(inv);
                             /**
                              * Mark block as in flight already, even though the actual "getdata" message only goes out
                              * later (within the same cs_main lock, though).
@@ -4895,6 +7242,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            //! If pruning, don't inv blocks unless we have them on disk and are likely to still have
+            //! them for the time window (1 hour) that block relay might require.
+            const int nPrunedBlocksLikelyToHave = MIN_BLOCKS_TO_KEEP - 3600 / Params().TargetSpacing();
+            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Tip()->nHeight - nPrunedBlocksLikelyToHave)) {
+                LogPrint("net", " getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0) {
                 //! When this block is requested, we'll send an inv that'll make them
@@ -4936,19 +7290,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        /**
+         * pindex can be NULL either if we sent chainActive.Tip() OR
+         * if our peer has chainActive.Tip() (and thus we are sending an empty
+         * headers message). In both cases it's safe to update
+         * pindexBestHeaderSent to be our tip.
+         */
+        CNodeState* nodestate = State(pfrom->GetId());
+        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
 
     else if (strCommand == "tx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        //! Do the signature work before taking cs_main for the acceptance itself
+        if (!mempool.exists(inv.hash))
+            PreVerifyTransaction(tx);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
@@ -4958,69 +7322,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
                      pfrom->id, pfrom->strSubVer.c_str(),
                      tx.GetHash().ToString().c_str(),
                      mempool.mapTx.size());
 
-            //! Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi) {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    vEraseQueue.push_back(orphanHash);
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // too-little-fee orphan
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH (uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            //! Wake the orphans that spend this transaction; the first batch is
+            //! handled right away, the rest on later message handler passes
+            AddOrphanWork(tx, pfrom->setOrphanWorkSet);
+            EraseOrphanTx(inv.hash);
+            ProcessOrphanTx(pfrom);
         } else if (fMissingInputs) {
             AddOrphanTx(tx, pfrom->GetId());
 
             //! DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanTxSize = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanTxSize);
             if (nEvicted > 0)
-                LogPrintf("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else if (pfrom->fWhitelisted) {
             /**
              * Always relay transactions received from whitelisted peers, even
@@ -5043,11 +7364,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "headers" && !fImporting && !fReindex) //! Ignore headers received while importing
     {
-        //! Ignore headers received if we have enough and didn't ask for more
-        CNodeState *nodestate = State(pfrom->GetId());
-        if (!CanRequestMoreHeaders() && !nodestate->fSyncStarted)
-            return error("ignoring headers we did not request");
-
         std::vector<CBlockHeader> headers;
 
         //! Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
@@ -5056,6 +7372,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             Misbehaving(pfrom->GetId(), 20);
             return error("headers message size = %u", nCount);
         }
+
+        //! Ignore headers received if we have enough and didn't ask for more, except for new block announcements
+        CNodeState *nodestate = State(pfrom->GetId());
+        if (!CanRequestMoreHeaders() && !nodestate->fSyncStarted && nCount > MAX_BLOCKS_TO_ANNOUNCE)
+            return error("ignoring headers we did not request");
         headers.resize(nCount);       
         for (unsigned int n = 0; n < nCount; n++) {
             vRecv >> headers[n];
@@ -5071,6 +7392,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        if (nCount <= MAX_BLOCKS_TO_ANNOUNCE && mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end()) {
+            /**
+             * A block announcement that doesn't connect to our header tree, e.g. because we
+             * missed an earlier one. Ask for the headers in between, but only so many times
+             * in a row before treating the peer as misbehaving.
+             */
+            LogPrint("net", "received unconnecting header announcement %s from peer=%d, sending getheaders\n", headers[0].GetHash().ToString(), pfrom->id);
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            if (++nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                Misbehaving(pfrom->GetId(), 20);
+            return true;
+        }
+
         CBlockIndex *pindexLast = NULL;
         BOOST_FOREACH(const CBlockHeader& header, headers) {
             CValidationState state;
@@ -5090,6 +7425,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+        nodestate->nUnconnectingHeaders = 0;
 
         if (nCount == MAX_HEADERS_RESULTS && pindexLast && CanRequestMoreHeaders()) {
             /**
@@ -5101,30 +7437,200 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
         }
 
+        /**
+         * If this set of headers is valid and ends in a block with at least as
+         * much trust as our tip, download as much as possible right away instead
+         * of waiting for the next SendMessages pass.
+         */
+        if (pindexLast && CanDirectFetch() && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainTrust <= pindexLast->nChainTrust) {
+            vector<CBlockIndex*> vToFetch;
+            CBlockIndex* pindexWalk = pindexLast;
+            //! Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    //! We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            /**
+             * If pindexWalk still isn't on our main chain, we're looking at a
+             * very large reorg at a time we think we're close to caught up to
+             * the main chain. Bail out on the direct fetch and rely on parallel
+             * download instead.
+             */
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n", pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                //! Download as much as possible, from earliest to latest.
+                BOOST_REVERSE_FOREACH(CBlockIndex* pindex, vToFetch) {
+                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+                        break;
+                    if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION)
+                        vGetData.push_back(CInv(MSG_CMPCT_BLOCK, pindex->GetBlockHash()));
+                    else
+                        vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), pindex);
+                    LogPrint("net", "Requesting block %s from peer=%d\n", pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1)
+                    LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n", pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+                if (!vGetData.empty())
+                    pfrom->PushMessage("getdata", vGetData);
+            }
+        }
+
         CheckBlockIndex();
     }
 
     else if (strCommand == "block" && !fImporting && !fReindex) //! Ignore blocks received while importing
     {
-        int size = vRecv.size();
         CBlock block;
+        unsigned int nSize = vRecv.size();
         vRecv >> block;
-        uint256 hashBlock = block.GetHash();
+        block.nSerializedSize = nSize - vRecv.size();
+        ProcessBlockFromPeer(pfrom, block);
+    }
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
-        pfrom->AddInventoryKnown(inv);
-        CValidationState state;
-        ProcessNewBlock(state, pfrom, &block);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) //! Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                //! Doesn't connect; ask for the headers in between, counted like an unconnecting headers message
+                if (!IsInitialBlockDownload()) {
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+                    CNodeState* nodestate = State(pfrom->GetId());
+                    if (++nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                        Misbehaving(pfrom->GetId(), 20);
+                }
+                return true;
+            }
+
+            CBlockIndex* pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in cmpctblock from peer=%d", pfrom->id);
+                }
+            }
+            if (pindex == NULL)
+                return true;
+
+            uint256 hash = pindex->GetBlockHash();
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+            State(pfrom->GetId())->nUnconnectingHeaders = 0;
+
+            //! We only ever ask for compact blocks explicitly, so ignore anything we did not request from this peer
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) || itInFlight == mapBlocksInFlight.end() ||
+                itInFlight->second.first != pfrom->GetId())
+                return true;
+
+            boost::shared_ptr<PartiallyDownloadedBlock>& partialBlock = itInFlight->second.second->partialBlock;
+            partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+
+            //! Transactions waiting in the orphan pool are likely to be in the block as well
+            vector<const CTransaction*> vExtraTxn;
+            vExtraTxn.reserve(mapOrphanTransactions.size());
+            for (map<uint256, COrphanTx>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+                vExtraTxn.push_back(&mi->second.tx);
+
+            ReadStatus status = partialBlock->InitData(cmpctblock, vExtraTxn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us invalid compact block", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                //! Short id collision; the block stays in flight, so just ask for all of it
+                partialBlock.reset();
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                BlockTransactions txn;
+                txn.blockhash = hash;
+                fBlockReconstructed = FillCompactBlock(pfrom, txn, block);
+            } else {
+                req.blockhash = hash;
+                LogPrint("net", "requesting %u missing transactions of cmpctblock %s from peer=%d\n", req.indexes.size(), hash.ToString(), pfrom->id);
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            //! Only serve recent blocks this way; anyone asking for older ones gets the full block
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
             }
+            resp.txn[i] = block.vtx[req.indexes[i]];
         }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) //! Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            fBlockReconstructed = FillCompactBlock(pfrom, resp, block);
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block);
     }
 
 
@@ -5375,6 +7881,15 @@ bool ProcessMessages(CNode* pfrom)
     //! this maintains the order of responses
     if (!pfrom->vRecvGetData.empty())
         return fOk;
+
+    if (!pfrom->setOrphanWorkSet.empty()) {
+        LOCK(cs_main);
+        ProcessOrphanTx(pfrom);
+    }
+
+    //! later transactions from this peer may depend on the orphans still queued
+    if (!pfrom->setOrphanWorkSet.empty())
+        return fOk;
     int nBlocksInFlight = 0;
     {
         LOCK(cs_main);
@@ -5563,8 +8078,8 @@ bool SendMessages(CNode* pto)
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                //! returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     //! receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -5583,6 +8098,99 @@ bool SendMessages(CNode* pto)
             pto->nNextLocalAddrSend = PoissonNextSend(nNow, AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL);
         }
 
+        /**
+         * Try sending block announcements via headers
+         */
+        {
+            /**
+             * If we have less than MAX_BLOCKS_TO_ANNOUNCE in our list of block hashes
+             * we're going to announce, and our peer prefers headers, try to send
+             * headers. Otherwise fall back to inv'ing the tip. Blocks that don't
+             * connect to what the peer knows also fall back to an inv.
+             */
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex* pBestIndex = NULL; //! last header queued for delivery
+            ProcessBlockAvailability(pto->id); //! ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                /**
+                 * Try to find first header that our peer doesn't have, and
+                 * then send all headers past that one. If we come across any
+                 * headers that aren't on chainActive, give up.
+                 */
+                BOOST_FOREACH (const uint256& hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex* pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        //! Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        //! The list of blocks to announce doesn't connect to itself
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; //! keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        //! Peer doesn't have this header but they do have the prior one. Start sending headers.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        //! Peer doesn't have this header or the prior one; nothing will connect, so bail out.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (fRevertToInv) {
+                /**
+                 * If falling back to using an inv, just try to inv the tip.
+                 * The last entry in vBlockHashesToAnnounce was our tip at some point in the past.
+                 */
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256& hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex* pindex = mi->second;
+
+                    //! Warn if we're announcing a block that is not on the main chain.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                                 hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
+
+                    /**
+                     * If the peer announced this block to us, don't inv it back.
+                     * (Since block announcements may not be via inv's, we can't solely rely on
+                     * filterInventoryKnown to track this.)
+                     */
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__, pto->id, hashToAnnounce.ToString());
+                    }
+                }
+            } else if (!vHeaders.empty()) {
+                if (vHeaders.size() > 1) {
+                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__, vHeaders.size(),
+                             vHeaders.front().GetHash().ToString(), vHeaders.back().GetHash().ToString(), pto->id);
+                } else {
+                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__, vHeaders.front().GetHash().ToString(), pto->id);
+                }
+                pto->PushMessage("headers", vHeaders);
+                state.pindexBestHeaderSent = pBestIndex;
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         /*
          * Message: inventory
          */
@@ -5598,7 +8206,7 @@ bool SendMessages(CNode* pto)
             vInv.reserve(pto->vInventoryToSend.size());
             vInv.reserve(std::min<size_t>(1000, pto->vInventoryToSend.size()));
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 //! trickle out tx inv to protect privacy
@@ -5617,13 +8225,11 @@ bool SendMessages(CNode* pto)
                     }
                 }
 
-                //! returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000) {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -5796,6 +8402,8 @@ public:
             delete (*it1).second;
         mapBlockIndex.clear();
         //! orphan transactions
+        mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
         mapOrphanTransactions.clear();
         mapOrphanBlocks.clear();
         mapOrphanBlocksByPrev.clear();
@@ -14,6 +14,7 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
+#include "crypto/common.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "net.h"
@@ -130,16 +131,24 @@ class CBlock;
 class CBlockIndex;
 class CBlockTreeDB;
 class CCoins;
+class CCoinsViewDB;
 class CInv;
 class CKeyItem;
 class CNode;
+class CTxIndexDB;
 class CReserveKey;
 class CScriptCheck;
 class CWallet;
 class CValidationInterface;
 class CValidationState;
 
+struct CAddressIndexKey;
+struct CAddressUnspentKey;
+struct CAddressUnspentValue;
+struct CSpentIndexKey;
+struct CSpentIndexValue;
 struct CBlockTemplate;
+struct CDiskTxPos;
 struct CNodeStateStats;
 
 /** The maximum size for transactions we're willing to relay/mine **/
@@ -149,6 +158,28 @@ static const unsigned int DEFAULT_BLOCK_MAX_SIZE = 1000000;
 static const unsigned int DEFAULT_BLOCK_MIN_SIZE = 0;
 /** Default for -blockprioritysize, maximum space for zero/low-fee transactions **/
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 30000;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Maximum number of wallet notifications queued before block processing waits for the wallets */
+static const unsigned int MAX_VALIDATION_CALLBACK_QUEUE = 10;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -addrindex */
+static const bool DEFAULT_ADDRINDEX = false;
+/** Default for -spentindex */
+static const bool DEFAULT_SPENTINDEX = false;
+/** Default for -timestampindex */
+static const bool DEFAULT_TIMESTAMPINDEX = false;
 /** Default for accepting alerts from the P2P network. */
 static const bool DEFAULT_ALERTS = true;
 /** The maximum allowed number of signature check operations in a block (network rule) */
@@ -159,6 +190,14 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum megabytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 5;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Maximum number of unblocked orphan transactions re-validated per message handler pass for one peer */
+static const unsigned int MAX_ORPHAN_TX_BATCH = 10;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -167,6 +206,14 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; //! 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; //! 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; //! 1 MiB
+/**
+ * Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned.
+ * This covers the recent blocks the masternode payment checks read back, and is the reorg window the
+ * stake metadata of spent outputs is kept for.
+ */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 1500;
+/** Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat) */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 500;
 /** Maximum number of script-checking threads allowed */
@@ -184,6 +231,12 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  verify a header is valid as the coinstake requires the complete transaction history.
  *  This will help prevent exhaustion attacks from bad actors spamming bad headers */
 static const unsigned int MAX_HEADERS_PENDING = 10 * MAX_HEADERS_RESULTS;
+/** Maximum number of headers to announce when relaying blocks with a headers message. Larger
+ *  batches fall back to announcing the tip with an inv. */
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Maximum number of unconnecting headers or compact block announcements from one peer
+ *  that are answered with getheaders before the peer is given a misbehaviour penalty. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -191,6 +244,10 @@ static const unsigned int MAX_HEADERS_PENDING = 10 * MAX_HEADERS_RESULTS;
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
+/** Default for -backgroundflush, writing the coins cache in the background and keeping its hot entries */
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
+/** Percentage of its limit (half the coins cache budget) that a background flush trims the cache down to */
+static const unsigned int COINS_CACHE_TRIM_PERCENT = 75;
 
 /** Average delay between local address broadcasts in seconds. */
 static const unsigned int AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL = 24 * 24 * 60;
@@ -236,6 +293,15 @@ extern bool fImporting;
 extern bool fReindex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fTimestampIndex;
+/** True if any block files have ever been pruned. */
+extern bool fHavePruned;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** Number of MiB of block files that we're trying to stay below. */
+extern uint64_t nPruneTarget;
 extern int nScriptCheckThreads;
 extern unsigned int nCoinCacheSize;
 extern CFeeRate minRelayTxFee;
@@ -262,6 +328,12 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
+/** Run the thread that delivers wallet notifications */
+void ThreadValidationCallbacks();
+/** Wait until the wallet notification queue is short again. Must not be called with cs_main held. */
+void LimitValidationInterfaceQueue();
+/** Wait until all wallet notifications raised so far have been delivered. Must not be called with cs_main held. */
+void SyncWithValidationInterfaceQueue();
 /** Ask wallets to resend their transactions */
 void ResendWalletTransactions(bool fForce = false);
 
@@ -292,6 +364,25 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** Write the chain state at the tip and the block index data PoS validation needs to a snapshot file */
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, uint256& hashBlock, int& nHeight, uint64_t& nCoins, uint256& hashContent);
+/** Load a snapshot matching one of the chainparams UTXO snapshots into empty block and coin databases */
+bool LoadUTXOSnapshot(const boost::filesystem::path& path);
+/** Prepare the -addrindex address index: wipe it if it went stale, or schedule its background build */
+bool InitAddressIndex();
+/** Build the address index for blocks connected before it was enabled */
+void ThreadAddressIndex();
+/** Whether -addrindex is on and covers the whole chain */
+bool IsAddressIndexReady();
+/** Map an address to its address index key */
+bool GetAddressIndexKey(const CTxDestination& dest, unsigned int& type, uint160& hashBytes);
+/** Read the address index rows of an address, between heights nStart and nEnd (0 for no bound) */
+bool GetAddressIndex(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart = 0, int nEnd = 0);
+bool GetAddressUnspent(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
+/** Look up the input that spent an outpoint (requires -spentindex) */
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+/** Hashes of the active chain blocks with nLow <= time <= nHigh, by time (requires -timestampindex) */
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -304,6 +395,14 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the relayed transaction script checking thread */
+void ThreadTxScriptCheck();
+/** Run an instance of the stateless block transaction checking thread */
+void ThreadBlockCheck();
+/** Run the thread that reads ahead and writes undo data and the tx index while blocks are connected */
+void ThreadConnectPipeline(CCoinsView* pcoinsview);
+/** Run the thread that writes the coins cache in the background (-backgroundflush) */
+void ThreadCoinsFlush(CCoinsView* pcoinsview);
 /** Stop the script checking threads */
 void ThreadScriptCheckQuit();
 
@@ -318,6 +417,8 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256& hash, CTransaction& tx, uint256& hashBlock, bool fAllowSlow);
+/** Look up a transaction's position, including index entries still queued by the connect pipeline */
+bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet* pwallet, bool fProofOfStake);
@@ -327,9 +428,18 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock = NULL);
 CBlockIndex* InsertBlockIndex(uint256 hash);
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputsbool, bool fRejectInsaneFee = false);
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputsbool, bool fRejectInsaneFee = false, bool fOverrideMempoolLimit = false);
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, std::string& errorMessage, bool fOverrideMempoolLimit = false);
+
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime);
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, std::string& errorMessage);
+/** Load the mempool from disk. */
+bool LoadMempool();
+
+/** Dump the mempool to disk. */
+bool DumpMempool();
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& txo, bool fLimitFree, bool* pfMissingInputs);
 
@@ -342,6 +452,12 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Prune block files as far as -prune allows, then flush all state, indexes and buffers to disk. */
+void PruneAndFlush();
+/** Whether a block file was pruned, so positions in it (like those in the tx index) can no longer be read */
+bool IsBlockFilePruned(int nFile);
+/** Fill the stake metadata of the reorg window when -prune is switched on, or wipe it when it is off */
+bool InitStakeMeta();
 bool IsBlockMasternodePaymentValid(CBlockIndex *pindex, CAmount masternodePayment);
 int64_t GetMasternodePayment(int nHeight, int64_t blockValue, CAmount masternodeCollateral);
 
@@ -380,6 +496,266 @@ struct CDiskTxPos : public CDiskBlockPos {
     }
 };
 
+/** Kinds of script the address index keys on */
+enum AddressIndexType {
+    ADDRESS_INDEX_PUBKEYHASH = 1, //! pay-to-pubkey and pay-to-pubkey-hash, keyed on the key id
+    ADDRESS_INDEX_SCRIPTHASH = 2, //! pay-to-script-hash, keyed on the script id
+};
+
+/** Address index row: an output received by, or an input spent from, an address */
+struct CAddressIndexKey {
+    unsigned int type;
+    uint160 hashBytes;
+    int blockHeight;
+    uint256 txhash;
+    unsigned int index; //! output index when receiving, input index when spending
+    bool spending;
+
+    CAddressIndexKey(unsigned int typeIn, const uint160& hashBytesIn, int blockHeightIn, const uint256& txhashIn, unsigned int indexIn, bool spendingIn)
+        : type(typeIn), hashBytes(hashBytesIn), blockHeight(blockHeightIn), txhash(txhashIn), index(indexIn), spending(spendingIn) {}
+
+    CAddressIndexKey() : type(0), hashBytes(0), blockHeight(0), txhash(0), index(0), spending(false) {}
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 32 + 4 + 1;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        //! Heights are stored big endian so that the rows of an address sort by height
+        unsigned char chType = type;
+        unsigned char pchHeight[4];
+        WriteBE32(pchHeight, blockHeight);
+        unsigned char chSpending = spending;
+        s << chType << hashBytes << FLATDATA(pchHeight) << txhash << index << chSpending;
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char chType;
+        unsigned char pchHeight[4];
+        unsigned char chSpending;
+        s >> chType >> hashBytes >> FLATDATA(pchHeight) >> txhash >> index >> chSpending;
+        type = chType;
+        blockHeight = ReadBE32(pchHeight);
+        spending = chSpending != 0;
+    }
+};
+
+/** Prefix of the address index rows of one address, optionally starting at a height */
+struct CAddressIndexIteratorKey {
+    unsigned int type;
+    uint160 hashBytes;
+    int blockHeight; //! -1 to start at the first row
+
+    CAddressIndexIteratorKey(unsigned int typeIn, const uint160& hashBytesIn, int blockHeightIn = -1)
+        : type(typeIn), hashBytes(hashBytesIn), blockHeight(blockHeightIn) {}
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + (blockHeight < 0 ? 0 : 4);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char chType = type;
+        s << chType << hashBytes;
+        if (blockHeight >= 0) {
+            unsigned char pchHeight[4];
+            WriteBE32(pchHeight, blockHeight);
+            s << FLATDATA(pchHeight);
+        }
+    }
+};
+
+/** Address unspent index key: an output currently unspent at an address */
+struct CAddressUnspentKey {
+    unsigned int type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int index;
+
+    CAddressUnspentKey(unsigned int typeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int indexIn)
+        : type(typeIn), hashBytes(hashBytesIn), txhash(txhashIn), index(indexIn) {}
+
+    CAddressUnspentKey() : type(0), hashBytes(0), txhash(0), index(0) {}
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 32 + 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char chType = type;
+        s << chType << hashBytes << txhash << index;
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char chType;
+        s >> chType >> hashBytes >> txhash >> index;
+        type = chType;
+    }
+};
+
+struct CAddressUnspentValue {
+    CAmount satoshis;
+    CScript script;
+    int blockHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(satoshis);
+        READWRITE(script);
+        READWRITE(blockHeight);
+    }
+
+    CAddressUnspentValue(CAmount satoshisIn, const CScript& scriptIn, int blockHeightIn)
+        : satoshis(satoshisIn), script(scriptIn), blockHeight(blockHeightIn) {}
+
+    CAddressUnspentValue()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        satoshis = -1;
+        script.clear();
+        blockHeight = 0;
+    }
+
+    //! A null value erases the row
+    bool IsNull() const
+    {
+        return satoshis == -1;
+    }
+};
+
+/** Spent index key: an outpoint */
+struct CSpentIndexKey {
+    uint256 txid;
+    unsigned int outputIndex;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(outputIndex);
+    }
+
+    CSpentIndexKey(const uint256& txidIn, unsigned int outputIndexIn) : txid(txidIn), outputIndex(outputIndexIn) {}
+    CSpentIndexKey() : txid(0), outputIndex(0) {}
+};
+
+/** Spent index value: the input that spent the outpoint */
+struct CSpentIndexValue {
+    uint256 txid;
+    unsigned int inputIndex;
+    int blockHeight;
+    CAmount satoshis;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(inputIndex);
+        READWRITE(blockHeight);
+        READWRITE(satoshis);
+    }
+
+    CSpentIndexValue(const uint256& txidIn, unsigned int inputIndexIn, int blockHeightIn, CAmount satoshisIn)
+        : txid(txidIn), inputIndex(inputIndexIn), blockHeight(blockHeightIn), satoshis(satoshisIn) {}
+
+    CSpentIndexValue()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        txid = 0;
+        inputIndex = 0;
+        blockHeight = 0;
+        satoshis = 0;
+    }
+
+    //! A null value erases the row
+    bool IsNull() const
+    {
+        return txid == 0;
+    }
+};
+
+/** Timestamp index key: a block by its time, stored big endian so that the rows sort by time */
+struct CTimestampIndexKey {
+    unsigned int timestamp;
+    uint256 blockHash;
+
+    CTimestampIndexKey(unsigned int timestampIn, const uint256& blockHashIn) : timestamp(timestampIn), blockHash(blockHashIn) {}
+    CTimestampIndexKey() : timestamp(0), blockHash(0) {}
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 4 + 32;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char pchTime[4];
+        WriteBE32(pchTime, timestamp);
+        s << FLATDATA(pchTime) << blockHash;
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char pchTime[4];
+        s >> FLATDATA(pchTime) >> blockHash;
+        timestamp = ReadBE32(pchTime);
+    }
+};
+
+/**
+ * Stake metadata of an output spent on the active chain: what the kernel checks read from its
+ * transaction and block. Kept in prune mode, for as long as a reorg can undo the spend.
+ */
+struct CStakeMetaValue {
+    unsigned int nTime;      //! nTime of the transaction holding the output
+    unsigned int nBlockTime; //! time of the block holding that transaction
+    CTxOut txout;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nTime);
+        READWRITE(nBlockTime);
+        CTxOutCompressor txoutCompressor(REF(txout));
+        READWRITE(txoutCompressor);
+    }
+
+    CStakeMetaValue(unsigned int nTimeIn, unsigned int nBlockTimeIn, const CTxOut& txoutIn)
+        : nTime(nTimeIn), nBlockTime(nBlockTimeIn), txout(txoutIn) {}
+    CStakeMetaValue() : nTime(0), nBlockTime(0) {}
+};
+
 CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes);
 
 /**
@@ -396,8 +772,19 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
 //! Context-independent validity checks
 bool CheckTransaction(const CTransaction& tx, CValidationState& state);
 
-//! ppcoin: get transaction coin age
-bool GetCoinAge(const CTransaction& tx, CValidationState& state, CCoinsViewCache& view, uint64_t& nCoinAge, unsigned int nHeight);
+//! ppcoin: get transaction coin age; ptxundo holds the spent outputs when tx was already applied to view
+bool GetCoinAge(const CTransaction& tx, CValidationState& state, CCoinsViewCache& view, uint64_t& nCoinAge, unsigned int nHeight, const CTxUndo* ptxundo = NULL);
+/**
+ * Rebuild nTime and the outputs of a transaction from the UTXO set, together with the time of its
+ * block, when that block's data is not on disk (loaded from a UTXO snapshot or pruned).
+ */
+bool GetStakeTxPrev(const COutPoint& prevout, const CCoins& coins, const CTxInUndo* pundo, CTransaction& txPrev, unsigned int& nTimeBlockFrom);
+/**
+ * The same for a stake whose block data is gone, whether or not the output is still unspent: outputs spent
+ * on the active chain within MIN_BLOCKS_TO_KEEP blocks come from the stake metadata, the others from the
+ * UTXO set. A competing branch can stake an output the active chain has spent already.
+ */
+bool ReadStakeTxPrev(const COutPoint& prevout, CTransaction& txPrev, unsigned int& nTimeBlockFrom);
 
 
 /** Undo information for a CBlock */
@@ -492,14 +879,20 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. The block's undo data is
+ *  read from disk unless the caller passes it in pblockUndo. */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, const CBlockUndo* pblockUndo = NULL);
+
+/** Bring the coins back to a single best block after a flush of them was interrupted, by undoing the
+ *  blocks of the old branch and redoing those of the new one (see CCoinsViewDB::BatchWrite). */
+bool ReplayBlocks(CCoinsViewCache& view);
 
 //! Apply the effects of this block (with given index) on the UTXO set represented by coins
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
 
 //! Context-independent validity checks
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
+//! fCheckPOWHash=false skips only the (scrypt) proof-of-work hash, for blocks whose hash was already checked
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true, bool fCheckPOWHash = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
 
 
@@ -508,7 +901,7 @@ bool UpdateHashProof(CBlock& block, CValidationState& state, CBlockIndex* pindex
 //! Store block on disk
 //! if dbp is provided, the file is known to already reside on disk
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex= NULL);
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex= NULL, bool fCheckPOWHash = true);
 
 //! Metrix: attempt to generate suitable proof-of-stake
 bool SignBlock(CBlock& block, CWallet& keystore, int64_t nFees);
@@ -675,6 +1068,10 @@ protected:
 extern CCoinsViewCache* pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
+/** Global variable that points to the coin database below pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+/** Global variable that points to the transaction index database */
+extern CTxIndexDB* ptxindexdb;
 struct CBlockTemplate {
     CBlock block;
     std::vector<CAmount> vTxFees;
@@ -28,326 +28,581 @@ using namespace std;
 
 extern unsigned int nMinerSleep;
 
-/**
- * Unconfirmed transactions in the memory pool often depend on other
- * transactions in the memory pool. When we select transactions from the
- * pool, we select by highest priority or fee rate, so we might consider
- * transactions that depend on transactions that aren't yet in the block.
- * The COrphan class keeps track of these 'temporary orphans' while
- * CreateBlock is figuring out which transactions to include.
- */
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
-    {
-    }
-};
-
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 int64_t nLastCoinStakeSearchTime = GetAdjustedTime();
 
-//! We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+namespace
 {
-    bool byFee;
-
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
-    bool operator()(const TxPriority& a, const TxPriority& b)
+/**
+ * A mempool transaction whose ancestor totals changed because some of its
+ * ancestors were already added to the block being assembled.
+ */
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
     }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
 };
 
-//! CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
-{
-    CReserveKey reservekey(pwallet);
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
 
-    //! Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if (!pblocktemplate.get()) {
-        error("CreateNewBlock() : Out of memory");
-        return NULL;
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
     }
-    CBlock* pblock = &pblocktemplate->block; //! pointer for convenience
+};
 
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    int nHeight = pindexPrev->nHeight + 1;
+//! Same ordering as CompareTxMemPoolEntryByAncestorFee, on the updated totals
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
+    }
+};
 
-    // initiate soft fork after block X to give nodes time to update.
-    // older nodes will not accept higher block versions than 7
-    if (nHeight > V8_START_BLOCK)
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter>,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
     {
-       pblocktemplate->block.nVersion = 8; 
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
     }
 
-    //! Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
+    CTxMemPool::txiter iter;
+};
 
-    if (!fProofOfStake) {
-        txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-    } else {
-        //! Height first in coinbase required for block.version=2
-        txNew.vin[0].scriptSig = (CScript() << nHeight) + COINBASE_FLAGS;
-        assert(txNew.vin[0].scriptSig.size() <= 100);
+//! Sorts by the number of in-mempool ancestors, which puts parents before children
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-        txNew.vout[0].SetEmpty();
-        if (fDebug)
-            LogPrintf("CreateNewBlock() : Coinbase vin=%s, height=%i\n", txNew.vin[0].scriptSig.ToString(), nHeight);
+//! We want to sort transactions by coin age priority
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByAncestorFee()(*(b.second), *(a.second)); //! Reverse order to make sort less than
+        return a.first < b.first;
     }
+};
 
-    //! Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1);   //! updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); //! updated at end
+/**
+ * Selects the transactions of a new block from the memory pool.
+ *
+ * The mempool keeps every entry's fee and size totals including all of its
+ * unconfirmed ancestors, sorted in the ancestor_score index, so the block is
+ * filled by walking that index once: each step adds the best remaining
+ * package (a transaction together with its not yet included ancestors).
+ * Entries whose ancestors were partly included are re-scored in
+ * mapModifiedTx. Scripts are not run again here, they were checked when
+ * the transactions entered the pool; only the inputs of every package are
+ * looked up in a view of the tip with the earlier transactions of the block
+ * applied, so a spent or conflicting pool entry is left out instead of
+ * making the whole template fail its final ConnectBlock check.
+ */
+class BlockAssembler
+{
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+
+    //! Configuration parameters for the block
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockMinSize;
+    unsigned int nBlockPrioritySize;
+    int nHeight;
+    //! Latest transaction time allowed in the block
+    int64_t nTimeLimit;
+
+    //! Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+    //! The tip with the transactions already in the block applied
+    CCoinsViewCache view;
 
-    //! Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    //! Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
+public:
+    BlockAssembler(CBlockTemplate* pblocktemplateIn, int nHeightIn)
+        : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), nHeight(nHeightIn), nTimeLimit(GetAdjustedTime()),
+          nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0), view(pcoinsTip)
+    {
+        //! Largest block you're willing to create:
+        nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+        //! Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+        nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
+
+        //! How much of the block should be dedicated to high-priority transactions,
+        //! included regardless of the fees they pay
+        nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+        nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+        //! Minimum block size you want to create; block will be filled with free transactions
+        //! until there are no more or the block reaches this size:
+        nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+        nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    }
 
-    //! How much of the block should be dedicated to high-priority transactions,
-    //! included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+    //! Add mempool transactions to the block; requires cs_main and mempool.cs
+    void AddTransactions()
+    {
+        addPriorityTxs();
+        addPackageTxs();
 
-    //! Minimum block size you want to create; block will be filled with free transactions
-    //! until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+        nLastBlockTx = nBlockTx;
+        nLastBlockSize = nBlockSize;
 
-    pblock->nBits = GetNextTargetRequired(pindexPrev, fProofOfStake);
+        if (fDebug && GetBoolArg("-printpriority", false))
+            LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+    }
 
+    CAmount GetFees() const { return nFees; }
 
-    //! Collect memory pool transactions into the block
-    CAmount nFees = 0;
+private:
+    //! Finality and timestamp rules every transaction in the block must meet
+    bool TestTransaction(const CTransaction& tx) const
     {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        CCoinsViewCache view(pcoinsTip);
-        //!>Metrix<
-        //! Priority order to process transactions
-        list<COrphan> vOrphan; //! list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        //! This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+        //! Timestamp limit; the same for both kinds of block, so a selection can serve either
+        if (tx.nTime > nTimeLimit)
+            return false;
+        return true;
+    }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                //! Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    /**
-                     * This should never happen; all transactions in the memory
-                     * pool should connect to either transactions in the chain
-                     * or other transactions in the memory pool.
-                     */
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug)
-                            assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    //! Has to wait for dependencies
-                    if (!porphan) {
-                        //! Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    //! Test if a set of transactions can all be included in the block
+    bool TestPackageTransactions(const CTxMemPool::setEntries& package) const
+    {
+        BOOST_FOREACH (const CTxMemPool::txiter it, package) {
+            if (!TestTransaction(it->GetTx()))
+                return false;
+        }
+        return true;
+    }
 
-                int nConf = pindexPrev->nHeight - coins->nHeight + 1;
-                dPriority += (double)nValueIn * nConf;
+    /**
+     * Check that the inputs of a package, sorted parents first, are unspent in
+     * the block so far and apply it to the view if they are. Scripts are not
+     * verified; the mempool already did that on entry.
+     */
+    bool TestPackageInputs(const std::vector<CTxMemPool::txiter>& sortedEntries)
+    {
+        CCoinsViewCache viewPackage(&view);
+        BOOST_FOREACH (const CTxMemPool::txiter it, sortedEntries) {
+            const CTransaction& tx = it->GetTx();
+            CValidationState state;
+            if (!viewPackage.HaveInputs(tx) || !CheckInputs(tx, state, viewPackage, false, 0, false)) {
+                LogPrint("miner", "%s : skipping %s, its inputs are missing or invalid\n", __func__, tx.GetHash().ToString());
+                return false;
             }
-            if (fMissingInputs)
-                continue;
-
-            //! Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+            CTxUndo txundo;
+            UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+        }
+        viewPackage.Flush();
+        return true;
+    }
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+    //! Test if a package of the given size and sigops still fits into the block
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps) const
+    {
+        if (nBlockSize + packageSize >= nBlockMaxSize)
+            return false;
+        if (nBlockSigOps + packageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+        return true;
+    }
 
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
+    void AddToBlock(CTxMemPool::txiter iter)
+    {
+        pblock->vtx.push_back(iter->GetTx());
+        pblocktemplate->vTxFees.push_back(iter->GetFee());
+        pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+        nBlockSize += iter->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += iter->GetSigOpCount();
+        nFees += iter->GetFee();
+        inBlock.insert(iter);
+
+        if (fDebug && GetBoolArg("-printpriority", false)) {
+            double dPriority = iter->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                      dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+        }
+    }
 
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+    //! Whether the transaction still has in-mempool parents that are not in the block
+    bool IsStillDependent(CTxMemPool::txiter iter) const
+    {
+        BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+            if (!inBlock.count(parent))
+                return true;
         }
+        return false;
+    }
+
+    /**
+     * Add the highest coin age priority transactions, regardless of their fee,
+     * until -blockprioritysize is reached.
+     */
+    void addPriorityTxs()
+    {
+        if (nBlockPrioritySize == 0)
+            return;
 
-        //! Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        //! This vector will be sorted into a priority queue:
+        std::vector<TxCoinAgePriority> vecPriority;
+        TxCoinAgePriorityCompare pricomparer;
+        std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+        typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+        double actualPriority = -1;
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
 
         while (!vecPriority.empty()) {
-            //! Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            CTxMemPool::txiter iter = vecPriority.front().second;
+            actualPriority = vecPriority.front().first;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
             vecPriority.pop_back();
 
-            //! Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            //! Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            //! If tx is dependent on other mempool txs which haven't yet been included
+            //! then put it in the waitSet
+            if (IsStillDependent(iter)) {
+                waitPriMap.insert(std::make_pair(iter, actualPriority));
                 continue;
+            }
 
-            //! Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+            if (!TestPackage(iter->GetTxSize(), iter->GetSigOpCount()) || !TestTransaction(iter->GetTx()))
                 continue;
-
-            //! Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            int64_t nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            if (!TestPackageInputs(std::vector<CTxMemPool::txiter>(1, iter)))
                 continue;
 
-            //! Prioritise by fee once past the priority size or we run out of high-priority
-            //! transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            AddToBlock(iter);
+
+            //! If now that this txs is added we've surpassed our desired priority size
+            //! or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority))
+                break;
+
+            //! This tx was successfully added, so
+            //! add transactions that depend on this one to the priority queue to try again
+            BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
             }
+        }
+    }
 
-            if (!view.HaveInputs(tx))
-                continue;
+    //! Add descendants of the given transactions to mapModifiedTx with ancestor
+    //! state updated assuming the given transactions are inBlock.
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
+    {
+        BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+            CTxMemPool::setEntries descendants;
+            mempool.CalculateDescendants(it, descendants);
+            //! Insert all descendants (not yet in block) into the modified set
+            BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+                if (alreadyAdded.count(desc))
+                    continue;
+                modtxiter mit = mapModifiedTx.find(desc);
+                if (mit == mapModifiedTx.end()) {
+                    CTxMemPoolModifiedEntry modEntry(desc);
+                    modEntry.nSizeWithAncestors -= it->GetTxSize();
+                    modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                    modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                    mapModifiedTx.insert(modEntry);
+                } else {
+                    mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+                }
+            }
+        }
+    }
 
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+    //! Skip entries in mapTx that are already in a block or are present
+    //! in mapModifiedTx (which implies that the mapTx ancestor state is
+    //! stale due to ancestor inclusion in the block), or have already failed.
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx) const
+    {
+        return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+    }
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+    /**
+     * Add packages in order of their fee rate including unconfirmed ancestors.
+     * Each time a package is added, the descendants of its transactions get
+     * their ancestor totals reduced in mapModifiedTx, so they compete with
+     * the remaining mapTx entries on their real remaining cost.
+     */
+    void addPackageTxs()
+    {
+        //! mapModifiedTx will store sorted packages after they are modified
+        //! because some of their txs are already in the block
+        indexed_modified_transaction_set mapModifiedTx;
+        //! Keep track of entries that failed inclusion, to avoid duplicate work
+        CTxMemPool::setEntries failedTx;
+
+        //! Start by adding all descendants of previously added txs to mapModifiedTx
+        //! and modifying them for their already included ancestors
+        UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+        CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+        CTxMemPool::txiter iter;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+            //! First try to find a new transaction in mapTx to evaluate.
+            if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+                ++mi;
                 continue;
+            }
 
-            CValidationState state;
+            //! Now that mi is not stale, determine which transaction to evaluate:
+            //! the next entry from mapTx, or the best from mapModifiedTx?
+            bool fUsingModified = false;
+
+            modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+            if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+                //! We're out of entries in mapTx; use the entry from mapModifiedTx
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                //! Try to compare the mapTx entry to the mapModifiedTx entry
+                iter = mempool.mapTx.project<0>(mi);
+                if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                    //! The best entry in mapModifiedTx has higher score
+                    //! than the one from mapTx.
+                    //! Switch which transaction (package) to consider
+                    iter = modit->iter;
+                    fUsingModified = true;
+                } else {
+                    //! Either no entry in mapModifiedTx, or it's worse than mapTx.
+                    //! Increment mi for the next loop iteration.
+                    ++mi;
+                }
+            }
 
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH, true))
-                continue;
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight + 1);
+            //! We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+            //! contain anything that is inBlock.
+            assert(!inBlock.count(iter));
+
+            uint64_t packageSize = iter->GetSizeWithAncestors();
+            CAmount packageFees = iter->GetModFeesWithAncestors();
+            unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+            if (fUsingModified) {
+                packageSize = modit->nSizeWithAncestors;
+                packageFees = modit->nModFeesWithAncestors;
+                packageSigOps = modit->nSigOpCountWithAncestors;
+            }
 
+            //! Skip free transactions if we're past the minimum block size;
+            //! everything after this has an even lower fee rate.
+            if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+                return;
+
+            if (!TestPackage(packageSize, packageSigOps)) {
+                if (fUsingModified) {
+                    //! Since we always look at the best entry in mapModifiedTx,
+                    //! we must erase failed entries so that we can consider the
+                    //! next best entry on the next loop iteration
+                    mapModifiedTx.get<ancestor_score>().erase(modit);
+                    failedTx.insert(iter);
+                }
+                continue;
+            }
 
-            //! Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+            CTxMemPool::setEntries ancestors;
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
 
-            if (fDebug && GetBoolArg("-printpriority", false)) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                          dPriority, feeRate.ToString(), tx.GetHash().ToString());
+            //! Only the ancestors that are not in the block yet belong to the package
+            for (CTxMemPool::setEntries::iterator ait = ancestors.begin(); ait != ancestors.end();) {
+                if (inBlock.count(*ait))
+                    ancestors.erase(ait++);
+                else
+                    ++ait;
             }
+            ancestors.insert(iter);
 
-            //! Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+            //! Test if all tx's are final and within the timestamp limit
+            if (!TestPackageTransactions(ancestors)) {
+                if (fUsingModified) {
+                    mapModifiedTx.get<ancestor_score>().erase(modit);
+                    failedTx.insert(iter);
                 }
+                continue;
             }
-        }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+            //! Sort the entries in a valid order and check their inputs in that order
+            std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+            std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+            if (!TestPackageInputs(sortedEntries)) {
+                if (fUsingModified)
+                    mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+                continue;
+            }
 
-        if (fDebug && GetBoolArg("-printpriority", false))
-            LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+            for (size_t i = 0; i < sortedEntries.size(); ++i) {
+                AddToBlock(sortedEntries[i]);
+                //! Erase from the modified set, if present
+                mapModifiedTx.erase(sortedEntries[i]);
+            }
 
-        //! Compute final coinbase transaction.
-        if (!fProofOfStake) {
-            int64_t nReward = GetProofOfWorkReward(nFees);
-            txNew.vout[0].nValue = nReward;
+            //! Update transactions that depend on each of these
+            UpdatePackagesForAdded(ancestors, mapModifiedTx);
         }
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-        pblock->vtx[0] = txNew;
+    }
+};
+} // namespace
 
-        //! Fill in header
-        pblock->hashPrevBlock = pindexPrev->GetBlockHash();
-        pblock->nTime = max(pindexPrev->GetPastTimeLimit() + 1, pblock->GetMaxTransactionTime());
-        if (!fProofOfStake)
-            UpdateTime(*pblock, pindexPrev);
-        pblock->nNonce = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+/**
+ * Select the mempool transactions of a block on top of the tip into pblocktemplate,
+ * behind a placeholder coinbase. Returns the total fees. Requires cs_main and mempool.cs.
+ */
+static CAmount SelectTransactions(CBlockTemplate* pblocktemplate, int nHeight)
+{
+    //! Add dummy coinbase tx as first transaction
+    pblocktemplate->block.vtx.push_back(CTransaction());
+    pblocktemplate->vTxFees.push_back(-1);   //! updated in FinishBlockTemplate
+    pblocktemplate->vTxSigOps.push_back(-1); //! updated in FinishBlockTemplate
+
+    BlockAssembler assembler(pblocktemplate, nHeight);
+    assembler.AddTransactions();
+    return assembler.GetFees();
+}
+
+/**
+ * Fill in the coinbase and header of a template whose transactions are selected.
+ * The coinbase pays scriptPubKeyIn for proof-of-work and is empty for proof-of-stake.
+ * With fCheck the result is verified with ConnectBlock. Requires cs_main.
+ */
+static bool FinishBlockTemplate(CBlockTemplate* pblocktemplate, const CScript& scriptPubKeyIn, CAmount nFees, bool fProofOfStake, bool fCheck)
+{
+    CBlock* pblock = &pblocktemplate->block; //! pointer for convenience
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    int nHeight = pindexPrev->nHeight + 1;
 
+    // initiate soft fork after block X to give nodes time to update.
+    // older nodes will not accept higher block versions than 7
+    if (nHeight > V8_START_BLOCK)
+    {
+       pblock->nVersion = 8; 
+    }
+
+    //! Create coinbase tx
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+
+    if (!fProofOfStake) {
+        txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+        txNew.vout[0].nValue = GetProofOfWorkReward(nFees);
+    } else {
+        txNew.vout[0].SetEmpty();
+    }
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    if (fDebug && fProofOfStake)
+        LogPrintf("CreateNewBlock() : Coinbase vin=%s, height=%i\n", txNew.vin[0].scriptSig.ToString(), nHeight);
+    pblock->vtx[0] = txNew;
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    pblock->nBits = GetNextTargetRequired(pindexPrev, fProofOfStake);
+
+    //! Fill in header
+    pblock->hashPrevBlock = pindexPrev->GetBlockHash();
+    pblock->nTime = max(pindexPrev->GetPastTimeLimit() + 1, pblock->GetMaxTransactionTime());
+    if (!fProofOfStake)
+        UpdateTime(*pblock, pindexPrev);
+    pblock->nNonce = 0;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    if (fCheck) {
         CBlockIndex indexDummy(*pblock);
         indexDummy.pprev = pindexPrev;
-        indexDummy.nHeight = pindexPrev->nHeight + 1;
+        indexDummy.nHeight = nHeight;
         CCoinsViewCache viewNew(pcoinsTip);
         CValidationState state;
-        if (!ConnectBlock(*pblock, state, &indexDummy, viewNew, true)) {
-            error("CreateNewBlock() : ConnectBlock failed");
-            return NULL;
-        }
+        if (!ConnectBlock(*pblock, state, &indexDummy, viewNew, true))
+            return error("CreateNewBlock() : ConnectBlock failed");
+    }
+    return true;
+}
+
+//! CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
+{
+    //! Create new block
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if (!pblocktemplate.get()) {
+        error("CreateNewBlock() : Out of memory");
+        return NULL;
     }
 
+    //! Collect memory pool transactions into the block
+    LOCK2(cs_main, mempool.cs);
+    CAmount nFees = SelectTransactions(pblocktemplate.get(), chainActive.Height() + 1);
+    if (!FinishBlockTemplate(pblocktemplate.get(), scriptPubKeyIn, nFees, fProofOfStake, true))
+        return NULL;
+
     return pblocktemplate.release();
 }
 
@@ -361,6 +616,50 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet* pwallet,
     return CreateNewBlock(scriptPubKey, pwallet, fProofOfStake);
 }
 
+/**
+ * The transaction selection of the last template built by CreateNewBlockCached,
+ * with its fees in vTxFees[0]. It does not depend on the kind of block or on
+ * the coinbase script, so the staker and getblocktemplate share it.
+ */
+static CCriticalSection cs_templateCache;
+static auto_ptr<CBlockTemplate> pselectionCached;
+static uint256 hashSelectionPrevBlock;
+static unsigned int nSelectionTransactionsUpdated = 0;
+static int64_t nSelectionTime = 0;
+
+CBlockTemplate* CreateNewBlockCached(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake, int64_t nMaxAge, unsigned int* pnTransactionsUpdated)
+{
+    //! CreateNewBlock takes cs_main; take it first so callers that already hold it keep the same order
+    LOCK2(cs_main, cs_templateCache);
+
+    const uint256 hashTip = chainActive.Tip()->GetBlockHash();
+    const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    bool fMatch = pselectionCached.get() &&
+                  hashSelectionPrevBlock == hashTip &&
+                  (nSelectionTransactionsUpdated == nTransactionsUpdated || GetTime() - nSelectionTime <= nMaxAge);
+
+    auto_ptr<CBlockTemplate> pblocktemplate;
+    if (!fMatch) {
+        pblocktemplate.reset(CreateNewBlock(scriptPubKeyIn, pwallet, fProofOfStake));
+        if (!pblocktemplate.get())
+            return NULL;
+        pselectionCached.reset(new CBlockTemplate(*pblocktemplate));
+        hashSelectionPrevBlock = hashTip;
+        nSelectionTransactionsUpdated = nTransactionsUpdated;
+        nSelectionTime = GetTime();
+    } else {
+        LogPrint("miner", "CreateNewBlockCached() : reusing selection for %s (%u txs)\n", hashTip.ToString(), pselectionCached->block.vtx.size());
+        //! The transactions were checked when the selection was built
+        pblocktemplate.reset(new CBlockTemplate(*pselectionCached));
+        if (!FinishBlockTemplate(pblocktemplate.get(), scriptPubKeyIn, -pselectionCached->vTxFees[0], fProofOfStake, false))
+            return NULL;
+    }
+
+    if (pnTransactionsUpdated)
+        *pnTransactionsUpdated = nSelectionTransactionsUpdated;
+    return pblocktemplate.release();
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     //! Update nExtraNonce
@@ -481,11 +780,14 @@ void ThreadStakeMiner(CWallet* pwallet, bool fProofOfStake)
             }
         }
 
+        //! Let the wallet see the spends of the latest blocks before staking its coins
+        SyncWithValidationInterfaceQueue();
+
         /*
          * Create new block
          */
         CAmount nFees = 0;
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
+        auto_ptr<CBlockTemplate> pblocktemplate(fProofOfStake ? CreateNewBlockCached(CScript(), pwallet, true) : CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
         if (!pblocktemplate.get()) {
             LogPrintf("Error in ThreadStakeMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
             return;
@@ -14,6 +14,20 @@
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake = false);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet* pwallet, bool fProofOfStake = false);
 
+/** Maximum age in seconds of a cached block template once the mempool has changed */
+static const int64_t BLOCK_TEMPLATE_MAX_AGE = 5;
+
+/**
+ * Build a block template from a shared transaction selection, which is
+ * rebuilt only when the tip changed, or when the mempool changed and the
+ * selection is older than nMaxAge seconds. The coinbase and header are made
+ * for each caller, so proof-of-stake and proof-of-work templates reuse the
+ * same selection. pnTransactionsUpdated, if given, receives the mempool
+ * update counter the selection reflects. The caller owns the result, as
+ * with CreateNewBlock.
+ */
+CBlockTemplate* CreateNewBlockCached(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake, int64_t nMaxAge = BLOCK_TEMPLATE_MAX_AGE, unsigned int* pnTransactionsUpdated = NULL);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 
@@ -0,0 +1,215 @@
+// Copyright (c) 2017-2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <stdexcept>
+#include <string.h>
+
+namespace
+{
+//! The modulus 2^3072 - 1103717, the largest 3072-bit safe prime
+const unsigned long MODULUS_OFFSET = 1103717;
+
+/**
+ * The modulus and its Montgomery parameters, computed once. OpenSSL only
+ * reads them while multiplying, so all threads share them.
+ */
+class CMuHashModulus
+{
+public:
+    BIGNUM* p;
+    BN_MONT_CTX* mont;
+
+    CMuHashModulus() : p(BN_new()), mont(BN_MONT_CTX_new())
+    {
+        BN_CTX* ctx = BN_CTX_new();
+        bool fOk = ctx && p && mont && BN_set_bit(p, 3072) && BN_sub_word(p, MODULUS_OFFSET) && BN_MONT_CTX_set(mont, p, ctx);
+        BN_CTX_free(ctx);
+        if (!fOk)
+            throw std::runtime_error("CMuHash3072 : OpenSSL bignum allocation failed");
+    }
+
+    ~CMuHashModulus()
+    {
+        BN_MONT_CTX_free(mont);
+        BN_free(p);
+    }
+};
+
+const CMuHashModulus modulus;
+
+void Load(BIGNUM* bn, const unsigned char* pch)
+{
+    if (!BN_bin2bn(pch, CMuHash3072::BYTE_SIZE, bn))
+        throw std::runtime_error("CMuHash3072 : BN_bin2bn failed");
+}
+
+void Store(const BIGNUM* bn, unsigned char* pch)
+{
+    int nBytes = BN_num_bytes(bn);
+    memset(pch, 0, CMuHash3072::BYTE_SIZE - nBytes);
+    BN_bn2bin(bn, pch + CMuHash3072::BYTE_SIZE - nBytes);
+}
+
+/** The OpenSSL state of one modular operation */
+class CMuHashContext
+{
+public:
+    BN_CTX* ctx;
+    BIGNUM* a;
+    BIGNUM* b;
+
+    CMuHashContext() : ctx(BN_CTX_new()), a(BN_new()), b(BN_new())
+    {
+        if (!ctx || !a || !b)
+            throw std::runtime_error("CMuHash3072 : OpenSSL bignum allocation failed");
+    }
+
+    ~CMuHashContext()
+    {
+        BN_clear_free(b);
+        BN_clear_free(a);
+        BN_CTX_free(ctx);
+    }
+
+    //! pch = pch * pchOther mod p
+    void MulMod(unsigned char* pch, const unsigned char* pchOther)
+    {
+        Load(a, pch);
+        Load(b, pchOther);
+        if (!BN_mod_mul(a, a, b, modulus.p, ctx))
+            throw std::runtime_error("CMuHash3072 : BN_mod_mul failed");
+        Store(a, pch);
+    }
+};
+
+//! Expand an element to a 3072-bit number: SHA256 of the element, stretched with SHA512 in counter mode
+void ExpandElement(const unsigned char* pch, size_t nLen, unsigned char* pchOut)
+{
+    unsigned char seed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(pch, nLen).Finalize(seed);
+    for (unsigned char i = 0; i < CMuHash3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++)
+        CSHA512().Write(seed, sizeof(seed)).Write(&i, 1).Finalize(pchOut + i * CSHA512::OUTPUT_SIZE);
+}
+
+void SetOne(unsigned char* pch)
+{
+    memset(pch, 0, CMuHash3072::BYTE_SIZE);
+    pch[CMuHash3072::BYTE_SIZE - 1] = 1;
+}
+}
+
+CMuHash3072::CMuHash3072()
+{
+    SetOne(numerator);
+    SetOne(denominator);
+}
+
+void CMuHash3072::Insert(const unsigned char* pch, size_t nLen)
+{
+    unsigned char element[BYTE_SIZE];
+    ExpandElement(pch, nLen, element);
+    CMuHashContext().MulMod(numerator, element);
+}
+
+void CMuHash3072::Remove(const unsigned char* pch, size_t nLen)
+{
+    unsigned char element[BYTE_SIZE];
+    ExpandElement(pch, nLen, element);
+    CMuHashContext().MulMod(denominator, element);
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& other)
+{
+    CMuHashContext context;
+    context.MulMod(numerator, other.numerator);
+    context.MulMod(denominator, other.denominator);
+    return *this;
+}
+
+uint256 CMuHash3072::Finalize() const
+{
+    CMuHashContext context;
+    Load(context.a, numerator);
+    Load(context.b, denominator);
+    if (!BN_mod_inverse(context.b, context.b, modulus.p, context.ctx) ||
+        !BN_mod_mul(context.a, context.a, context.b, modulus.p, context.ctx))
+        throw std::runtime_error("CMuHash3072 : finalizing failed");
+
+    unsigned char result[BYTE_SIZE];
+    Store(context.a, result);
+    uint256 hash;
+    CSHA256().Write(result, BYTE_SIZE).Finalize(hash.begin());
+    return hash;
+}
+
+CMuHash3072Batch::CMuHash3072Batch() : ctx(BN_CTX_new()), numerator(BN_new()), denominator(BN_new()), element(BN_new()), nNumerator(0), nDenominator(0)
+{
+    if (!ctx || !numerator || !denominator || !element || !BN_one(numerator) || !BN_one(denominator))
+        throw std::runtime_error("CMuHash3072Batch : OpenSSL bignum allocation failed");
+}
+
+CMuHash3072Batch::~CMuHash3072Batch()
+{
+    BN_clear_free(element);
+    BN_clear_free(denominator);
+    BN_clear_free(numerator);
+    BN_CTX_free(ctx);
+}
+
+void CMuHash3072Batch::Multiply(BIGNUM* product, const unsigned char* pch, size_t nLen)
+{
+    unsigned char buf[CMuHash3072::BYTE_SIZE];
+    ExpandElement(pch, nLen, buf);
+    Load(element, buf);
+    //! Montgomery multiplication needs factors below the modulus, which nearly every expansion already is
+    if (BN_cmp(element, modulus.p) >= 0 && !BN_sub(element, element, modulus.p))
+        throw std::runtime_error("CMuHash3072Batch : BN_sub failed");
+    if (!BN_mod_mul_montgomery(product, product, element, modulus.mont, ctx))
+        throw std::runtime_error("CMuHash3072Batch : BN_mod_mul_montgomery failed");
+}
+
+void CMuHash3072Batch::Insert(const unsigned char* pch, size_t nLen)
+{
+    Multiply(numerator, pch, nLen);
+    nNumerator++;
+}
+
+void CMuHash3072Batch::Remove(const unsigned char* pch, size_t nLen)
+{
+    Multiply(denominator, pch, nLen);
+    nDenominator++;
+}
+
+void CMuHash3072Batch::StoreProduct(BIGNUM* product, unsigned long n, unsigned char* pch)
+{
+    //! R = 2^3072 mod p is just the offset of the modulus
+    BN_CTX_start(ctx);
+    BIGNUM* exponent = BN_CTX_get(ctx);
+    bool fOk = exponent && BN_set_word(element, MODULUS_OFFSET) && BN_set_word(exponent, n) &&
+               BN_mod_exp(element, element, exponent, modulus.p, ctx) && BN_mod_mul(product, product, element, modulus.p, ctx);
+    BN_CTX_end(ctx);
+    if (!fOk)
+        throw std::runtime_error("CMuHash3072Batch : BN_mod_exp failed");
+    Store(product, pch);
+}
+
+void CMuHash3072Batch::MoveTo(CMuHash3072& muhash)
+{
+    if (size() == 0)
+        return;
+    CMuHash3072 collected;
+    StoreProduct(numerator, nNumerator, collected.numerator);
+    StoreProduct(denominator, nDenominator, collected.denominator);
+    muhash *= collected;
+
+    if (!BN_one(numerator) || !BN_one(denominator))
+        throw std::runtime_error("CMuHash3072Batch : BN_one failed");
+    nNumerator = 0;
+    nDenominator = 0;
+}
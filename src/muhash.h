@@ -0,0 +1,103 @@
+// Copyright (c) 2017-2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+#include <openssl/bn.h>
+
+class CMuHash3072Batch;
+
+/**
+ * Order-independent hash of a multiset of byte strings (MuHash3072).
+ *
+ * Every element is expanded to a number modulo the prime 2^3072 - 1103717
+ * and the set hash is the product of these numbers, so elements can be added
+ * and removed in any order and two sets can be combined. Removed elements
+ * are multiplied into a separate denominator that is only inverted by
+ * Finalize(), which keeps Insert() and Remove() equally cheap.
+ */
+class CMuHash3072
+{
+public:
+    static const size_t BYTE_SIZE = 384;
+
+private:
+    //! Big-endian numbers modulo the prime
+    unsigned char numerator[BYTE_SIZE];
+    unsigned char denominator[BYTE_SIZE];
+
+public:
+    //! The hash of the empty set
+    CMuHash3072();
+
+    void Insert(const unsigned char* pch, size_t nLen);
+    void Remove(const unsigned char* pch, size_t nLen);
+
+    //! Add all elements of another set hash to this one
+    CMuHash3072& operator*=(const CMuHash3072& other);
+
+    //! SHA256 of the normalized set hash
+    uint256 Finalize() const;
+
+    friend class CMuHash3072Batch;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(FLATDATA(numerator));
+        READWRITE(FLATDATA(denominator));
+    }
+};
+
+/**
+ * Collects many elements for a CMuHash3072 at a time.
+ *
+ * Insert() and Remove() of CMuHash3072 convert the whole number to and from
+ * bytes and do a generic modular multiplication for every element. A batch
+ * keeps its two running products as OpenSSL numbers and multiplies each
+ * element in with a single Montgomery multiplication, which also divides by
+ * R = 2^3072 mod p; MoveTo() makes up for those factors at once. A batch is
+ * used by one thread at a time.
+ */
+class CMuHash3072Batch
+{
+private:
+    BN_CTX* ctx;
+    BIGNUM* numerator;
+    BIGNUM* denominator;
+    BIGNUM* element;
+    //! Montgomery multiplications done into each product, each of which divided it by R
+    unsigned long nNumerator;
+    unsigned long nDenominator;
+
+    CMuHash3072Batch(const CMuHash3072Batch&);
+    void operator=(const CMuHash3072Batch&);
+
+    void Multiply(BIGNUM* product, const unsigned char* pch, size_t nLen);
+    //! Store product * R^n mod p
+    void StoreProduct(BIGNUM* product, unsigned long n, unsigned char* pch);
+
+public:
+    CMuHash3072Batch();
+    ~CMuHash3072Batch();
+
+    void Insert(const unsigned char* pch, size_t nLen);
+    void Remove(const unsigned char* pch, size_t nLen);
+
+    //! Number of elements inserted or removed since the last MoveTo
+    size_t size() const { return nNumerator + nDenominator; }
+
+    //! Add the collected elements to muhash and start over empty
+    void MoveTo(CMuHash3072& muhash);
+};
+
+#endif // BITCOIN_MUHASH_H
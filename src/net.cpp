@@ -56,14 +56,28 @@ using namespace std;
 namespace
 {
 const int MAX_OUTBOUND_CONNECTIONS = 64;
+//! Maximum number of outbound connects in flight at the same time
+const int MAX_PENDING_CONNECTIONS = 16;
 struct ListenSocket {
     SOCKET socket;
     bool whitelisted;
     ListenSocket(SOCKET socket, bool whitelisted) : socket(socket), whitelisted(whitelisted) {}
 };
+
+/** An outbound connection whose non-blocking connect() has not completed yet */
+struct PendingConnection {
+    SOCKET hSocket;
+    CAddress addr;
+    int64_t nTimeStarted;
+    //! outbound slot reserved for this connection, moved to the node once connected
+    CSemaphoreGrant grantOutbound;
+
+    PendingConnection() : hSocket(INVALID_SOCKET), nTimeStarted(0) {}
+};
 } // namespace
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOutbound = NULL, const char* strDest = NULL, bool fOneShot = false);
+static bool OpenNetworkConnectionAsync(const CAddress& addrConnect, CSemaphoreGrant& grantOutbound);
 
 /**
  * Global state variables
@@ -102,6 +116,10 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
 
+//! Outbound connects started by ThreadOpenConnections, completed by ThreadSocketHandler
+static list<PendingConnection> lPendingConnections;
+static CCriticalSection cs_lPendingConnections;
+
 //! Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
@@ -341,6 +359,11 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nAvgBlockSize = DEFAULT_AVG_BLOCK_SIZE;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -369,6 +392,25 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+//! Wrap a freshly connected outbound socket in a CNode and add it to vNodes
+static CNode* AddOutboundNode(SOCKET hSocket, const CAddress& addrConnect, const char* pszDest)
+{
+    addrman.Attempt(addrConnect);
+
+    //! Add node
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+    pnode->AddRef();
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+
+    pnode->nTimeConnected = GetTime();
+
+    return pnode;
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool darkSendMaster)
 {
     if (pszDest == NULL) {
@@ -401,20 +443,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool darkSendMaste
             return NULL;
         }
 
-        addrman.Attempt(addrConnect);
-
-        //! Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
-
-        pnode->nTimeConnected = GetTime();
-
-        return pnode;
+        return AddOutboundNode(hSocket, addrConnect, pszDest);
     } else if (!proxyConnectionFailed) {
         /**
          * If connecting to the node failed, and failure is not caused by a problem connecting to
@@ -766,6 +795,16 @@ void ThreadSocketHandler()
             have_fds = true;
             setSocket.insert(hListenSocket.socket);
         }
+        {
+            //! An outbound connect has completed (or failed) once its socket is writable
+            LOCK(cs_lPendingConnections);
+            BOOST_FOREACH (const PendingConnection& conn, lPendingConnections) {
+                FD_SET(conn.hSocket, &fdsetSend);
+                FD_SET(conn.hSocket, &fdsetError);
+                hSocketMax = max(hSocketMax, conn.hSocket);
+                have_fds = true;
+            }
+        }
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
@@ -826,6 +865,36 @@ void ThreadSocketHandler()
         }
 
 
+        /**
+         * Complete pending outbound connections
+         */
+        {
+            int64_t nNow = GetTimeMillis();
+            LOCK(cs_lPendingConnections);
+            list<PendingConnection>::iterator it = lPendingConnections.begin();
+            while (it != lPendingConnections.end()) {
+                PendingConnection& conn = *it;
+                if (FD_ISSET(conn.hSocket, &fdsetSend) || FD_ISSET(conn.hSocket, &fdsetError)) {
+                    if (FinishConnectSocket(conn.addr, conn.hSocket)) {
+                        CNode* pnode = AddOutboundNode(conn.hSocket, conn.addr, NULL);
+                        conn.grantOutbound.MoveTo(pnode->grantOutbound);
+                        pnode->fNetworkNode = true;
+                    } else
+                        addrman.Attempt(conn.addr);
+                } else if (nNow - conn.nTimeStarted > nConnectTimeout) {
+                    LogPrint("net", "connection to %s timeout\n", conn.addr.ToString());
+                    CloseSocket(conn.hSocket);
+                    addrman.Attempt(conn.addr);
+                } else {
+                    ++it;
+                    continue;
+                }
+                //! a failed connect releases its outbound slot here
+                it = lPendingConnections.erase(it);
+            }
+        }
+
+
         /**
          * Accept new connections
          */
@@ -1203,63 +1272,79 @@ void ThreadOpenConnections()
             }
         }
 
-        /**
-         * Choose an address to connect to based on most recently seen
-         */
-        CAddress addrConnect;
-
         /**
          * Only connect out to one peer per network group (/16 for IPv4).
          * Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
          */
-        int nOutbound = 0;
         set<vector<unsigned char> > setConnected;
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (!pnode->fInbound) {
+                if (!pnode->fInbound)
                     setConnected.insert(pnode->addr.GetGroup());
-                    nOutbound++;
-                }
+            }
+        }
+        int nPending = 0;
+        {
+            LOCK(cs_lPendingConnections);
+            BOOST_FOREACH (const PendingConnection& conn, lPendingConnections) {
+                setConnected.insert(conn.addr.GetGroup());
+                nPending++;
             }
         }
 
         int64_t nANow = GetAdjustedTime();
 
-        int nTries = 0;
-        while (true) {
-            CAddress addr = addrman.Select();
+        /**
+         * Start a connect for every free outbound slot at once. Connects complete in the
+         * socket handler thread, so dead addresses no longer hold up the ones behind them.
+         */
+        while (grant && nPending < MAX_PENDING_CONNECTIONS) {
+            CAddress addrConnect;
+            int nTries = 0;
+            while (true) {
+                CAddress addr = addrman.Select();
 
-            //! if we selected an invalid address, restart
-            if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
-                break;
+                //! if we selected an invalid address, restart
+                if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
+                    break;
 
-            /**
-             * If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
-             * stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
-             * already-connected network ranges, ...) before trying new addrman addresses.
-             */
-            nTries++;
-            if (nTries > 100)
-                break;
+                /**
+                 * If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
+                 * stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
+                 * already-connected network ranges, ...) before trying new addrman addresses.
+                 */
+                nTries++;
+                if (nTries > 100)
+                    break;
 
-            if (IsLimited(addr))
-                continue;
+                if (IsLimited(addr))
+                    continue;
 
-            //! only consider very recently tried nodes after 30 failed attempts
-            if (nANow - addr.nLastTry < 600 && nTries < 30)
-                continue;
+                //! only consider very recently tried nodes after 30 failed attempts
+                if (nANow - addr.nLastTry < 600 && nTries < 30)
+                    continue;
 
-            //! do not allow non-default ports, unless after 50 invalid addresses selected already
-            if (addr.GetPort() != Params().GetDefaultPort() && nTries < 50)
-                continue;
+                //! do not allow non-default ports, unless after 50 invalid addresses selected already
+                if (addr.GetPort() != Params().GetDefaultPort() && nTries < 50)
+                    continue;
 
-            addrConnect = addr;
-            break;
-        }
+                addrConnect = addr;
+                break;
+            }
+
+            if (!addrConnect.IsValid())
+                break;
 
-        if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+            setConnected.insert(addrConnect.GetGroup());
+            if (OpenNetworkConnectionAsync(addrConnect, grant))
+                nPending++;
+            if (!grant) {
+                //! the slot went to the new connection; take the next free one, if any, without waiting
+                CSemaphoreGrant grantNext(*semOutbound, true);
+                grantNext.MoveTo(grant);
+            }
+        }
     }
 }
 
@@ -1325,13 +1410,70 @@ void ThreadOpenAddedConnections()
         }
         BOOST_FOREACH (vector<CService>& vserv, lservAddressesToAdd) {
             CSemaphoreGrant grant(*semOutbound);
-            OpenNetworkConnection(CAddress(vserv[i % vserv.size()]), &grant);
-            MilliSleep(500);
+            OpenNetworkConnectionAsync(CAddress(vserv[i % vserv.size()]), grant);
         }
         MilliSleep(120000); //! Retry every 2 minutes
     }
 }
 
+static bool IsPendingConnection(const CService& addr)
+{
+    LOCK(cs_lPendingConnections);
+    BOOST_FOREACH (const PendingConnection& conn, lPendingConnections)
+        if ((CService)conn.addr == addr)
+            return true;
+    return false;
+}
+
+/**
+ * Start connecting to addrConnect without waiting for the connect to complete; the
+ * socket handler thread turns it into a node. Connections through a proxy need the
+ * SOCKS5 handshake and are still made synchronously.
+ * If successful, this moves the passed grant to the pending connection.
+ */
+static bool OpenNetworkConnectionAsync(const CAddress& addrConnect, CSemaphoreGrant& grantOutbound)
+{
+    boost::this_thread::interruption_point();
+    if (IsLocal(addrConnect) ||
+        FindNode((CNetAddr)addrConnect) || CNode::IsBanned(addrConnect) ||
+        FindNode(addrConnect.ToStringIPPort()) || IsPendingConnection(addrConnect))
+        return false;
+
+    proxyType proxy;
+    if (GetProxy(addrConnect.GetNetwork(), proxy))
+        return OpenNetworkConnection(addrConnect, &grantOutbound);
+
+    LogPrint("net", "trying connection %s lastseen=%.1fhrs\n", addrConnect.ToString(), (double)(GetAdjustedTime() - addrConnect.nTime) / 3600.0);
+
+    SOCKET hSocket = INVALID_SOCKET;
+    bool fInProgress = false;
+    if (!StartConnectSocket(addrConnect, hSocket, fInProgress)) {
+        addrman.Attempt(addrConnect);
+        return false;
+    }
+    if (!IsSelectableSocket(hSocket)) {
+        LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
+        CloseSocket(hSocket);
+        return false;
+    }
+
+    if (!fInProgress) {
+        CNode* pnode = AddOutboundNode(hSocket, addrConnect, NULL);
+        grantOutbound.MoveTo(pnode->grantOutbound);
+        pnode->fNetworkNode = true;
+        return true;
+    }
+
+    LOCK(cs_lPendingConnections);
+    lPendingConnections.push_back(PendingConnection());
+    PendingConnection& conn = lPendingConnections.back();
+    conn.hSocket = hSocket;
+    conn.addr = addrConnect;
+    conn.nTimeStarted = GetTimeMillis();
+    grantOutbound.MoveTo(conn.grantOutbound);
+    return true;
+}
+
 //! if successful, this moves the passed grant to the constructed node
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOutbound, const char* pszDest, bool fOneShot)
 {
@@ -1389,7 +1531,7 @@ void ThreadMessageHandler()
                         pnode->CloseSocketDisconnect();
 
                     if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                        if (!pnode->vRecvGetData.empty() || !pnode->setOrphanWorkSet.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
                             fSleep = false;
                         }
                     }
@@ -1643,6 +1785,9 @@ public:
             delete pnode;
         BOOST_FOREACH (CNode* pnode, vNodesDisconnected)
             delete pnode;
+        BOOST_FOREACH (PendingConnection& conn, lPendingConnections)
+            CloseSocket(conn.hSocket);
+        lPendingConnections.clear();
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
@@ -1795,6 +1940,102 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now) {
+        //! timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::RecordBlockSize(uint64_t nSize)
+{
+    LOCK(cs_totalBytesSent);
+    nAvgBlockSize = (nAvgBlockSize * 15 + nSize) / 16;
+}
+
+uint64_t CNode::GetBlockRelayReserve(uint64_t nTime)
+{
+    return nTime / Params().TargetSpacing() * nAvgBlockSize;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    //! enough to relay every block of a cycle once, at the average block size
+    uint64_t recommendedMinimum = GetBlockRelayReserve(nMaxOutboundTimeframe);
+    nMaxOutboundLimit = limit;
+
+    if (limit > 0 && limit < recommendedMinimum)
+        LogPrintf("Max outbound target is very small (%s bytes) and will be overshot. Recommended minimum is %s bytes.\n", nMaxOutboundLimit, recommendedMinimum);
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+void CNode::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe) {
+        //! reset measure-cycle in case of changing
+        //! the timeframe
+        nMaxOutboundCycleStartTime = GetTime();
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit) {
+        //! keep a large enough buffer to at least relay each block once, but never hold back
+        //! so much of the target that historical blocks are not served at all
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = std::min(GetBlockRelayReserve(timeLeftInCycle), nMaxOutboundLimit / 100 * MAX_UPLOAD_RESERVE_PERCENT);
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -1951,7 +2192,9 @@ int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                           addrKnown(5000, 0.001),
+                                                                                           filterInventoryKnown(10000, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -1990,7 +2233,6 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nNextAddrSend = 0;
     nNextInvSend = 0;
     nMisbehavior = 0;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
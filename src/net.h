@@ -11,7 +11,6 @@
 #include "primitives/block.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "pubkey.h"
@@ -50,6 +49,16 @@ static const unsigned int MAX_ADDR_TO_SEND = 1000;
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** The default for -maxuploadtarget. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The length of an upload target cycle (in seconds) */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Block size assumed by the upload target reserve until blocks have been connected */
+static const uint64_t DEFAULT_AVG_BLOCK_SIZE = 50 * 1000;
+/** Most of the upload target that may be held back for relaying new blocks, in percent */
+static const unsigned int MAX_UPLOAD_RESERVE_PERCENT = 50;
+/** Blocks older than this are considered historical and are not served once the upload target is reached */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
 /** -upnp default */
 #ifdef USE_UPNP
 static const bool DEFAULT_UPNP = USE_UPNP;
@@ -226,6 +235,8 @@ public:
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    //! Orphans whose parents this peer supplied, waiting to be re-validated (protected by cs_main)
+    std::set<uint256> setOrphanWorkSet;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
@@ -297,15 +308,17 @@ public:
 
     //! flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
     int64_t nNextLocalAddrSend;
 
     //! inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    //! Block hashes to announce with a headers message, or an inv if the peer does not want headers.
+    std::vector<uint256> vBlockHashesToAnnounce;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
     int64_t nNextInvSend;
@@ -330,6 +343,17 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    //! Outbound limit & stats, guarded by cs_totalBytesSent
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+    //! Moving average of the size of connected blocks, guarded by cs_totalBytesSent
+    static uint64_t nAvgBlockSize;
+
+    //! Bytes to keep for relaying each new block once during nTime seconds. Requires cs_totalBytesSent.
+    static uint64_t GetBlockRelayReserve(uint64_t nTime);
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -379,7 +403,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -389,7 +413,7 @@ public:
          * SendMessages will filter it again for knowns that were added
          * after addresses were pushed.
          */
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -403,7 +427,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -411,11 +435,17 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    void PushBlockHash(const uint256& hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
 
@@ -620,9 +650,32 @@ public:
     //! Network stats
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
+    //! Feed the size of a newly connected block into the upload target reserve
+    static void RecordBlockSize(uint64_t nSize);
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! set the max outbound target in bytes
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //! set the timeframe for the max outbound target
+    static void SetMaxOutboundTimeframe(uint64_t timeframe);
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! check if the outbound target is reached
+    //! if historicalBlockServingLimit is set true, the function will
+    //! return true if the limit is too close to serve any more historical blocks
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //! response the bytes left in the current max outbound cycle
+    //! in case of no limit, it will always response 0
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! response the time in second left in the current max outbound cycle
+    //! in case of no limit, it will always response 0
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 class CTxIn;
 class CTxOut;
@@ -188,6 +188,14 @@ bool Lookup(const char* pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char* pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService& addr, SOCKET& hSocketRet, int nTimeout, bool* outProxyConnectionFailed = 0);
 bool ConnectSocketByName(CService& addr, SOCKET& hSocketRet, const char* pszDest, int portDefault, int nTimeout, bool* outProxyConnectionFailed = 0);
+/**
+ * Open a non-blocking socket and start connecting it to addr without waiting.
+ * fInProgress is set when the connection is still being established; the caller
+ * must then wait for the socket to become writable and call FinishConnectSocket.
+ */
+bool StartConnectSocket(const CService& addr, SOCKET& hSocketRet, bool& fInProgress);
+/** Check the outcome of a connect started by StartConnectSocket; closes the socket on failure */
+bool FinishConnectSocket(const CService& addr, SOCKET& hSocket);
 /** Return readable error string for a network error code */
 std::string NetworkErrorString(int err);
 /** Close socket and set hSocket to INVALID_SOCKET */
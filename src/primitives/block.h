@@ -92,6 +92,10 @@ public:
     std::vector<unsigned char> vchBlockSig;
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    // memory only: serialized size as measured while reading the block, 0 if unknown
+    mutable unsigned int nSerializedSize;
+    // memory only: set once the context-free checks of CheckBlock passed, so they are not repeated
+    mutable bool fChecked;
 
     CBlock()
     {
@@ -112,6 +116,10 @@ public:
         READWRITE(*(CBlockHeader*)this);
         READWRITE(vtx);
         READWRITE(vchBlockSig);
+        if (ser_action.ForRead()) {
+            nSerializedSize = 0;
+            fChecked = false;
+        }
     }
 
     void SetNull()
@@ -120,6 +128,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        nSerializedSize = 0;
+        fChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
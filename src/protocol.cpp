@@ -132,6 +132,8 @@ const char* CInv::GetCommand() const
 
 std::string CInv::ToString() const
 {
+    if (type == MSG_CMPCT_BLOCK)
+        return strprintf("cmpctblock %s", hash.ToString());
     if (type == MSG_BLOCK)
         return strprintf("%s %s", GetCommand(), hash.ToString());
     if (type == MSG_TX)
@@ -154,7 +154,12 @@ enum {
     MSG_TXLOCK_REQUEST,
     MSG_TXLOCK_VOTE,
     MSG_SPORK,
-    MSG_MASTERNODE_WINNER
+    MSG_MASTERNODE_WINNER,
+    /**
+     * Like MSG_FILTERED_BLOCK, MSG_CMPCT_BLOCK is only used in getdata and
+     * asks for the block to be sent as a "cmpctblock" message.
+     */
+    MSG_CMPCT_BLOCK
 };
 
 #endif //! BITCOIN_PROTOCOL_H
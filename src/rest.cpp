@@ -198,6 +198,9 @@ static bool rest_block(AcceptedConnection* conn,
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
 
         pblockindex = mapBlockIndex[hash];
+        if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
+
         if (!ReadBlockFromDisk(block, pblockindex))
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
     }
@@ -330,6 +333,99 @@ static bool rest_tx(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_spentinfo(AcceptedConnection* conn,
+                           const std::string& strURIPart,
+                           const std::string& strRequest,
+                           const std::map<std::string, std::string>& mapHeaders,
+                           bool fRun)
+{
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("-"));
+
+    if (path.size() != 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "No output specified. Use /rest/spentinfo/<txid>-<n>.<ext>.");
+
+    uint256 hash;
+    if (!ParseHashStr(path[0], hash))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + path[0]);
+
+    int32_t nOutput;
+    if (!ParseInt32(path[1], &nOutput) || nOutput < 0)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid output index: " + path[1]);
+
+    if (!fSpentIndex)
+        throw RESTERR(HTTP_NOT_FOUND, "Spent index not enabled");
+
+    CSpentIndexValue value;
+    if (!GetSpentIndex(CSpentIndexKey(hash, nOutput), value))
+        throw RESTERR(HTTP_NOT_FOUND, path[0] + "-" + path[1] + " not found");
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue objSpent(UniValue::VOBJ);
+        objSpent.push_back(Pair("txid", value.txid.GetHex()));
+        objSpent.push_back(Pair("index", (int)value.inputIndex));
+        objSpent.push_back(Pair("height", value.blockHeight));
+        objSpent.push_back(Pair("satoshis", value.satoshis));
+        string strJSON = objSpent.write() + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        return true;
+    }
+    default: {
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_blockhashes(AcceptedConnection* conn,
+                             const std::string& strURIPart,
+                             const std::string& strRequest,
+                             const std::map<std::string, std::string>& mapHeaders,
+                             bool fRun)
+{
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "No time range specified. Use /rest/blockhashes/<high>/<low>.<ext>.");
+
+    int64_t nHigh, nLow;
+    if (!ParseInt64(path[0], &nHigh) || !ParseInt64(path[1], &nLow) ||
+        nLow < 0 || nHigh < nLow || nHigh > std::numeric_limits<unsigned int>::max())
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid time range: " + params[0]);
+
+    if (!fTimestampIndex)
+        throw RESTERR(HTTP_NOT_FOUND, "Timestamp index not enabled");
+
+    std::vector<uint256> vHashes;
+    if (!GetTimestampIndex(nHigh, nLow, vHashes))
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Error reading the timestamp index");
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue arrHashes(UniValue::VARR);
+        BOOST_FOREACH (const uint256& hash, vHashes)
+            arrHashes.push_back(hash.GetHex());
+        string strJSON = arrHashes.write() + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        return true;
+    }
+    default: {
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static bool rest_getutxos(AcceptedConnection* conn,
                           const std::string& strURIPart,
                           const std::string& strRequest,
@@ -540,6 +636,8 @@ static const struct {
       {"/rest/chaininfo", rest_chaininfo},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
+      {"/rest/spentinfo/", rest_spentinfo},
+      {"/rest/blockhashes/", rest_blockhashes},
 };
 
 bool HTTPReq_REST(AcceptedConnection* conn,
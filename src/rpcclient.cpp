@@ -86,6 +86,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"signrawtransaction", 2},
         {"gettxout", 1},
         {"gettxout", 2},
+        {"gettxoutsetinfo", 0},
         {"verifychain", 0},
         {"verifychain", 1},
         {"keypoolrefill", 0},
@@ -100,12 +101,26 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"searchrawtransactions", 1},
         {"searchrawtransactions", 2},
         {"searchrawtransactions", 3},
+        {"getspentinfo", 0},
+        {"getblockhashes", 0},
+        {"getblockhashes", 1},
+};
+
+/** Params that take either a JSON object or a plain string, like the address
+ * index lookups that accept "address" as well as {"addresses": [...]}.
+ */
+static const CRPCConvertParam vRPCObjectOrStringParams[] =
+    {
+        {"getaddressbalance", 0},
+        {"getaddressdeltas", 0},
+        {"getaddressutxos", 0},
 };
 
 class CRPCConvertTable
 {
 private:
     std::set<std::pair<std::string, int> > members;
+    std::set<std::pair<std::string, int> > membersObjectOrString;
 
 public:
     CRPCConvertTable();
@@ -114,6 +129,11 @@ public:
     {
         return (members.count(std::make_pair(method, idx)) > 0);
     }
+
+    bool convertObjectOrString(const std::string& method, int idx)
+    {
+        return (membersObjectOrString.count(std::make_pair(method, idx)) > 0);
+    }
 };
 
 CRPCConvertTable::CRPCConvertTable()
@@ -125,6 +145,14 @@ CRPCConvertTable::CRPCConvertTable()
         members.insert(std::make_pair(vRPCConvertParams[i].methodName,
                                       vRPCConvertParams[i].paramIdx));
     }
+
+    const unsigned int n_obj =
+        (sizeof(vRPCObjectOrStringParams) / sizeof(vRPCObjectOrStringParams[0]));
+
+    for (unsigned int i = 0; i < n_obj; i++) {
+        membersObjectOrString.insert(std::make_pair(vRPCObjectOrStringParams[i].methodName,
+                                                    vRPCObjectOrStringParams[i].paramIdx));
+    }
 }
 
 static CRPCConvertTable rpcCvtTable;
@@ -149,7 +177,14 @@ UniValue RPCConvertValues(const std::string &strMethod, const std::vector<std::s
     for (unsigned int idx = 0; idx < strParams.size(); idx++) {
         const std::string& strVal = strParams[idx];
 
-        if (!rpcCvtTable.convert(strMethod, idx)) {
+        if (rpcCvtTable.convertObjectOrString(strMethod, idx)) {
+            // parse a JSON object, anything else is passed on as a string
+            UniValue jVal;
+            if (jVal.read(strVal) && jVal.isObject())
+                params.push_back(jVal);
+            else
+                params.push_back(strVal);
+        } else if (!rpcCvtTable.convert(strMethod, idx)) {
             // insert string value directly
             params.push_back(strVal);
         } else {
@@ -331,3 +331,218 @@ UniValue spork(const UniValue& params, bool fHelp)
         "<value> is a epoch datetime to enable or disable spork" +
         HelpRequiringPassphrase());
 }
+
+/** Parse an address or {"addresses": [...]} into address index keys */
+static void ParseAddressIndexKeys(const UniValue& param, std::vector<std::pair<uint160, unsigned int> >& vAddresses)
+{
+    std::vector<UniValue> vValues;
+    if (param.isStr()) {
+        vValues.push_back(param);
+    } else if (param.isObject()) {
+        UniValue addresses = find_value(param.get_obj(), "addresses");
+        if (!addresses.isArray())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Addresses is expected to be an array");
+        vValues = addresses.getValues();
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an object with addresses");
+    }
+
+    BOOST_FOREACH (const UniValue& value, vValues) {
+        CBitcoinAddress address(value.get_str());
+        uint160 hashBytes;
+        unsigned int type = 0;
+        if (!address.IsValid() || !GetAddressIndexKey(address.Get(), type, hashBytes))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        vAddresses.push_back(std::make_pair(hashBytes, type));
+    }
+
+    if (!IsAddressIndexReady())
+        throw JSONRPCError(RPC_MISC_ERROR, fAddressIndex ? "Address index is still being built" : "Address index not enabled, start with -addrindex");
+}
+
+static std::string AddressIndexKeyToString(const uint160& hashBytes, unsigned int type)
+{
+    if (type == ADDRESS_INDEX_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\" | {\"addresses\": [\"address\",...]}\n"
+            "\nReturns the balance of one or more addresses (requires -addrindex).\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\": n,   (numeric) The current balance in satoshis\n"
+            "  \"received\": n   (numeric) The total amount received in satoshis, change included\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"MSbdwahRnJQ7W8DGzHYJtrRULPyDZLmwND\"]}'") +
+            HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"MSbdwahRnJQ7W8DGzHYJtrRULPyDZLmwND\"]}"));
+
+    std::vector<std::pair<uint160, unsigned int> > vAddresses;
+    ParseAddressIndexKeys(params[0], vAddresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    for (std::vector<std::pair<uint160, unsigned int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vAddressIndex.begin(); it != vAddressIndex.end(); it++) {
+        if (it->second > 0)
+            nReceived += it->second;
+        nBalance += it->second;
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\" | {\"addresses\": [\"address\",...]}\n"
+            "\nReturns the unspent outputs of one or more addresses (requires -addrindex).\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"address\",  (string) The address\n"
+            "    \"txid\": \"hash\",        (string) The transaction id\n"
+            "    \"outputIndex\": n,      (numeric) The output index\n"
+            "    \"script\": \"hex\",       (string) The script hex\n"
+            "    \"satoshis\": n,         (numeric) The value of the output in satoshis\n"
+            "    \"height\": n            (numeric) The height of the block the output was created in\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"MSbdwahRnJQ7W8DGzHYJtrRULPyDZLmwND\"]}'") +
+            HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"MSbdwahRnJQ7W8DGzHYJtrRULPyDZLmwND\"]}"));
+
+    std::vector<std::pair<uint160, unsigned int> > vAddresses;
+    ParseAddressIndexKeys(params[0], vAddresses);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    for (std::vector<std::pair<uint160, unsigned int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        if (!GetAddressUnspent(it->first, it->second, vUnspent))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vUnspent.begin(); it != vUnspent.end(); it++) {
+        UniValue output(UniValue::VOBJ);
+        output.push_back(Pair("address", AddressIndexKeyToString(it->first.hashBytes, it->first.type)));
+        output.push_back(Pair("txid", it->first.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)it->first.index));
+        output.push_back(Pair("script", HexStr(it->second.script.begin(), it->second.script.end())));
+        output.push_back(Pair("satoshis", it->second.satoshis));
+        output.push_back(Pair("height", it->second.blockHeight));
+        result.push_back(output);
+    }
+    return result;
+}
+
+UniValue getaddressdeltas(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressdeltas \"address\" | {\"addresses\": [\"address\",...], \"start\": n, \"end\": n}\n"
+            "\nReturns every output received and input spent by one or more addresses (requires -addrindex).\n"
+            "\nArguments:\n"
+            "  \"start\"  (numeric, optional) The first block height to include\n"
+            "  \"end\"    (numeric, optional) The last block height to include\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\": n,      (numeric) The amount received (positive) or spent (negative) in satoshis\n"
+            "    \"txid\": \"hash\",     (string) The transaction id\n"
+            "    \"index\": n,         (numeric) The output index when receiving, the input index when spending\n"
+            "    \"height\": n,        (numeric) The block height\n"
+            "    \"address\": \"address\" (string) The address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"MSbdwahRnJQ7W8DGzHYJtrRULPyDZLmwND\"]}'") +
+            HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"MSbdwahRnJQ7W8DGzHYJtrRULPyDZLmwND\"]}"));
+
+    int nStart = 0;
+    int nEnd = 0;
+    if (params[0].isObject()) {
+        UniValue startValue = find_value(params[0].get_obj(), "start");
+        UniValue endValue = find_value(params[0].get_obj(), "end");
+        if (startValue.isNum())
+            nStart = startValue.get_int();
+        if (endValue.isNum())
+            nEnd = endValue.get_int();
+        if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start or end height");
+    }
+
+    std::vector<std::pair<uint160, unsigned int> > vAddresses;
+    ParseAddressIndexKeys(params[0], vAddresses);
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<uint160, unsigned int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+
+        std::string strAddress = AddressIndexKeyToString(it->first, it->second);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator itRow = vAddressIndex.begin(); itRow != vAddressIndex.end(); itRow++) {
+            UniValue delta(UniValue::VOBJ);
+            delta.push_back(Pair("satoshis", itRow->second));
+            delta.push_back(Pair("txid", itRow->first.txhash.GetHex()));
+            delta.push_back(Pair("index", (int)itRow->first.index));
+            delta.push_back(Pair("height", itRow->first.blockHeight));
+            delta.push_back(Pair("address", strAddress));
+            result.push_back(delta);
+        }
+    }
+    return result;
+}
+
+UniValue getspentinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getspentinfo {\"txid\": \"hash\", \"index\": n}\n"
+            "\nReturns the input that spent an output (requires -spentindex).\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\": \"hash\",     (string) The id of the spending transaction\n"
+            "  \"index\": n,         (numeric) The index of the spending input\n"
+            "  \"height\": n,        (numeric) The height of the block the output was spent in\n"
+            "  \"satoshis\": n       (numeric) The value of the spent output in satoshis\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'") +
+            HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}"));
+
+    UniValue txidValue = find_value(params[0].get_obj(), "txid");
+    UniValue indexValue = find_value(params[0].get_obj(), "index");
+    if (!txidValue.isStr() || !indexValue.isNum())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid txid or index");
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled, start with -spentindex");
+
+    CSpentIndexKey key(ParseHashV(txidValue, "txid"), indexValue.get_int());
+    CSpentIndexValue value;
+    if (!GetSpentIndex(key, value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.inputIndex));
+    result.push_back(Pair("height", value.blockHeight));
+    result.push_back(Pair("satoshis", value.satoshis));
+    return result;
+}
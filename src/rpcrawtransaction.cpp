@@ -829,16 +829,30 @@ UniValue searchrawtransactions(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 4)
         throw runtime_error(
-            "searchrawtransactions <address> [verbose=1] [skip=0] [count=100]\n");
+            "searchrawtransactions <address> [verbose=1] [skip=0] [count=100]\n"
+            "\nReturns the transactions that pay to or spend from an address, oldest first (requires -addrindex).\n");
 
     CBitcoinAddress address(params[0].get_str());
     if (!address.IsValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Metrix address");
-    CTxDestination dest = address.Get();
-
+    uint160 hashBytes;
+    unsigned int type = 0;
+    if (!GetAddressIndexKey(address.Get(), type, hashBytes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Address type not indexed");
+    if (!IsAddressIndexReady())
+        throw JSONRPCError(RPC_DATABASE_ERROR, fAddressIndex ? "Address index is still being built" : "Address index not enabled, start with -addrindex");
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    if (!GetAddressIndex(hashBytes, type, vAddressIndex))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+    //! A transaction has a row per output and input that touches the address
     std::vector<uint256> vtxhash;
-    throw JSONRPCError(RPC_DATABASE_ERROR, "method deprecated");
-
+    std::set<uint256> setSeen;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vAddressIndex.begin(); it != vAddressIndex.end(); it++) {
+        if (setSeen.insert(it->first.txhash).second)
+            vtxhash.push_back(it->first.txhash);
+    }
 
     int nSkip = 0;
     int nCount = 100;
@@ -270,12 +270,15 @@ static const CRPCCommand vRPCCommands[] =
         {"blockchain", "getblock", &getblock, true, false, false},
         {"blockchain", "getblockbynumber", &getblockbynumber, false, false, false},
         {"blockchain", "getblockhash", &getblockhash, true, false, false},
+        {"blockchain", "getblockhashes", &getblockhashes, true, true, false},
         {"blockchain", "getchaintips", &getchaintips, true, false, false},
         {"blockchain", "getdifficulty", &getdifficulty, true, false, false},
         {"blockchain", "getmempoolinfo", &getmempoolinfo, true, true, false},
         {"blockchain", "getrawmempool", &getrawmempool, true, false, false},
         {"blockchain", "gettxout", &gettxout, true, false, false},
         {"blockchain", "gettxoutsetinfo", &gettxoutsetinfo, true, false, false},
+        {"blockchain", "getdbstats", &getdbstats, true, true, false},
+        {"blockchain", "dumptxoutset", &dumptxoutset, true, true, false},
 
         /* Staking */
         {"staking", "getblocktemplate", &getblocktemplate, true, false, false},
@@ -298,6 +301,10 @@ static const CRPCCommand vRPCCommands[] =
         {"util", "validateaddress", &validateaddress, true, false, false},
         {"util", "validatepubkey", &validatepubkey, true, false, false},
         {"util", "verifymessage", &verifymessage, true, false, false},
+        {"util", "getaddressbalance", &getaddressbalance, true, true, false},
+        {"util", "getaddressdeltas", &getaddressdeltas, true, true, false},
+        {"util", "getaddressutxos", &getaddressutxos, true, true, false},
+        {"util", "getspentinfo", &getspentinfo, true, true, false},
         {"util", "estimatefee", &estimatefee, true, true, false },
         {"util", "estimatepriority", &estimatepriority, true, true, false },
 
@@ -985,6 +992,11 @@ UniValue CRPCTable::execute(const std::string& strMethod, const UniValue& params
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
     try {
+#ifdef ENABLE_WALLET
+        //! Wallet calls see every block and transaction validated before the call
+        if (pcmd->reqWallet && pwalletMain)
+            SyncWithValidationInterfaceQueue();
+#endif
         //! Execute
         UniValue result;
         {
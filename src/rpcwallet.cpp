@@ -2375,6 +2375,9 @@ UniValue scanforalltxns(const UniValue& params, bool fHelp)
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
 
+    if (fPruneMode)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
+
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
@@ -2417,6 +2420,9 @@ UniValue scanforstealthtxns(const UniValue& params, bool fHelp)
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
 
+    if (fPruneMode)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
+
     //! -- locks in AddToWalletIfInvolvingMe
 
     bool fUpdate = true; //! todo: option?
@@ -0,0 +1,251 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+//! Backing view that keeps its coins in a plain map, the way the database would
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+    uint256 hashBestBlock;
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const
+    {
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256& txid) const
+    {
+        CCoins coins;
+        return GetCoins(txid, coins);
+    }
+
+    uint256 GetBestBlock() const { return hashBestBlock; }
+
+    bool BatchWrite(CCoinsMap& mapDirty, const uint256& hashBlock)
+    {
+        for (CCoinsMap::iterator it = mapDirty.begin(); it != mapDirty.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            if (it->second.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coins;
+        }
+        mapDirty.clear();
+        hashBestBlock = hashBlock;
+        return true;
+    }
+};
+
+//! Cache that lets the tests look at its entries and their flags
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* baseIn) : CCoinsViewCache(baseIn) {}
+
+    const CCoinsCacheEntry* Entry(const uint256& txid) const
+    {
+        CCoinsMap::const_iterator it = cacheCoins.find(txid);
+        return it == cacheCoins.end() ? NULL : &it->second;
+    }
+};
+
+CCoins MakeCoins(int nHeight, unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = nHeight;
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = (i + 1) * 1000;
+        coins.vout[i].scriptPubKey = CScript() << nHeight << OP_DROP << OP_TRUE;
+    }
+    return coins;
+}
+
+//! Create coins in the cache as a connected block would
+void AddCoins(CCoinsViewCache& cache, const uint256& txid, int nHeight)
+{
+    CCoinsModifier coins = cache.ModifyCoins(txid);
+    *coins = MakeCoins(nHeight, 2);
+}
+
+//! Spend every output, as a block spending the whole transaction would
+void SpendCoins(CCoinsViewCache& cache, const uint256& txid)
+{
+    CCoinsModifier coins = cache.ModifyCoins(txid);
+    BOOST_FOREACH (CTxOut& out, coins->vout)
+        out.SetNull();
+}
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coins_copydirty_clears_flags)
+{
+    CCoinsViewTest base;
+    base.mapCoins[uint256(1)] = MakeCoins(1, 2);
+    base.mapCoins[uint256(2)] = MakeCoins(2, 2);
+
+    CCoinsViewCacheTest cache(&base);
+    AddCoins(cache, uint256(3), 3);                    // DIRTY | FRESH
+    cache.ModifyCoins(uint256(1))->vout[0].SetNull(); // DIRTY
+    BOOST_CHECK(cache.AccessCoins(uint256(2)));        // clean
+    BOOST_CHECK_EQUAL(cache.Entry(uint256(3))->flags, CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+    BOOST_CHECK_EQUAL(cache.Entry(uint256(1))->flags, CCoinsCacheEntry::DIRTY);
+
+    CCoinsMap mapDirty;
+    cache.CopyDirty(mapDirty);
+
+    // Only the dirty entries are copied, with the flags they had
+    BOOST_CHECK_EQUAL(mapDirty.size(), 2U);
+    BOOST_CHECK_EQUAL(mapDirty[uint256(3)].flags, CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+    BOOST_CHECK_EQUAL(mapDirty[uint256(1)].flags, CCoinsCacheEntry::DIRTY);
+    BOOST_CHECK(mapDirty[uint256(1)].coins == *cache.AccessCoins(uint256(1)));
+
+    // Every entry stays cached, neither fresh nor dirty
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 3U);
+    for (int i = 1; i <= 3; i++) {
+        const CCoinsCacheEntry* entry = cache.Entry(uint256(i));
+        BOOST_REQUIRE(entry);
+        BOOST_CHECK_EQUAL(entry->flags, 0);
+    }
+    BOOST_CHECK(cache.Entry(uint256(2))->coins == base.mapCoins[uint256(2)]);
+    BOOST_CHECK(cache.Entry(uint256(3))->coins == MakeCoins(3, 2));
+
+    // Nothing is left to copy until the cache is modified again
+    CCoinsMap mapAgain;
+    cache.CopyDirty(mapAgain);
+    BOOST_CHECK(mapAgain.empty());
+
+    // The copies write the same state as a flush would have
+    base.BatchWrite(mapDirty, uint256(10));
+    BOOST_CHECK(base.mapCoins[uint256(1)] == *cache.AccessCoins(uint256(1)));
+    BOOST_CHECK(base.mapCoins[uint256(3)] == *cache.AccessCoins(uint256(3)));
+}
+
+BOOST_AUTO_TEST_CASE(coins_trim_keeps_dirty)
+{
+    CCoinsViewTest base;
+    for (int i = 1; i <= 10; i++)
+        base.mapCoins[uint256(i)] = MakeCoins(i, 2);
+
+    CCoinsViewCacheTest cache(&base);
+    for (int i = 1; i <= 10; i++)
+        BOOST_CHECK(cache.AccessCoins(uint256(i)));
+    for (int i = 11; i <= 15; i++)
+        AddCoins(cache, uint256(i), i);
+    cache.ModifyCoins(uint256(1))->vout[1].SetNull();
+    SpendCoins(cache, uint256(2));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 15U);
+
+    // Even asked to empty the cache, every dirty entry stays
+    cache.Trim(0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 7U);
+    for (int i = 1; i <= 15; i++) {
+        const CCoinsCacheEntry* entry = cache.Entry(uint256(i));
+        if (i <= 2 || i >= 11) {
+            BOOST_REQUIRE(entry);
+            BOOST_CHECK(entry->flags & CCoinsCacheEntry::DIRTY);
+        } else {
+            BOOST_CHECK(!entry);
+        }
+    }
+
+    // A cache already small enough is left alone
+    cache.Trim(7);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 7U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_trim_order)
+{
+    CCoinsViewTest base;
+    for (int i = 1; i <= 8; i++)
+        base.mapCoins[uint256(i)] = MakeCoins(100 - i * 10, 2);
+
+    CCoinsViewCacheTest cache(&base);
+    for (int i = 1; i <= 8; i++)
+        BOOST_CHECK(cache.AccessCoins(uint256(i)));
+    // Spend the two newest transactions fully and clean them by copying them out
+    SpendCoins(cache, uint256(7));
+    SpendCoins(cache, uint256(8));
+    CCoinsMap mapDirty;
+    cache.CopyDirty(mapDirty);
+    BOOST_CHECK_EQUAL(mapDirty.size(), 2U);
+    BOOST_CHECK(cache.Entry(uint256(7))->coins.IsPruned());
+    BOOST_CHECK(cache.Entry(uint256(8))->coins.IsPruned());
+    // One dirty entry of the lowest height, which must survive regardless
+    cache.ModifyCoins(uint256(6))->vout[0].SetNull();
+
+    // The fully spent entries go first, however high they are
+    cache.Trim(6);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 6U);
+    BOOST_CHECK(!cache.Entry(uint256(7)));
+    BOOST_CHECK(!cache.Entry(uint256(8)));
+    for (int i = 1; i <= 6; i++)
+        BOOST_CHECK(cache.Entry(uint256(i)));
+
+    // Then the clean entries of the lowest heights
+    cache.Trim(3);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 3U);
+    BOOST_CHECK(cache.Entry(uint256(1)));
+    BOOST_CHECK(cache.Entry(uint256(2)));
+    BOOST_CHECK(!cache.Entry(uint256(3)));
+    BOOST_CHECK(!cache.Entry(uint256(4)));
+    BOOST_CHECK(!cache.Entry(uint256(5)));
+    BOOST_CHECK(cache.Entry(uint256(6)));
+}
+
+BOOST_AUTO_TEST_CASE(coins_spend_copied_entry)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    AddCoins(cache, uint256(1), 1);
+
+    // Start writing the new coins out; the copy in mapDirty is still pending
+    CCoinsMap mapDirty;
+    cache.CopyDirty(mapDirty);
+    BOOST_CHECK_EQUAL(cache.Entry(uint256(1))->flags, 0);
+
+    // A child view spends the coins completely and is flushed into the cache
+    {
+        CCoinsViewCacheTest child(&cache);
+        SpendCoins(child, uint256(1));
+        BOOST_CHECK_EQUAL(child.Entry(uint256(1))->flags, CCoinsCacheEntry::DIRTY);
+        BOOST_CHECK(child.Flush());
+    }
+
+    // The spend is kept as a dirty entry: erasing it would resurrect the pending copy
+    const CCoinsCacheEntry* entry = cache.Entry(uint256(1));
+    BOOST_REQUIRE(entry);
+    BOOST_CHECK_EQUAL(entry->flags, CCoinsCacheEntry::DIRTY);
+    BOOST_CHECK(entry->coins.IsPruned());
+    cache.Trim(0);
+    BOOST_CHECK(cache.Entry(uint256(1)));
+
+    // The pending write lands, then the spend is flushed on top of it
+    base.BatchWrite(mapDirty, uint256(10));
+    BOOST_CHECK(base.HaveCoins(uint256(1)));
+    BOOST_CHECK(cache.AccessCoins(uint256(1))->IsPruned());
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!base.HaveCoins(uint256(1)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,102 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+#include "streams.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+static void InsertByte(CMuHash3072& muhash, unsigned char ch)
+{
+    muhash.Insert(&ch, 1);
+}
+
+static void RemoveByte(CMuHash3072& muhash, unsigned char ch)
+{
+    muhash.Remove(&ch, 1);
+}
+
+BOOST_AUTO_TEST_SUITE(muhash_tests)
+
+BOOST_AUTO_TEST_CASE(muhash_order_independent)
+{
+    CMuHash3072 empty;
+
+    // Insertion order does not matter, and removing undoes inserting
+    CMuHash3072 a, b;
+    InsertByte(a, 1);
+    InsertByte(a, 2);
+    InsertByte(b, 3);
+    InsertByte(b, 2);
+    InsertByte(b, 1);
+    RemoveByte(b, 3);
+    BOOST_CHECK(a.Finalize() == b.Finalize());
+    BOOST_CHECK(a.Finalize() != empty.Finalize());
+
+    // A removal may come before the matching insertion
+    CMuHash3072 c;
+    RemoveByte(c, 5);
+    InsertByte(c, 5);
+    BOOST_CHECK(c.Finalize() == empty.Finalize());
+
+    // Multisets: an element inserted twice differs from one inserted once
+    CMuHash3072 d;
+    InsertByte(d, 1);
+    InsertByte(d, 1);
+    CMuHash3072 e;
+    InsertByte(e, 1);
+    BOOST_CHECK(d.Finalize() != e.Finalize());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_combine_serialize)
+{
+    CMuHash3072 a, b, ab;
+    InsertByte(a, 1);
+    RemoveByte(a, 9);
+    InsertByte(b, 2);
+    InsertByte(ab, 2);
+    RemoveByte(ab, 9);
+    InsertByte(ab, 1);
+    a *= b;
+    BOOST_CHECK(a.Finalize() == ab.Finalize());
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << a;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * CMuHash3072::BYTE_SIZE);
+    CMuHash3072 read;
+    ss >> read;
+    BOOST_CHECK(read.Finalize() == ab.Finalize());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_batch)
+{
+    // A batch collects the same set hash as single insertions and removals
+    CMuHash3072 single, batched;
+    CMuHash3072Batch batch;
+    for (unsigned char ch = 0; ch < 50; ch++) {
+        InsertByte(single, ch);
+        batch.Insert(&ch, 1);
+        if (ch % 3 == 0) {
+            unsigned char chRemoved = ch + 100;
+            RemoveByte(single, chRemoved);
+            batch.Remove(&chRemoved, 1);
+        }
+        // Moving part of the way leaves a batch that starts over empty
+        if (ch == 20) {
+            BOOST_CHECK_EQUAL(batch.size(), 28U);
+            batch.MoveTo(batched);
+            BOOST_CHECK_EQUAL(batch.size(), 0U);
+        }
+    }
+    batch.MoveTo(batched);
+    BOOST_CHECK(single.Finalize() == batched.Finalize());
+
+    // Moving an empty batch changes nothing
+    CMuHash3072 empty;
+    batch.MoveTo(empty);
+    BOOST_CHECK(empty.Finalize() == CMuHash3072().Finalize());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
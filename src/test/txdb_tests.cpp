@@ -0,0 +1,645 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "chainparamsbase.h"
+#include "coins.h"
+#include "hash.h"
+#include "random.h"
+#include "script/script.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <limits>
+#include <string.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+namespace
+{
+//! Gives every test case a chainstate of its own in a temporary data directory
+struct CoinsDBTestingSetup {
+    boost::filesystem::path pathTemp;
+
+    CoinsDBTestingSetup()
+    {
+        SelectBaseParams(CBaseChainParams::MAIN);
+        pathTemp = boost::filesystem::temp_directory_path() / strprintf("test_metrix_txdb_%lu_%i", (unsigned long)GetTime(), (int)GetRandInt(100000));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+    }
+
+    ~CoinsDBTestingSetup()
+    {
+        mapArgs.erase("-datadir");
+        mapArgs.erase("-dbbatchsize");
+        ClearDatadirCache();
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+//! Coin database that can store legacy records and shows which rows it holds
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, false, false) {}
+
+    //! Store coins the way older versions did, as one 'c' record
+    void WriteLegacy(const uint256& txid, const CCoins& coins)
+    {
+        db.Write(make_pair('c', txid), coins);
+        LOCK(cs_legacy);
+        fLegacyRecords = true;
+    }
+
+    bool Read(const uint256& txid, CCoins& coins, bool& fLegacy) const
+    {
+        return ReadCoins(txid, coins, fLegacy);
+    }
+
+    bool HasLegacyRow(const uint256& txid) const { return db.Exists(make_pair('c', txid)); }
+    bool HasHeaderRow(const uint256& txid) const { return db.Exists(make_pair('C', txid)); }
+    bool HasBestBlockRow() const { return db.Exists('B'); }
+
+    /**
+     * Leave the database as a flush of hashBlock does when it is stopped after
+     * its first partial batches: the entries of mapPartial and the totals are
+     * written, and the best block is replaced by the marker.
+     */
+    bool WritePartialFlush(CCoinsMap& mapPartial, const uint256& hashBlock)
+    {
+        uint256 hashOld = GetBestBlock();
+        if (!BatchWrite(mapPartial, uint256(0)))
+            return false;
+        CLevelDBBatch batch;
+        batch.Erase('B');
+        batch.Write('H', make_pair(hashBlock, hashOld));
+        return db.WriteBatch(batch);
+    }
+
+    //! Output numbers of the per-output rows stored for txid
+    vector<unsigned int> OutputRows(const uint256& txid) const
+    {
+        vector<unsigned int> vRows;
+        boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper&>(db).NewIterator());
+        CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+        ssKeySet << make_pair('C', txid);
+        for (pcursor->Seek(ssKeySet.str()); pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() < 33 || slKey[0] != 'C' || memcmp(slKey.data() + 1, txid.begin(), 32) != 0)
+                break;
+            if (slKey.size() == 33)
+                continue;
+            CDataStream ssKey(slKey.data() + 33, slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            unsigned int n;
+            ssKey >> VARINT(n);
+            vRows.push_back(n);
+        }
+        return vRows;
+    }
+};
+
+CCoins MakeCoins(int nHeight, unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = nHeight;
+    coins.fCoinStake = nHeight % 2 == 1;
+    coins.nTime = 1500000000 + nHeight;
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = (nHeight + 1) * 100000 + i;
+        coins.vout[i].scriptPubKey = CScript() << vector<unsigned char>(20, (unsigned char)i) << OP_CHECKSIG;
+    }
+    return coins;
+}
+
+uint256 MakeTxid(int n)
+{
+    return Hash(BEGIN(n), END(n));
+}
+
+//! Write a single changed entry the way a flush of the coins cache does
+bool WriteCoins(CCoinsViewDB& db, const uint256& txid, const CCoins& coins, bool fFresh, const uint256& hashBlock)
+{
+    CCoinsMap mapCoins;
+    CCoinsCacheEntry& entry = mapCoins[txid];
+    entry.coins = coins;
+    entry.flags = CCoinsCacheEntry::DIRTY | (fFresh ? CCoinsCacheEntry::FRESH : 0);
+    return db.BatchWrite(mapCoins, hashBlock);
+}
+
+bool SameCoins(const CCoins& a, const CCoins& b)
+{
+    return a == b && a.nTime == b.nTime;
+}
+
+//! Order of the coins keys in the database
+bool CompareTxidKey(const uint256& a, const uint256& b)
+{
+    return memcmp(a.begin(), b.begin(), 32) < 0;
+}
+
+void CheckCursor(const CCoinsViewDB& db, vector<uint256> vTxids, const vector<CCoins>& vCoins)
+{
+    vector<uint256> vSorted(vTxids);
+    sort(vSorted.begin(), vSorted.end(), CompareTxidKey);
+
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor(db.Cursor());
+    size_t nSeen = 0;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        uint256 txid;
+        CCoins coins;
+        BOOST_REQUIRE(pcursor->GetKey(txid));
+        BOOST_REQUIRE(pcursor->GetValue(coins));
+        BOOST_REQUIRE(nSeen < vSorted.size());
+        BOOST_CHECK(txid == vSorted[nSeen]);
+        size_t nIndex = find(vTxids.begin(), vTxids.end(), txid) - vTxids.begin();
+        BOOST_REQUIRE(nIndex < vCoins.size());
+        BOOST_CHECK(SameCoins(coins, vCoins[nIndex]));
+        nSeen++;
+    }
+    BOOST_CHECK_EQUAL(nSeen, vSorted.size());
+}
+
+void CheckStatsEqual(const CCoinsStats& a, const CCoinsStats& b)
+{
+    BOOST_CHECK(a.hashMuHash == b.hashMuHash);
+    BOOST_CHECK_EQUAL(a.nTransactions, b.nTransactions);
+    BOOST_CHECK_EQUAL(a.nTransactionOutputs, b.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(a.nSerializedSize, b.nSerializedSize);
+    BOOST_CHECK_EQUAL(a.nTotalAmount, b.nTotalAmount);
+}
+
+bool ScanStats(const CCoinsViewDB& db, CCoinsStats& stats)
+{
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor(db.Cursor());
+    return db.ScanStats(*pcursor, stats);
+}
+
+//! The running totals must match a full scan of the rows
+void CheckStats(const CCoinsViewDB& db)
+{
+    CCoinsStats stats, statsScan;
+    BOOST_REQUIRE(db.GetStats(stats));
+    BOOST_REQUIRE(ScanStats(db, statsScan));
+    CheckStatsEqual(stats, statsScan);
+}
+
+//! Transaction spending vPrevouts, shaped as a coinstake so its block counts as proof of stake
+CTransaction MakeStakeTx(const vector<COutPoint>& vPrevouts, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.nTime = 1500000000;
+    for (unsigned int i = 0; i < vPrevouts.size(); i++)
+        tx.vin.push_back(CTxIn(vPrevouts[i]));
+    tx.vout.resize(2);
+    tx.vout[0].SetEmpty();
+    tx.vout[1] = CTxOut(nValue, CScript() << OP_TRUE);
+    return tx;
+}
+
+CTransaction MakeCoinbase(int nHeight, unsigned int nOutputs, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.nTime = 1500000000;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << vector<unsigned char>(1, (unsigned char)nHeight) << OP_0;
+    for (unsigned int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut(nValue + i, CScript() << OP_TRUE));
+    return tx;
+}
+
+//! Apply the transactions of a block to view, collecting its undo data
+void ApplyBlock(const CBlock& block, int nHeight, CCoinsViewCache& view, CBlockUndo& blockUndo)
+{
+    CValidationState state;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        CTxUndo txundo;
+        UpdateCoins(block.vtx[i], state, view, txundo, nHeight);
+        if (i > 0)
+            blockUndo.vtxundo.push_back(txundo);
+    }
+}
+
+/**
+ * Block index entry on top of pprev for hash, or for block stored in a block
+ * file of its own, together with its undo data if there is any.
+ */
+CBlockIndex* AddBlockIndex(CBlockIndex* pprev, const uint256& hash, CBlock* pblock = NULL, CBlockUndo* pblockUndo = NULL)
+{
+    CBlockIndex* pindex = pblock ? new CBlockIndex(*pblock) : new CBlockIndex();
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(pblock ? pblock->GetHash() : hash, pindex)).first;
+    pindex->phashBlock = &mi->first;
+    pindex->pprev = pprev;
+    pindex->nHeight = pprev ? pprev->nHeight + 1 : 0;
+    pindex->BuildSkip();
+    if (pblock) {
+        CDiskBlockPos pos(pindex->nHeight * 2 + (pblockUndo ? 0 : 1), 0);
+        BOOST_REQUIRE(WriteBlockToDisk(*pblock, pos));
+        pindex->nFile = pos.nFile;
+        pindex->nDataPos = pos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+        if (pblockUndo) {
+            pos.nPos = 0;
+            BOOST_REQUIRE(pblockUndo->WriteToDisk(pos, pprev->GetBlockHash()));
+            pindex->nUndoPos = pos.nPos;
+            pindex->nStatus |= BLOCK_HAVE_UNDO;
+        }
+    }
+    return pindex;
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(txdb_tests, CoinsDBTestingSetup)
+
+BOOST_AUTO_TEST_CASE(coinsdb_legacy_partial_spend)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = MakeTxid(1);
+    CCoins coins = MakeCoins(10, 4);
+    db.WriteLegacy(txid, coins);
+    uint256 txid2 = MakeTxid(2);
+    CCoins coins2 = MakeCoins(11, 2);
+    db.WriteLegacy(txid2, coins2);
+    BOOST_REQUIRE(db.LoadStats());
+
+    // Spending one output replaces the legacy record by the rows of the others
+    coins.vout[1].SetNull();
+    BOOST_CHECK(WriteCoins(db, txid, coins, false, uint256(1)));
+    BOOST_CHECK(!db.HasLegacyRow(txid));
+    BOOST_CHECK(db.HasHeaderRow(txid));
+    vector<unsigned int> vRows = db.OutputRows(txid);
+    BOOST_REQUIRE_EQUAL(vRows.size(), 3U);
+    BOOST_CHECK_EQUAL(vRows[0], 0U);
+    BOOST_CHECK_EQUAL(vRows[1], 2U);
+    BOOST_CHECK_EQUAL(vRows[2], 3U);
+    CCoins coinsRead;
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(SameCoins(coinsRead, coins));
+    CheckStats(db);
+
+    // Later spends erase exactly the spent rows, the last one all of them
+    coins.vout[3].SetNull();
+    coins.Cleanup();
+    BOOST_CHECK(WriteCoins(db, txid, coins, false, uint256(2)));
+    vRows = db.OutputRows(txid);
+    BOOST_REQUIRE_EQUAL(vRows.size(), 2U);
+    BOOST_CHECK_EQUAL(vRows[0], 0U);
+    BOOST_CHECK_EQUAL(vRows[1], 2U);
+    CheckStats(db);
+
+    coins.vout[0].SetNull();
+    coins.vout[2].SetNull();
+    coins.Cleanup();
+    BOOST_CHECK(WriteCoins(db, txid, coins, false, uint256(3)));
+    BOOST_CHECK(!db.HasHeaderRow(txid));
+    BOOST_CHECK(db.OutputRows(txid).empty());
+    BOOST_CHECK(!db.HaveCoins(txid));
+    CheckStats(db);
+
+    // Spending a legacy record completely leaves no rows at all
+    coins2.vout[0].SetNull();
+    coins2.vout[1].SetNull();
+    coins2.Cleanup();
+    BOOST_CHECK(WriteCoins(db, txid2, coins2, false, uint256(4)));
+    BOOST_CHECK(!db.HasLegacyRow(txid2));
+    BOOST_CHECK(!db.HasHeaderRow(txid2));
+    BOOST_CHECK(db.OutputRows(txid2).empty());
+    CheckStats(db);
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_read_both_layouts)
+{
+    CCoinsViewDBTest db;
+    CCoins coins = MakeCoins(21, 5);
+    coins.vout[0].SetNull();
+    coins.vout[3].SetNull();
+
+    // The same coins once as a legacy record and once in rows
+    uint256 txidLegacy = MakeTxid(1), txidRows = MakeTxid(2);
+    db.WriteLegacy(txidLegacy, coins);
+    BOOST_REQUIRE(db.LoadStats());
+    BOOST_CHECK(WriteCoins(db, txidRows, coins, true, uint256(1)));
+    BOOST_CHECK(db.HasLegacyRow(txidLegacy));
+    BOOST_CHECK(!db.HasLegacyRow(txidRows));
+
+    CCoins coinsLegacy, coinsRows;
+    bool fLegacy;
+    BOOST_CHECK(db.Read(txidLegacy, coinsLegacy, fLegacy));
+    BOOST_CHECK(fLegacy);
+    BOOST_CHECK(db.Read(txidRows, coinsRows, fLegacy));
+    BOOST_CHECK(!fLegacy);
+    BOOST_CHECK(SameCoins(coinsLegacy, coins));
+    BOOST_CHECK(SameCoins(coinsRows, coins));
+    BOOST_CHECK_EQUAL(coinsLegacy.fCoinStake, coinsRows.fCoinStake);
+    BOOST_CHECK_EQUAL(coinsLegacy.vout.size(), coinsRows.vout.size());
+
+    // Once converted, the legacy entry reads the same from its rows
+    uint256 hashNext;
+    BOOST_CHECK_EQUAL(db.UpgradeRecords(COINS_UPGRADE_BATCH_SIZE, hashNext), 1U);
+    BOOST_CHECK(db.Read(txidLegacy, coinsLegacy, fLegacy));
+    BOOST_CHECK(!fLegacy);
+    BOOST_CHECK(SameCoins(coinsLegacy, coins));
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_cursor_interleaved)
+{
+    CCoinsViewDBTest db;
+    vector<uint256> vTxids;
+    vector<CCoins> vCoins;
+    for (int i = 0; i < 40; i++) {
+        vTxids.push_back(MakeTxid(i));
+        vCoins.push_back(MakeCoins(i, 1 + i % 3));
+    }
+
+    // Every other entry stays a legacy record, so the two key ranges interleave by txid
+    for (int i = 0; i < 40; i += 2)
+        db.WriteLegacy(vTxids[i], vCoins[i]);
+    BOOST_REQUIRE(db.LoadStats());
+    CCoinsMap mapCoins;
+    for (int i = 1; i < 40; i += 2) {
+        CCoinsCacheEntry& entry = mapCoins[vTxids[i]];
+        entry.coins = vCoins[i];
+        entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+    }
+    BOOST_CHECK(db.BatchWrite(mapCoins, uint256(1)));
+    CheckCursor(db, vTxids, vCoins);
+
+    // Halfway through the conversion the order stays the same
+    uint256 hashNext;
+    BOOST_CHECK_EQUAL(db.UpgradeRecords(7, hashNext), 7U);
+    CheckCursor(db, vTxids, vCoins);
+
+    while (db.UpgradeRecords(7, hashNext) > 0) {
+    }
+    BOOST_CHECK(!db.HasLegacyRecords());
+    CheckCursor(db, vTxids, vCoins);
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_upgrade_keeps_stats)
+{
+    CCoinsViewDBTest db;
+    vector<uint256> vTxids;
+    vector<CCoins> vCoins;
+    for (int i = 0; i < 30; i++) {
+        vTxids.push_back(MakeTxid(i));
+        vCoins.push_back(MakeCoins(i, 2 + i % 3));
+        if (i % 5 == 0)
+            vCoins.back().vout[0].SetNull();
+        if (i % 3 != 0)
+            db.WriteLegacy(vTxids[i], vCoins[i]);
+    }
+    BOOST_REQUIRE(db.LoadStats());
+    for (int i = 0; i < 30; i += 3)
+        BOOST_CHECK(WriteCoins(db, vTxids[i], vCoins[i], true, uint256(1)));
+    CheckStats(db);
+
+    CCoinsStats statsBefore, statsScanBefore;
+    BOOST_REQUIRE(db.GetStats(statsBefore));
+    BOOST_REQUIRE(ScanStats(db, statsScanBefore));
+    BOOST_CHECK_EQUAL(statsBefore.nTransactions, 30U);
+
+    uint256 hashNext;
+    unsigned int nConverted = 0, n;
+    while ((n = db.UpgradeRecords(4, hashNext)) > 0)
+        nConverted += n;
+    BOOST_CHECK_EQUAL(nConverted, 20U);
+    BOOST_CHECK(!db.HasLegacyRecords());
+    for (int i = 0; i < 30; i++) {
+        BOOST_CHECK(!db.HasLegacyRow(vTxids[i]));
+        BOOST_CHECK(db.HasHeaderRow(vTxids[i]));
+    }
+
+    // Converting changes the layout only: the totals, the set hash and the legacy hash stay
+    CCoinsStats statsAfter, statsScanAfter;
+    BOOST_REQUIRE(db.GetStats(statsAfter));
+    BOOST_REQUIRE(ScanStats(db, statsScanAfter));
+    CheckStatsEqual(statsAfter, statsBefore);
+    CheckStatsEqual(statsScanAfter, statsScanBefore);
+    BOOST_CHECK(statsScanAfter.hashSerialized == statsScanBefore.hashSerialized);
+    BOOST_CHECK(statsAfter.hashBlock == statsBefore.hashBlock);
+}
+
+BOOST_AUTO_TEST_CASE(coinsdb_interrupted_flush)
+{
+    // Every entry goes into a batch of its own
+    mapArgs["-dbbatchsize"] = "1";
+    uint256 hashOld(1), hashNew(2);
+    vector<uint256> vTxids;
+    vector<CCoins> vCoins;
+    for (int i = 0; i < 20; i++) {
+        vTxids.push_back(MakeTxid(i));
+        vCoins.push_back(MakeCoins(i, 2));
+    }
+
+    {
+        CCoinsViewDBTest db;
+        BOOST_REQUIRE(db.LoadStats());
+        CCoinsMap mapCoins;
+        for (int i = 0; i < 10; i++) {
+            CCoinsCacheEntry& entry = mapCoins[vTxids[i]];
+            entry.coins = vCoins[i];
+            entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+        }
+        BOOST_CHECK(db.BatchWrite(mapCoins, hashOld));
+        BOOST_CHECK(db.GetBestBlock() == hashOld);
+        BOOST_CHECK(db.GetHeadBlocks().empty());
+        CheckStats(db);
+
+        // Block hashNew spends entries 0 to 4 and creates 10 to 19; the node stops
+        // after the batches of two of each were written
+        CCoinsMap mapPartial;
+        for (int i = 0; i < 2; i++)
+            mapPartial[vTxids[i]].flags = CCoinsCacheEntry::DIRTY;
+        for (int i = 10; i < 12; i++) {
+            CCoinsCacheEntry& entry = mapPartial[vTxids[i]];
+            entry.coins = vCoins[i];
+            entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+        }
+        BOOST_REQUIRE(db.WritePartialFlush(mapPartial, hashNew));
+    }
+
+    // On the next start, the marker names both blocks and there is no best block
+    CCoinsViewDBTest db;
+    vector<uint256> vHeads = db.GetHeadBlocks();
+    BOOST_REQUIRE_EQUAL(vHeads.size(), 2U);
+    BOOST_CHECK(vHeads[0] == hashNew);
+    BOOST_CHECK(vHeads[1] == hashOld);
+    BOOST_CHECK(!db.HasBestBlockRow());
+    BOOST_CHECK(db.GetBestBlock() == uint256(0));
+    BOOST_REQUIRE(db.LoadStats());
+    CCoinsStats statsHalfway;
+    BOOST_CHECK(db.GetStats(statsHalfway));
+    // The rows belong to no single block, so a full scan refuses them
+    BOOST_CHECK(!ScanStats(db, statsHalfway));
+
+    // Nothing but the block being replayed may be flushed
+    CCoinsMap mapOther;
+    mapOther[vTxids[5]].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(!db.BatchWrite(mapOther, uint256(3)));
+    BOOST_CHECK(db.HaveCoins(vTxids[5]));
+    BOOST_CHECK(db.GetHeadBlocks() == vHeads);
+    BOOST_CHECK(!db.HasBestBlockRow());
+
+    // Replaying hashNew writes all of its changes again, over several batches, and only then drops the marker
+    CCoinsMap mapReplay;
+    for (int i = 0; i < 5; i++)
+        mapReplay[vTxids[i]].flags = CCoinsCacheEntry::DIRTY;
+    for (int i = 10; i < 20; i++) {
+        CCoinsCacheEntry& entry = mapReplay[vTxids[i]];
+        entry.coins = vCoins[i];
+        entry.flags = CCoinsCacheEntry::DIRTY;
+    }
+    BOOST_CHECK(db.BatchWrite(mapReplay, hashNew));
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    BOOST_CHECK(db.HasBestBlockRow());
+    BOOST_CHECK(db.GetBestBlock() == hashNew);
+    for (int i = 0; i < 20; i++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(vTxids[i], coins), i >= 5);
+        if (i >= 5)
+            BOOST_CHECK(SameCoins(coins, vCoins[i]));
+    }
+    CheckStats(db);
+    CCoinsStats stats;
+    BOOST_REQUIRE(db.GetStats(stats));
+    BOOST_CHECK(stats.hashBlock == hashNew);
+    BOOST_CHECK_EQUAL(stats.nTransactions, 15U);
+}
+
+/**
+ * A flush from old tip A2 to new tip B3, on a branch that forks off below it at A1, is
+ * stopped halfway. ReplayBlocks rolls A2 back and B2 and B3 forward over the rows that
+ * were written, some of which already spend what B2 spends.
+ */
+BOOST_AUTO_TEST_CASE(coinsdb_replay_blocks)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    CBlockIndex* pindexGenesis = AddBlockIndex(NULL, uint256(100));
+    CBlockIndex* pindexA1 = AddBlockIndex(pindexGenesis, uint256(101));
+
+    CTransaction txA1 = MakeCoinbase(1, 2, 10 * COIN);
+    CBlock blockA2, blockB2, blockB3;
+    blockA2.hashPrevBlock = blockB2.hashPrevBlock = pindexA1->GetBlockHash();
+    blockA2.vtx.push_back(MakeCoinbase(2, 1, 5 * COIN));
+    blockA2.vtx.push_back(MakeStakeTx(vector<COutPoint>(1, COutPoint(txA1.GetHash(), 0)), 10 * COIN));
+    blockB2.vtx.push_back(MakeCoinbase(2, 1, 6 * COIN));
+    vector<COutPoint> vPrevouts;
+    vPrevouts.push_back(COutPoint(txA1.GetHash(), 0));
+    vPrevouts.push_back(COutPoint(txA1.GetHash(), 1));
+    blockB2.vtx.push_back(MakeStakeTx(vPrevouts, 20 * COIN));
+    blockB3.vtx.push_back(MakeCoinbase(3, 1, 7 * COIN));
+    blockB3.vtx.push_back(MakeStakeTx(vector<COutPoint>(1, COutPoint(blockB2.vtx[1].GetHash(), 1)), 20 * COIN));
+    blockA2.hashMerkleRoot = blockA2.BuildMerkleTree();
+    blockB2.hashMerkleRoot = blockB2.BuildMerkleTree();
+    blockB3.hashPrevBlock = blockB2.GetHash();
+    blockB3.hashMerkleRoot = blockB3.BuildMerkleTree();
+
+    // The coins at either tip, and the undo data of A2
+    CCoinsView viewEmpty;
+    CCoinsViewCache viewOld(&viewEmpty), viewNew(&viewEmpty);
+    CBlockUndo undoA2, undoB2, undoB3;
+    CValidationState state;
+    CTxUndo txundo;
+    UpdateCoins(txA1, state, viewOld, txundo, 1);
+    UpdateCoins(txA1, state, viewNew, txundo, 1);
+    ApplyBlock(blockA2, 2, viewOld, undoA2);
+    ApplyBlock(blockB2, 2, viewNew, undoB2);
+    ApplyBlock(blockB3, 3, viewNew, undoB3);
+
+    CBlockIndex* pindexA2 = AddBlockIndex(pindexA1, uint256(0), &blockA2, &undoA2);
+    CBlockIndex* pindexB2 = AddBlockIndex(pindexA1, uint256(0), &blockB2);
+    CBlockIndex* pindexB3 = AddBlockIndex(pindexB2, uint256(0), &blockB3);
+
+    vector<uint256> vTxids;
+    vTxids.push_back(txA1.GetHash());
+    const CBlock* vpblock[] = {&blockA2, &blockB2, &blockB3};
+    for (unsigned int i = 0; i < 3; i++)
+        BOOST_FOREACH (const CTransaction& tx, vpblock[i]->vtx)
+            vTxids.push_back(tx.GetHash());
+
+    CCoinsViewDBTest db;
+    BOOST_REQUIRE(db.LoadStats());
+    CCoinsMap mapOld;
+    for (unsigned int i = 0; i < 3; i++) {
+        CCoinsCacheEntry& entry = mapOld[vTxids[i]];
+        entry.coins = *viewOld.AccessCoins(vTxids[i]);
+        entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+    }
+    BOOST_REQUIRE(db.BatchWrite(mapOld, pindexA2->GetBlockHash()));
+
+    // Stopped after A1, whose outputs B2 spends, the stake of B2 with the output B3 spends, and the coinbase of B3
+    CCoinsMap mapPartial;
+    mapPartial[txA1.GetHash()].flags = CCoinsCacheEntry::DIRTY;
+    const uint256 vPartial[] = {blockB2.vtx[1].GetHash(), blockB3.vtx[0].GetHash()};
+    for (unsigned int i = 0; i < 2; i++) {
+        CCoinsCacheEntry& entry = mapPartial[vPartial[i]];
+        entry.coins = *viewNew.AccessCoins(vPartial[i]);
+        entry.flags = CCoinsCacheEntry::DIRTY;
+    }
+    BOOST_REQUIRE(db.WritePartialFlush(mapPartial, pindexB3->GetBlockHash()));
+    BOOST_REQUIRE_EQUAL(db.GetHeadBlocks().size(), 2U);
+
+    CCoinsViewCache view(&db);
+    BOOST_CHECK(ReplayBlocks(view));
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    BOOST_CHECK(db.GetBestBlock() == pindexB3->GetBlockHash());
+    BOOST_FOREACH (const uint256& txid, vTxids) {
+        const CCoins* pcoinsNew = viewNew.AccessCoins(txid);
+        bool fHaveNew = pcoinsNew && !pcoinsNew->IsPruned();
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(txid, coins), fHaveNew);
+        if (fHaveNew)
+            BOOST_CHECK(SameCoins(coins, *pcoinsNew));
+    }
+    CheckStats(db);
+
+    CBlockIndex* vpindex[] = {pindexGenesis, pindexA1, pindexA2, pindexB2, pindexB3};
+    for (unsigned int i = 0; i < 5; i++) {
+        mapBlockIndex.erase(vpindex[i]->GetBlockHash());
+        delete vpindex[i];
+    }
+}
+
+//! Rows of a block go away when it is disconnected, and once its height leaves the reorg window
+BOOST_AUTO_TEST_CASE(blocktree_stake_meta)
+{
+    CBlockTreeDB db(1 << 20, true);
+    CTxOut txout(50 * COIN, CScript() << OP_TRUE);
+    for (int nHeight = 1; nHeight <= 3; nHeight++) {
+        std::vector<std::pair<COutPoint, CStakeMetaValue> > vStakeMeta;
+        for (unsigned int n = 0; n < 2; n++)
+            vStakeMeta.push_back(std::make_pair(COutPoint(MakeTxid(nHeight), n), CStakeMetaValue(1000 + nHeight, 2000 + nHeight, txout)));
+        BOOST_REQUIRE(db.WriteStakeMeta(nHeight, vStakeMeta));
+    }
+
+    CStakeMetaValue meta;
+    BOOST_REQUIRE(db.ReadStakeMeta(COutPoint(MakeTxid(2), 1), meta));
+    BOOST_CHECK_EQUAL(meta.nTime, 1002U);
+    BOOST_CHECK_EQUAL(meta.nBlockTime, 2002U);
+    BOOST_CHECK(meta.txout == txout);
+
+    BOOST_CHECK(db.EraseStakeMeta(3));
+    BOOST_CHECK(!db.ReadStakeMeta(COutPoint(MakeTxid(3), 0), meta));
+    BOOST_CHECK(db.EraseStakeMeta(3));
+
+    BOOST_CHECK(db.ExpireStakeMeta(1));
+    BOOST_CHECK(!db.ReadStakeMeta(COutPoint(MakeTxid(1), 0), meta));
+    BOOST_CHECK(!db.ReadStakeMeta(COutPoint(MakeTxid(1), 1), meta));
+    BOOST_CHECK(db.ReadStakeMeta(COutPoint(MakeTxid(2), 0), meta));
+
+    BOOST_CHECK(db.ExpireStakeMeta(std::numeric_limits<int>::max()));
+    BOOST_CHECK(!db.ReadStakeMeta(COutPoint(MakeTxid(2), 0), meta));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -7,16 +7,202 @@
 #include "hash.h"
 #include "main.h"
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+namespace
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+/** Header row of a transaction's coins: everything of CCoins except the outputs */
+class CCoinsDBHeader
+{
+public:
+    int nVersion;
+    bool fCoinBase;
+    bool fCoinStake;
+    int nHeight;
+    unsigned int nTime;
+
+    CCoinsDBHeader() : nVersion(0), fCoinBase(false), fCoinStake(false), nHeight(0), nTime(0) {}
+    CCoinsDBHeader(const CCoins& coins) : nVersion(coins.nVersion), fCoinBase(coins.fCoinBase), fCoinStake(coins.fCoinStake), nHeight(coins.nHeight), nTime(coins.nTime) {}
+
+    void ApplyTo(CCoins& coins) const
+    {
+        coins.nVersion = nVersion;
+        coins.fCoinBase = fCoinBase;
+        coins.fCoinStake = fCoinStake;
+        coins.nHeight = nHeight;
+        coins.nTime = nTime;
+    }
+
+    friend bool operator==(const CCoinsDBHeader& a, const CCoinsDBHeader& b)
+    {
+        return a.nVersion == b.nVersion && a.fCoinBase == b.fCoinBase && a.fCoinStake == b.fCoinStake &&
+               a.nHeight == b.nHeight && a.nTime == b.nTime;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn)
+    {
+        READWRITE(VARINT(this->nVersion));
+        unsigned int nCode = nHeight * 4 + (fCoinStake ? 2 : 0) + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            nHeight = nCode / 4;
+            fCoinStake = (nCode & 2) != 0;
+            fCoinBase = (nCode & 1) != 0;
+        }
+        READWRITE(VARINT(nTime));
+    }
+};
+
+/** Key of one unspent output row, sorting right behind its header row */
+struct CCoinsDBOutputKey {
+    uint256 txid;
+    unsigned int n;
+
+    CCoinsDBOutputKey(const uint256& txidIn, unsigned int nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        char chType = 'C';
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/** Key of the list of outputs a block spent in the stake metadata, big endian so that the rows sort by height */
+struct CStakeMetaHeightKey {
+    int nHeight;
+
+    CStakeMetaHeightKey(int nHeightIn = 0) : nHeight(nHeightIn) {}
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char pchHeight[4];
+        WriteBE32(pchHeight, nHeight);
+        s << 'K' << FLATDATA(pchHeight);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        char chType;
+        unsigned char pchHeight[4];
+        s >> chType >> FLATDATA(pchHeight);
+        nHeight = ReadBE32(pchHeight);
+    }
+};
+
+//! Length of a header key ('C' + txid); output row keys extend it
+const size_t COINS_HEADER_KEY_SIZE = 33;
+
+/**
+ * Read the coins whose header row the iterator points at, together with the
+ * output rows following it, and leave the iterator behind the last row.
+ * Returns false if the iterator is not at the header of txid.
+ */
+bool ReadCoinsRows(leveldb::Iterator* pcursor, const uint256& txid, CCoins& coins)
+{
+    try {
+        if (!pcursor->Valid())
+            return false;
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != COINS_HEADER_KEY_SIZE || slKey[0] != 'C' || memcmp(slKey.data() + 1, txid.begin(), 32) != 0)
+            return false;
+        CCoinsDBHeader header;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> header;
+        coins.vout.clear();
+        header.ApplyTo(coins);
+
+        for (pcursor->Next(); pcursor->Valid(); pcursor->Next()) {
+            slKey = pcursor->key();
+            if (slKey.size() <= COINS_HEADER_KEY_SIZE || slKey[0] != 'C' || memcmp(slKey.data() + 1, txid.begin(), 32) != 0)
+                break;
+            CDataStream ssKey(slKey.data() + COINS_HEADER_KEY_SIZE, slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            unsigned int n;
+            ssKey >> VARINT(n);
+            if (n >= coins.vout.size())
+                coins.vout.resize(n + 1);
+            slValue = pcursor->value();
+            CDataStream ssOut(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssOut >> REF(CTxOutCompressor(coins.vout[n]));
+        }
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+/**
+ * Move the iterator past stray rows to the next entry of the given type: a
+ * header row for 'C', a legacy record for 'c'. Returns false at the end of
+ * that key range.
+ */
+bool SeekCoinsEntry(leveldb::Iterator* pcursor, char chType)
+{
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != chType)
+            return false;
+        //! An output row without a header can only be the leftover of a broken write; skip it
+        if (slKey.size() == COINS_HEADER_KEY_SIZE)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Write the changes between the stored and the new version of a transaction's
+ * coins: only new or changed output rows are written and only spent ones
+ * erased. pcoinsOld is NULL if nothing is stored in the per-output layout.
+ */
+void BatchWriteCoins(CLevelDBBatch& batch, const uint256& txid, const CCoins& coins, const CCoins* pcoinsOld)
+{
+    if (coins.IsPruned()) {
+        if (pcoinsOld) {
+            batch.Erase(make_pair('C', txid));
+            for (unsigned int i = 0; i < pcoinsOld->vout.size(); i++)
+                if (!pcoinsOld->vout[i].IsNull())
+                    batch.Erase(CCoinsDBOutputKey(txid, i));
+        }
+        return;
+    }
+
+    CCoinsDBHeader header(coins);
+    if (!pcoinsOld || !(CCoinsDBHeader(*pcoinsOld) == header))
+        batch.Write(make_pair('C', txid), header);
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut& out = coins.vout[i];
+        bool fHaveOld = pcoinsOld && i < pcoinsOld->vout.size() && !pcoinsOld->vout[i].IsNull();
+        if (out.IsNull()) {
+            if (fHaveOld)
+                batch.Erase(CCoinsDBOutputKey(txid, i));
+        } else if (!fHaveOld || !(pcoinsOld->vout[i] == out)) {
+            batch.Write(CCoinsDBOutputKey(txid, i), CTxOutCompressor(const_cast<CTxOut&>(out)));
+        }
+    }
+    if (pcoinsOld) {
+        for (unsigned int i = coins.vout.size(); i < pcoinsOld->vout.size(); i++)
+            if (!pcoinsOld->vout[i].IsNull())
+                batch.Erase(CCoinsDBOutputKey(txid, i));
+    }
+}
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
@@ -24,18 +210,86 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+/**
+ * Add one coins entry (txid followed by the serialized coins) to the running totals, or take it away
+ * with fRemove. The set hash element goes into muhashBatch; move that into stats.muhash before the
+ * totals are stored.
+ */
+void static UpdateCoinsDBStats(CCoinsDBStats& stats, CMuHash3072Batch& muhashBatch, const uint256& txid, const CCoins& coins, bool fRemove)
 {
+    uint64_t nOutputs = 0;
+    CAmount nAmount = 0;
+    BOOST_FOREACH (const CTxOut& out, coins.vout) {
+        if (!out.IsNull()) {
+            nOutputs++;
+            nAmount += out.nValue;
+        }
+    }
+
+    CDataStream ssElement(SER_DISK, CLIENT_VERSION);
+    ssElement << txid << coins;
+    const unsigned char* pchElement = (const unsigned char*)&ssElement[0];
+    if (fRemove) {
+        stats.nTransactions--;
+        stats.nTransactionOutputs -= nOutputs;
+        stats.nSerializedSize -= ssElement.size();
+        stats.nTotalAmount -= nAmount;
+        muhashBatch.Remove(pchElement, ssElement.size());
+    } else {
+        stats.nTransactions++;
+        stats.nTransactionOutputs += nOutputs;
+        stats.nSerializedSize += ssElement.size();
+        stats.nTotalAmount += nAmount;
+        muhashBatch.Insert(pchElement, ssElement.size());
+    }
+}
+
+/**
+ * Chainstate: point lookups of coins headers that are often missing, and large batched writes when
+ * the coins cache is flushed during initial block download.
+ */
+static const CLevelDBProfile COINS_DB_PROFILE(10, 4096, 35);
+/** Block index: read by scans at startup and the range queries of the address and timestamp indexes */
+static const CLevelDBProfile BLOCK_TREE_DB_PROFILE(10, 16384, 25);
+/** Transaction index: point lookups by txid, and a write per connected block */
+static const CLevelDBProfile TX_INDEX_DB_PROFILE(10, 4096, 35);
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, COINS_DB_PROFILE), fStatsLoaded(false), fLegacyRecords(false)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'c';
+    pcursor->Seek(ssKeySet.str());
+    fLegacyRecords = pcursor->Valid() && pcursor->key().size() > 0 && pcursor->key()[0] == 'c';
+}
+
+bool CCoinsViewDB::ReadCoins(const uint256& txid, CCoins& coins, bool& fLegacy) const
+{
+    //! Legacy first: a concurrent upgrade batch only ever moves a record from there to the new layout
+    fLegacy = HasLegacyRecords() && db.Read(make_pair('c', txid), coins);
+    if (fLegacy)
+        return true;
+    //! The header row goes through the bloom filter, so misses stay cheap
+    if (!db.Exists(make_pair('C', txid)))
+        return false;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator(true));
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('C', txid);
+    pcursor->Seek(ssKeySet.str());
+    return ReadCoinsRows(pcursor.get(), txid, coins);
 }
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    bool fLegacy;
+    return ReadCoins(txid, coins, fLegacy);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    if (HasLegacyRecords() && db.Exists(make_pair('c', txid)))
+        return true;
+    return db.Exists(make_pair('C', txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -46,28 +300,290 @@ uint256 CCoinsViewDB::GetBestBlock() const
     return hashBestChain;
 }
 
+std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const
+{
+    std::pair<uint256, uint256> heads;
+    if (!db.Read('H', heads))
+        return std::vector<uint256>();
+    std::vector<uint256> vHashes;
+    vHashes.push_back(heads.first);
+    vHashes.push_back(heads.second);
+    return vHashes;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
+    LOCK(cs_write);
+    CCoinsDBStats dbstatsNew = dbstats;
+    CMuHash3072Batch muhashBatch;
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
+    size_t nBatchSize = (size_t)GetArg("-dbbatchsize", nDefaultDbBatchSize);
+
+    uint256 hashOld = GetBestBlock();
+    bool fHeads = false;
+    if (hashOld == uint256(0)) {
+        //! Finishing an interrupted flush: the marker stays until this one is complete
+        std::vector<uint256> vHeads = GetHeadBlocks();
+        if (vHeads.size() == 2) {
+            if (hashBlock != vHeads[0])
+                return error("%s : flushing block %s while block %s is being replayed", __func__, hashBlock.ToString(), vHeads[0].ToString());
+            hashOld = vHeads[1];
+            fHeads = true;
+        }
+    }
+    uint256 hashNew = hashBlock != uint256(0) ? hashBlock : hashOld;
+
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            //! The stored version is needed for the row diff and the totals; a fresh entry has none on disk
+            CCoins coinsOld;
+            bool fLegacy = false;
+            bool fHaveOld = !(it->second.flags & CCoinsCacheEntry::FRESH) && ReadCoins(it->first, coinsOld, fLegacy);
+            if (fStatsLoaded) {
+                if (fHaveOld)
+                    UpdateCoinsDBStats(dbstatsNew, muhashBatch, it->first, coinsOld, true);
+                if (!it->second.coins.IsPruned())
+                    UpdateCoinsDBStats(dbstatsNew, muhashBatch, it->first, it->second.coins, false);
+            }
+            //! A legacy record is replaced by the new layout as a whole
+            if (fLegacy)
+                batch.Erase(make_pair('c', it->first));
+            BatchWriteCoins(batch, it->first, it->second.coins, fHaveOld && !fLegacy ? &coinsOld : NULL);
             changed++;
         }
         count++;
         CCoinsMap::iterator itOld = it++;
         mapCoins.erase(itOld);
+
+        if (batch.SizeEstimate() > nBatchSize && it != mapCoins.end()) {
+            //! From the first partial batch on, the coins are a mix of the old and the new best block
+            //! until the last batch is written; a restart replays the blocks in between
+            if (!fHeads && hashNew != uint256(0)) {
+                batch.Erase('B');
+                batch.Write('H', make_pair(hashNew, hashOld));
+                fHeads = true;
+            }
+            //! The totals always describe the rows on disk, so they go into every batch
+            if (fStatsLoaded) {
+                muhashBatch.MoveTo(dbstatsNew.muhash);
+                batch.Write('S', dbstatsNew);
+            }
+            LogPrint("coindb", "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+            if (!db.WriteBatch(batch))
+                return false;
+            dbstats = dbstatsNew;
+            batch.Clear();
+        }
+    }
+    if (hashNew != uint256(0))
+        BatchWriteHashBestChain(batch, hashNew);
+    if (fHeads)
+        batch.Erase('H');
+    //! Without loaded totals the stored ones go stale, and LoadStats recomputes them
+    if (fStatsLoaded) {
+        if (hashNew != uint256(0))
+            dbstatsNew.hashBlock = hashNew;
+        muhashBatch.MoveTo(dbstatsNew.muhash);
+        batch.Write('S', dbstatsNew);
     }
-    if (hashBlock != uint256(0))
-        BatchWriteHashBestChain(batch, hashBlock);
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    if (!db.WriteBatch(batch))
+        return false;
+    dbstats = dbstatsNew;
+    return true;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
+bool CCoinsViewDB::HasLegacyRecords() const
+{
+    LOCK(cs_legacy);
+    return fLegacyRecords;
+}
+
+unsigned int CCoinsViewDB::UpgradeRecords(unsigned int nMax, uint256& hashNext)
+{
+    LOCK(cs_write);
+    if (!HasLegacyRecords())
+        return 0;
+
+    //! Nothing writes legacy records anymore, so everything before hashNext is done
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', hashNext);
+    pcursor->Seek(ssKeySet.str());
+
+    CLevelDBBatch batch;
+    unsigned int nConverted = 0;
+    for (; pcursor->Valid() && nConverted < nMax; pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != 'c')
+            break;
+        uint256 txid;
+        CCoins coins;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> coins;
+        } catch (std::exception& e) {
+            throw std::runtime_error(strprintf("%s : Deserialize or I/O error - %s", __func__, e.what()));
+        }
+        batch.Erase(make_pair('c', txid));
+        BatchWriteCoins(batch, txid, coins, NULL);
+        hashNext = txid;
+        nConverted++;
+    }
+    if (nConverted == 0) {
+        LOCK(cs_legacy);
+        fLegacyRecords = false;
+        return 0;
+    }
+    db.WriteBatch(batch);
+    return nConverted;
+}
+
+void ThreadUpgradeCoinsDB(CCoinsViewDB* pcoinsview)
+{
+    RenameThread("Metrix-coinsupg");
+    if (!pcoinsview->HasLegacyRecords())
+        return;
+
+    LogPrintf("%s: converting the coin database to one row per unspent output\n", __func__);
+    int64_t nStart = GetTimeMillis();
+    uint64_t nConverted = 0;
+    uint256 hashNext;
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+            unsigned int n = pcoinsview->UpgradeRecords(COINS_UPGRADE_BATCH_SIZE, hashNext);
+            if (n == 0)
+                break;
+            nConverted += n;
+            //! Let flushes of the coins cache in between
+            MilliSleep(1);
+        }
+    } catch (boost::thread_interrupted) {
+        LogPrintf("%s: interrupted after %u transactions, continuing on the next start\n", __func__, nConverted);
+        throw;
+    } catch (std::exception& e) {
+        AbortNode(strprintf("%s : %s", __func__, e.what()));
+        return;
+    }
+    LogPrintf("%s: converted %u transactions in %dms\n", __func__, nConverted, GetTimeMillis() - nStart);
+}
+
+CCoinsViewDBCursor* CCoinsViewDB::Cursor() const
+{
+    CCoinsViewDBCursor* pcursor = new CCoinsViewDBCursor(db);
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'C';
+    pcursor->pcursor->Seek(ssKeySet.str());
+    ssKeySet.clear();
+    ssKeySet << 'c';
+    pcursor->pcursorLegacy->Seek(ssKeySet.str());
+    pcursor->ReadEntry();
+    return pcursor;
+}
+
+/* Same const-cast as in GetStats: the cursor only reads. */
+CCoinsViewDBCursor::CCoinsViewDBCursor(const CLevelDBWrapper& dbIn) : db(dbIn), psnapshot(dbIn.GetSnapshot()),
+                                                                       pcursor(const_cast<CLevelDBWrapper&>(dbIn).NewIterator(false, psnapshot)),
+                                                                       pcursorLegacy(const_cast<CLevelDBWrapper&>(dbIn).NewIterator(false, psnapshot)),
+                                                                       fValid(false), fGood(false)
+{
+}
+
+CCoinsViewDBCursor::~CCoinsViewDBCursor()
+{
+    delete pcursor;
+    delete pcursorLegacy;
+    db.ReleaseSnapshot(psnapshot);
+}
+
+void CCoinsViewDBCursor::ReadEntry()
+{
+    fValid = false;
+    fGood = false;
+    bool fHave = SeekCoinsEntry(pcursor, 'C');
+    bool fHaveLegacy = SeekCoinsEntry(pcursorLegacy, 'c');
+    if (!fHave && !fHaveLegacy)
+        return;
+
+    //! Both keys are the type character followed by the raw txid, so compare what follows it
+    int nCmp = 0;
+    if (fHave && fHaveLegacy)
+        nCmp = memcmp(pcursor->key().data() + 1, pcursorLegacy->key().data() + 1, 32);
+    bool fLegacy = !fHave || (fHaveLegacy && nCmp >= 0);
+    memcpy(txid.begin(), (fLegacy ? pcursorLegacy : pcursor)->key().data() + 1, 32);
+    fValid = true;
+
+    if (!fLegacy) {
+        fGood = ReadCoinsRows(pcursor, txid, coins);
+        if (!fGood)
+            pcursor->Next();
+        return;
+    }
+    if (fHave && nCmp == 0) {
+        //! Should not happen, as both are changed in one batch; the legacy record wins, as in ReadCoins
+        CCoins coinsIgnored;
+        if (!ReadCoinsRows(pcursor, txid, coinsIgnored))
+            pcursor->Next();
+    }
+    try {
+        leveldb::Slice slValue = pcursorLegacy->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> coins;
+        fGood = true;
+    } catch (std::exception& e) {
+    }
+    pcursorLegacy->Next();
+}
+
+bool CCoinsViewDBCursor::Valid() const
+{
+    return fValid;
+}
+
+bool CCoinsViewDBCursor::GetKey(uint256& txidOut) const
+{
+    if (!fValid)
+        return false;
+    txidOut = txid;
+    return true;
+}
+
+bool CCoinsViewDBCursor::GetValue(CCoins& coinsOut) const
+{
+    if (!fGood)
+        return false;
+    coinsOut = coins;
+    return true;
+}
+
+void CCoinsViewDBCursor::Next()
+{
+    ReadEntry();
+}
+
+uint256 CCoinsViewDBCursor::GetBestBlock() const
+{
+    uint256 hashBestChain;
+    if (!db.Read('B', hashBestChain, psnapshot))
+        return uint256(0);
+    return hashBestChain;
+}
+
+bool CCoinsViewDBCursor::HasHeadBlocks() const
+{
+    std::pair<uint256, uint256> heads;
+    return db.Read('H', heads, psnapshot);
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, BLOCK_TREE_DB_PROFILE)
 {
 }
 
@@ -112,16 +628,191 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
 
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    leveldb::Iterator* pcursor = const_cast<CLevelDBWrapper*>(&db)->NewIterator();
-    pcursor->SeekToFirst();
+    LOCK(cs_write);
+    if (!fStatsLoaded)
+        return false;
+    stats.hashBlock = dbstats.hashBlock;
+    stats.nTransactions = dbstats.nTransactions;
+    stats.nTransactionOutputs = dbstats.nTransactionOutputs;
+    stats.nSerializedSize = dbstats.nSerializedSize;
+    stats.nTotalAmount = dbstats.nTotalAmount;
+    stats.hashMuHash = dbstats.muhash.Finalize();
+    BlockMap::const_iterator mi = mapBlockIndex.find(stats.hashBlock);
+    if (mi != mapBlockIndex.end())
+        stats.nHeight = mi->second->nHeight;
+    return true;
+}
+
+bool CCoinsViewDB::ScanStats(CCoinsViewDBCursor& cursor, CCoinsStats& stats) const
+{
+    CCoinsDBStats dbstatsScan;
+    return ScanStats(cursor, stats, dbstatsScan);
+}
+
+bool CCoinsViewDB::ScanStats(CCoinsViewDBCursor& cursor, CCoinsStats& stats, CCoinsDBStats& dbstatsOut) const
+{
+    //! Halfway through a flush the rows belong to no single block
+    if (cursor.HasHeadBlocks())
+        return error("%s : the coin database is in the middle of a flush", __func__);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
+    CMuHash3072Batch muhashBatch;
+    stats.hashBlock = cursor.GetBestBlock();
+    dbstatsOut.hashBlock = stats.hashBlock;
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+
+    for (; cursor.Valid(); cursor.Next()) {
+        boost::this_thread::interruption_point();
+        uint256 txhash;
+        CCoins coins;
+        if (!cursor.GetKey(txhash) || !cursor.GetValue(coins))
+            return error("%s : unable to read coins entry", __func__);
+        ss << txhash;
+        ss << VARINT(coins.nVersion);
+        ss << (coins.fCoinBase ? 'c' : 'n');
+        ss << VARINT(coins.nHeight);
+
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            const CTxOut& out = coins.vout[i];
+            if (!out.IsNull()) {
+                ss << VARINT(i + 1);
+                ss << out;
+            }
+        }
+        ss << VARINT(0);
+        UpdateCoinsDBStats(dbstatsOut, muhashBatch, txhash, coins, false);
+    }
+    muhashBatch.MoveTo(dbstatsOut.muhash);
+    stats.nTransactions = dbstatsOut.nTransactions;
+    stats.nTransactionOutputs = dbstatsOut.nTransactionOutputs;
+    stats.nSerializedSize = dbstatsOut.nSerializedSize;
+    stats.nTotalAmount = dbstatsOut.nTotalAmount;
+    stats.hashSerialized = ss.GetHash();
+    stats.hashMuHash = dbstatsOut.muhash.Finalize();
+    return true;
+}
+
+bool CCoinsViewDB::LoadStats()
+{
+    LOCK(cs_write);
+    //! During an interrupted flush the totals were written with every partial batch and still match the rows
+    CCoinsDBStats dbstatsRead;
+    if (db.Read('S', dbstatsRead) && (dbstatsRead.hashBlock == GetBestBlock() || !GetHeadBlocks().empty())) {
+        dbstats = dbstatsRead;
+        fStatsLoaded = true;
+        return true;
+    }
+
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor(Cursor());
+    if (pcursor->HasHeadBlocks()) {
+        //! Left unloaded, the totals are recomputed on the next start after ReplayBlocks
+        LogPrintf("UTXO set statistics are not available until an interrupted flush is replayed\n");
+        return true;
+    }
+    LogPrintf("Computing UTXO set statistics, this may take a while...\n");
+    CCoinsStats stats;
+    CCoinsDBStats dbstatsScan;
+    if (!ScanStats(*pcursor, stats, dbstatsScan))
+        return false;
+    if (!db.Write('S', dbstatsScan))
+        return error("%s : failed to write UTXO set statistics", __func__);
+    dbstats = dbstatsScan;
+    fStatsLoaded = true;
+    LogPrintf("UTXO set statistics: %u transactions, %u outputs, total amount %s\n",
+        dbstats.nTransactions, dbstats.nTransactionOutputs, FormatMoney(dbstats.nTotalAmount));
+    return true;
+}
+
+bool CBlockTreeDB::MoveTxIndex(CTxIndexDB& txindexdb)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 't';
+    pcursor->Seek(ssKeySet.str());
+
+    //! Move in bounded batches, the index can be large
+    uint64_t nMoved = 0;
+    bool fDone = false;
+    while (!fDone) {
+        boost::this_thread::interruption_point();
+        std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+        CLevelDBBatch batch;
+        while (vPos.size() < 10000) {
+            if (!pcursor->Valid()) {
+                fDone = true;
+                break;
+            }
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != 't') {
+                    fDone = true;
+                    break;
+                }
+                uint256 txid;
+                ssKey >> txid;
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                CDiskTxPos pos;
+                ssValue >> pos;
+                vPos.push_back(make_pair(txid, pos));
+                batch.Erase(make_pair('t', txid));
+                pcursor->Next();
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+        if (vPos.empty())
+            break;
+        if (nMoved == 0)
+            LogPrintf("Moving the transaction index to its own database...\n");
+        //! On disk in the new database before the rows go from here, so an interruption only repeats some of them
+        if (!txindexdb.WriteTxIndex(vPos, true) || !WriteBatch(batch))
+            return false;
+        nMoved += vPos.size();
+    }
+    if (nMoved > 0)
+        LogPrintf("Moved %u transaction index entries\n", nMoved);
+    return true;
+}
+
+bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Write(make_pair('a', it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Erase(make_pair('a', it->first));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressIndex(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart, int nEnd)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexIteratorKey(type, hashBytes, nStart > 0 ? nStart : -1));
+    pcursor->Seek(ssKeySet.str());
 
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
@@ -130,52 +821,248 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
+            if (chType != 'a')
+                break;
+            CAddressIndexKey key;
+            ssKey >> key;
+            if (key.type != type || key.hashBytes != hashBytes || (nEnd > 0 && key.blockHeight > nEnd))
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAmount nValue;
+            ssValue >> nValue;
+            vAddressIndex.push_back(std::make_pair(key, nValue));
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressIndexIteratorKey(type, hashBytes));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'u')
+                break;
+            CAddressUnspentKey key;
+            ssKey >> key;
+            if (key.type != type || key.hashBytes != hashBytes)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspent.push_back(std::make_pair(key, value));
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::WipeAddressIndex()
+{
+    const char chPrefixes[] = {'a', 'u'};
+    for (unsigned int i = 0; i < sizeof(chPrefixes); i++) {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+        CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+        ssKeySet << chPrefixes[i];
+        pcursor->Seek(ssKeySet.str());
+
+        //! Erase in bounded batches, the index can be large
+        bool fDone = false;
+        while (!fDone) {
+            boost::this_thread::interruption_point();
+            CLevelDBBatch batch;
+            for (unsigned int nErased = 0; nErased < 10000; nErased++) {
+                if (!pcursor->Valid()) {
+                    fDone = true;
+                    break;
+                }
+                try {
+                    leveldb::Slice slKey = pcursor->key();
+                    CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                    char chType;
+                    ssKey >> chType;
+                    if (chType != chPrefixes[i]) {
+                        fDone = true;
+                        break;
                     }
+                    if (chType == 'a') {
+                        CAddressIndexKey key;
+                        ssKey >> key;
+                        batch.Erase(make_pair(chType, key));
+                    } else {
+                        CAddressUnspentKey key;
+                        ssKey >> key;
+                        batch.Erase(make_pair(chType, key));
+                    }
+                    pcursor->Next();
+                } catch (std::exception& e) {
+                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
+            if (!WriteBatch(batch))
+                return false;
+        }
+    }
+    return EraseAddressIndexProgress();
+}
+
+bool CBlockTreeDB::ReadAddressIndexProgress(int& nHeight)
+{
+    return Read('A', nHeight);
+}
+
+bool CBlockTreeDB::WriteAddressIndexProgress(int nHeight)
+{
+    return Write('A', nHeight);
+}
+
+bool CBlockTreeDB::EraseAddressIndexProgress()
+{
+    return Erase('A');
+}
+
+bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    return Read(make_pair('p', key), value);
+}
+
+bool CBlockTreeDB::WriteTimestampIndex(const std::vector<CTimestampIndexKey>& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<CTimestampIndexKey>::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Write(make_pair('s', *it), '1');
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseTimestampIndex(const std::vector<CTimestampIndexKey>& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<CTimestampIndexKey>::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Erase(make_pair('s', *it));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('s', CTimestampIndexKey(nLow, 0));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 's')
+                break;
+            CTimestampIndexKey key;
+            ssKey >> key;
+            if (key.timestamp > nHigh)
+                break;
+            vHashes.push_back(key.blockHash);
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
+bool CBlockTreeDB::WriteStakeMeta(int nHeight, const std::vector<std::pair<COutPoint, CStakeMetaValue> >& vect)
 {
-    return Read(make_pair('t', txid), pos);
+    CLevelDBBatch batch;
+    std::vector<COutPoint> vOutPoints;
+    vOutPoints.reserve(vect.size());
+    for (std::vector<std::pair<COutPoint, CStakeMetaValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        batch.Write(make_pair('k', it->first), it->second);
+        vOutPoints.push_back(it->first);
+    }
+    batch.Write(CStakeMetaHeightKey(nHeight), vOutPoints);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadStakeMeta(const COutPoint& out, CStakeMetaValue& value)
+{
+    return Read(make_pair('k', out), value);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& vect)
+bool CBlockTreeDB::EraseStakeMeta(int nHeight)
 {
+    std::vector<COutPoint> vOutPoints;
+    if (!Read(CStakeMetaHeightKey(nHeight), vOutPoints))
+        return true;
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vect.begin(); it != vect.end(); it++)
-        batch.Write(make_pair('t', it->first), it->second);
+    for (std::vector<COutPoint>::const_iterator it = vOutPoints.begin(); it != vOutPoints.end(); it++)
+        batch.Erase(make_pair('k', *it));
+    batch.Erase(CStakeMetaHeightKey(nHeight));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ExpireStakeMeta(int nHeight)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CStakeMetaHeightKey(0);
+    pcursor->Seek(ssKeySet.str());
+
+    CLevelDBBatch batch;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() != 5 || slKey[0] != 'K')
+                break;
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            CStakeMetaHeightKey key;
+            ssKey >> key;
+            if (key.nHeight > nHeight)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            std::vector<COutPoint> vOutPoints;
+            ssValue >> vOutPoints;
+            for (std::vector<COutPoint>::const_iterator it = vOutPoints.begin(); it != vOutPoints.end(); it++)
+                batch.Erase(make_pair('k', *it));
+            batch.Erase(key);
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
     return WriteBatch(batch);
 }
 
@@ -266,4 +1153,21 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+CTxIndexDB::CTxIndexDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "txindex", nCacheSize, fMemory, fWipe, TX_INDEX_DB_PROFILE)
+{
+}
+
+bool CTxIndexDB::ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
+{
+    return Read(make_pair('t', txid), pos);
+}
+
+bool CTxIndexDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& vect, bool fSync)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Write(make_pair('t', it->first), it->second);
+    return WriteBatch(batch, fSync);
+}
@@ -9,6 +9,7 @@
 #include "init.h"
 #include "leveldbwrapper.h"
 #include "main.h"
+#include "muhash.h"
 
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 100;
@@ -16,23 +17,144 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -dbbatchsize default (bytes)
+static const int64_t nDefaultDbBatchSize = 16 << 20;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+class CCoinsViewDBCursor;
+
+/**
+ * Running totals over the coin database and a MuHash3072 of its entries
+ * (txid followed by the serialized coins). They are stored next to the best
+ * block and updated in the same batch as the coins themselves.
+ */
+struct CCoinsDBStats {
+    //! Best block of the coin database when these totals were written
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    CMuHash3072 muhash;
+
+    CCoinsDBStats() : hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    }
+};
+
+/** Number of legacy coins records converted per batch by the background upgrade */
+static const unsigned int COINS_UPGRADE_BATCH_SIZE = 2000;
+
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * Every transaction with unspent outputs is stored as a header row
+ * ('C' + txid: version, height, coinbase/coinstake flags and time) followed
+ * by one row per unspent output ('C' + txid + VARINT(n)), so spending an
+ * output erases a single small row instead of rewriting the whole
+ * transaction. Datadirs from older versions still hold one 'c' + txid record
+ * per transaction; those are read as before and converted by
+ * ThreadUpgradeCoinsDB.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
 
+    //! Serializes the writers (BatchWrite, UpgradeRecords) and guards the totals
+    mutable CCriticalSection cs_write;
+    CCoinsDBStats dbstats;
+    bool fStatsLoaded;
+    //! Guards fLegacyRecords on its own, so reads do not wait for a running BatchWrite
+    mutable CCriticalSection cs_legacy;
+    //! Whether legacy per-transaction records may remain; only ever goes from true to false
+    bool fLegacyRecords;
+
+    bool ScanStats(CCoinsViewDBCursor& cursor, CCoinsStats& stats, CCoinsDBStats& dbstatsOut) const;
+    bool ReadCoins(const uint256& txid, CCoins& coins, bool& fLegacy) const;
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
+    std::vector<uint256> GetHeadBlocks() const;
+    //! Writes in batches of at most -dbbatchsize bytes; while the later ones are pending, the best block
+    //! is replaced by a marker naming the old and the new one, see ReplayBlocks
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! Statistics from the running totals, without touching the coins
     bool GetStats(CCoinsStats& stats) const;
+    //! Statistics recomputed from every coins entry the cursor walks, including the legacy hash_serialized.
+    //! Fails if the cursor's snapshot caught an interrupted flush. nHeight is left to the caller.
+    bool ScanStats(CCoinsViewDBCursor& cursor, CCoinsStats& stats) const;
+    //! Load the running totals, recomputing them if they are missing or stale. Call before any BatchWrite.
+    bool LoadStats();
+    //! Return a new cursor over all coins, owned by the caller
+    CCoinsViewDBCursor* Cursor() const;
+    bool HasLegacyRecords() const;
+    //! Convert up to nMax legacy records, starting at txid hashNext and advancing it. Returns the number converted.
+    unsigned int UpgradeRecords(unsigned int nMax, uint256& hashNext);
+    //! The underlying database, for its properties and size estimates
+    const CLevelDBWrapper& GetDB() const { return db; }
+};
+
+/** Convert the legacy records of the coin database in the background */
+void ThreadUpgradeCoinsDB(CCoinsViewDB* pcoinsview);
+
+/**
+ * Walks the coins of a CCoinsViewDB in key order of the txids, merging those
+ * stored per output with any legacy records that were not converted yet, so
+ * the order does not depend on how far ThreadUpgradeCoinsDB got. Both ranges
+ * are read from one snapshot of the database.
+ */
+class CCoinsViewDBCursor
+{
+public:
+    ~CCoinsViewDBCursor();
+
+    //! Whether the cursor points at a coins entry
+    bool Valid() const;
+    bool GetKey(uint256& txid) const;
+    bool GetValue(CCoins& coins) const;
+    void Next();
+    //! The best block and replay marker as of the snapshot, see CCoinsViewDB
+    uint256 GetBestBlock() const;
+    bool HasHeadBlocks() const;
+
+private:
+    CCoinsViewDBCursor(const CLevelDBWrapper& dbIn);
+    CCoinsViewDBCursor(const CCoinsViewDBCursor&);
+    void operator=(const CCoinsViewDBCursor&);
+
+    //! Assemble the entry with the lower txid of the two iterator positions, leaving the iterator behind it
+    void ReadEntry();
+
+    const CLevelDBWrapper& db;
+    const leveldb::Snapshot* psnapshot;
+    //! Over the per-output rows ('C') and the legacy records ('c')
+    leveldb::Iterator* pcursor;
+    leveldb::Iterator* pcursorLegacy;
+    bool fValid;
+    bool fGood;
+    uint256 txid;
+    CCoins coins;
+
+    friend class CCoinsViewDB;
 };
 
+class CTxIndexDB;
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
@@ -51,11 +173,52 @@ public:
     bool WriteLastBlockFile(int nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool& fReindex);
-    bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list);
+    //! Move the transaction index rows older versions kept here to their own database
+    bool MoveTxIndex(CTxIndexDB& txindexdb);
+    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect);
+    bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect);
+    //! Rows with a null value are erased
+    bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect);
+    //! Read the rows of one address between heights nStart and nEnd (0 for no bound)
+    bool ReadAddressIndex(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart = 0, int nEnd = 0);
+    bool ReadAddressUnspentIndex(const uint160& hashBytes, unsigned int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
+    //! Remove every address index row, e.g. after the index was switched off for a while
+    bool WipeAddressIndex();
+    //! Height up to which the background build of the address index got
+    bool ReadAddressIndexProgress(int& nHeight);
+    bool WriteAddressIndexProgress(int nHeight);
+    bool EraseAddressIndexProgress();
+    //! Rows with a null value are erased
+    bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& vect);
+    bool ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+    bool WriteTimestampIndex(const std::vector<CTimestampIndexKey>& vect);
+    bool EraseTimestampIndex(const std::vector<CTimestampIndexKey>& vect);
+    bool ReadTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes);
+    //! Store the stake metadata of the outputs the active chain block at nHeight spent
+    bool WriteStakeMeta(int nHeight, const std::vector<std::pair<COutPoint, CStakeMetaValue> >& vect);
+    bool ReadStakeMeta(const COutPoint& out, CStakeMetaValue& value);
+    //! Drop the stake metadata the block at nHeight wrote, when it gets disconnected
+    bool EraseStakeMeta(int nHeight);
+    //! Drop the stake metadata of all blocks up to nHeight
+    bool ExpireStakeMeta(int nHeight);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
     bool LoadBlockIndexGuts();
 };
 
+/** Access to the transaction index database (blocks/txindex/) */
+class CTxIndexDB : public CLevelDBWrapper
+{
+public:
+    CTxIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    CTxIndexDB(const CTxIndexDB&);
+    void operator=(const CTxIndexDB&);
+
+public:
+    bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list, bool fSync = false);
+};
+
 #endif //! BITCOIN_TXDB_H
\ No newline at end of file
@@ -267,6 +267,12 @@ public:
         return pn[0] | (uint64_t)pn[1] << 32;
     }
 
+    uint64_t Get64(int n = 0) const
+    {
+        assert(WIDTH >= 2 * (n + 1));
+        return pn[2 * n] | (uint64_t)pn[2 * n + 1] << 32;
+    }
+
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
         return sizeof(pn);
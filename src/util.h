@@ -154,6 +154,8 @@ int RaiseFileDescriptorLimit(int nMinFD);
 void AllocateFileRange(FILE* file, unsigned int offset, unsigned int length);
 boost::filesystem::path GetDefaultDataDir(const std::string dirName="metrix");
 const boost::filesystem::path& GetDataDir(bool fNetSpecific = true);
+//! Forget the cached data directories, so the next GetDataDir picks up a changed -datadir
+void ClearDatadirCache();
 boost::filesystem::path GetConfigFile();
 #ifndef WIN32
 boost::filesystem::path GetPidFile();
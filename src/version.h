@@ -18,7 +18,7 @@ static const int DATABASE_VERSION = 70509;
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70004;
+static const int PROTOCOL_VERSION = 70006;
 
 /** initial proto version, to be increased after version/verack negotiation */
 static const int INIT_PROTO_VERSION = 209;
@@ -47,4 +47,10 @@ static const int BIP0031_VERSION = 60000;
 /** "mempool" command, enhanced "getdata" behavior starts with this version */
 static const int MEMPOOL_GD_VERSION = 60002;
 
+/** short-id-based block download ("cmpctblock", "getblocktxn", "blocktxn") starts with this version */
+static const int SHORT_IDS_BLOCKS_VERSION = 70005;
+
+/** "sendheaders" command and announcing blocks with headers starts with this version */
+static const int SENDHEADERS_VERSION = 70006;
+
 #endif // BITCOIN_VERSION_H
\ No newline at end of file